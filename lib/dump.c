@@ -7,21 +7,56 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <ctype.h>
 #include <string.h>
 #include <errno.h>
 
 #include "internal.h"
 
+/*
+ *  With dump.writable set, the dump becomes a simulated bus: the data read
+ *  from the file stay untouched and a device gets a private copy of its
+ *  config space on the first write (copy on write). Writes follow a few
+ *  rules of real hardware, enough to run power management and hot reset
+ *  flows against it:
+ *
+ *    - identification registers and capability headers are read-only,
+ *      status bits are write-one-to-clear;
+ *    - the PMCSR power state follows the last write;
+ *    - setting Secondary Bus Reset in Bridge Control takes the link down
+ *      (Data Link Layer Link Active clears) and the devices behind the
+ *      bridge stop responding; clearing it brings the link back and the
+ *      devices return to their dumped state;
+ *    - Retrain Link reads back as zero and sets Link Bandwidth Management
+ *      Status.
+ *
+ *  When dump.overlay names a file, the copies of modified devices are
+ *  loaded from it at init and written back to it at cleanup, in the same
+ *  format as the dump, so the state carries over between runs.
+ */
+
 struct dump_data {
+  struct dump_data *next;
+  int domain, bus, dev, func;
   int len, allocated;
+  int reset;				/* Held in reset by an upstream bridge */
+  byte *cow;				/* Private copy of data[] once written to */
   byte data[1];
 };
 
+struct dump_access {
+  struct dump_data *first;
+  int writable;
+  int dirty;				/* Overlay differs from the file */
+};
+
 static void
 dump_config(struct pci_access *a)
 {
   pci_define_param(a, "dump.name", "", "Name of the bus dump file to read from");
+  pci_define_param(a, "dump.writable", "0", "Accept writes, keeping the changes in memory");
+  pci_define_param(a, "dump.overlay", "", "File to load modified devices from and save them to");
 }
 
 static int
@@ -31,14 +66,65 @@ dump_detect(struct pci_access *a)
   return name && name[0];
 }
 
-static void
-dump_alloc_data(struct pci_dev *dev, int len)
+static struct dump_data *
+dump_alloc_data(struct pci_access *a, struct dump_data *old, int len)
 {
-  struct dump_data *dd = pci_malloc(dev->access, sizeof(struct dump_data) + len - 1);
+  struct dump_access *da = a->backend_data;
+  struct dump_data *dd = pci_malloc(a, sizeof(struct dump_data) + len - 1);
+  struct dump_data **p;
+
+  memset(dd, 0, sizeof(struct dump_data));
   dd->allocated = len;
-  dd->len = 0;
   memset(dd->data, 0xff, len);
-  dev->aux = dd;
+  if (!old)
+    {
+      dd->next = da->first;
+      da->first = dd;
+      return dd;
+    }
+
+  dd->next = old->next;
+  dd->domain = old->domain;
+  dd->bus = old->bus;
+  dd->dev = old->dev;
+  dd->func = old->func;
+  dd->len = old->len;
+  memcpy(dd->data, old->data, old->allocated);
+  for (p = &da->first; *p != old; p = &(*p)->next)
+    ;
+  *p = dd;
+  pci_mfree(old);
+  return dd;
+}
+
+static struct dump_data *
+dump_find(struct pci_access *a, int domain, int bus, int dev, int func)
+{
+  struct dump_access *da = a->backend_data;
+  struct dump_data *dd;
+
+  for (dd = da->first; dd; dd = dd->next)
+    if (dd->domain == domain && dd->bus == bus && dd->dev == dev && dd->func == func)
+      return dd;
+  return NULL;
+}
+
+/* Config space as currently seen by the device */
+static inline byte *
+dump_cfg(struct dump_data *dd)
+{
+  return dd->cow ? dd->cow : dd->data;
+}
+
+static byte *
+dump_cow(struct pci_access *a, struct dump_data *dd)
+{
+  if (!dd->cow)
+    {
+      dd->cow = pci_malloc(a, dd->allocated);
+      memcpy(dd->cow, dd->data, dd->allocated);
+    }
+  return dd->cow;
 }
 
 static int
@@ -53,19 +139,19 @@ dump_validate(char *s, char *fmt)
   return 1;
 }
 
+/*
+ *  Parse a dump file. For the base dump, every device found is added to the
+ *  bus; for the overlay, the bytes go to the private copy of a device which
+ *  is already known.
+ */
 static void
-dump_init(struct pci_access *a)
+dump_parse(struct pci_access *a, FILE *f, int overlay)
 {
-  char *name = pci_get_param(a, "dump.name");
-  FILE *f;
   char buf[256];
+  struct dump_data *dd = NULL;
   struct pci_dev *dev = NULL;
   int len, mn, bn, dn, fn, i, j;
 
-  if (!name)
-    a->error("dump: File name not given.");
-  if (!(f = fopen(name, "r")))
-    a->error("dump: Cannot open %s: %s", name, strerror(errno));
   while (fgets(buf, sizeof(buf)-1, f))
     {
       char *z = strchr(buf, '\n');
@@ -83,17 +169,29 @@ dump_init(struct pci_access *a)
 	  dump_validate(buf, "####:##:##.# ") && sscanf(buf, "%x:%x:%x.%d", &mn, &bn, &dn, &fn) == 4 ||
 	  dump_validate(buf, "#####:##:##.# ") && sscanf(buf, "%x:%x:%x.%d", &mn, &bn, &dn, &fn) == 4)
 	{
-	  dev = pci_get_dev(a, mn, bn, dn, fn);
-	  dump_alloc_data(dev, 256);
-	  pci_link_dev(a, dev);
+	  if (overlay)
+	    {
+	      if (!(dd = dump_find(a, mn, bn, dn, fn)))
+		a->warning("dump: Overlay device %04x:%02x:%02x.%d is not in the dump", mn, bn, dn, fn);
+	    }
+	  else
+	    {
+	      dev = pci_get_dev(a, mn, bn, dn, fn);
+	      dd = dump_alloc_data(a, NULL, 256);
+	      dd->domain = mn;
+	      dd->bus = bn;
+	      dd->dev = dn;
+	      dd->func = fn;
+	      dev->aux = dd;
+	      pci_link_dev(a, dev);
+	    }
 	}
       else if (!len)
-	dev = NULL;
-      else if (dev &&
+	dd = NULL;
+      else if (dd &&
 	       (dump_validate(buf, "##: ") || dump_validate(buf, "###: ")) &&
 	       sscanf(buf, "%x: ", &i) == 1)
 	{
-	  struct dump_data *dd = dev->aux;
 	  z = strchr(buf, ' ') + 1;
 	  while (isxdigit(z[0]) && isxdigit(z[1]) && (!z[2] || z[2] == ' ') &&
 		 sscanf(z, "%x", &j) == 1 && j < 256)
@@ -103,16 +201,24 @@ dump_init(struct pci_access *a)
 		  fclose(f);
 		  a->error("dump: At most 4096 bytes of config space are supported");
 		}
-	      if (i >= dd->allocated)	/* Need to re-allocate the buffer */
+	      if (overlay)
 		{
-		  dump_alloc_data(dev, 4096);
-		  memcpy(((struct dump_data *) dev->aux)->data, dd->data, 256);
-		  pci_mfree(dd);
-		  dd = dev->aux;
+		  /* Only registers present in the dump can be modified */
+		  if (i < dd->len)
+		    dump_cow(a, dd)[i] = j;
+		  i++;
+		}
+	      else
+		{
+		  if (i >= dd->allocated)	/* Need to re-allocate the buffer */
+		    {
+		      dd = dump_alloc_data(a, dd, 4096);
+		      dev->aux = dd;
+		    }
+		  dd->data[i++] = j;
+		  if (i > dd->len)
+		    dd->len = i;
 		}
-	      dd->data[i++] = j;
-	      if (i > dd->len)
-		dd->len = i;
 	      z += 2;
 	      if (*z)
 		z++;
@@ -127,55 +233,279 @@ dump_init(struct pci_access *a)
   fclose(f);
 }
 
+static int
+dump_find_cap(byte *cfg, int len, int id)
+{
+  int pos, ttl = 48;
+
+  if (len < 0x40 || !(cfg[PCI_STATUS] & PCI_STATUS_CAP_LIST))
+    return 0;
+  pos = cfg[PCI_CAPABILITY_LIST] & ~3;
+  while (pos >= 0x40 && pos + 2 <= len && ttl--)
+    {
+      if (cfg[pos + PCI_CAP_LIST_ID] == id)
+	return pos;
+      pos = cfg[pos + PCI_CAP_LIST_NEXT] & ~3;
+    }
+  return 0;
+}
+
+static int
+dump_is_bridge(byte *cfg, int len)
+{
+  return len >= 0x40 && (cfg[PCI_HEADER_TYPE] & 0x7f) == PCI_HEADER_TYPE_BRIDGE;
+}
+
+/* Hold the devices behind a bridge in reset or let them out of it */
 static void
-dump_cleanup(struct pci_access *a UNUSED)
+dump_reset_secondary(struct pci_access *a, byte *bridge, int domain, int reset)
 {
+  struct dump_access *da = a->backend_data;
+  struct dump_data *dd;
+
+  for (dd = da->first; dd; dd = dd->next)
+    if (dd->domain == domain &&
+	dd->bus >= bridge[PCI_SECONDARY_BUS] && dd->bus <= bridge[PCI_SUBORDINATE_BUS])
+      {
+	dd->reset = reset;
+	if (!reset && dd->cow)
+	  {
+	    pci_mfree(dd->cow);
+	    dd->cow = NULL;
+	    da->dirty = 1;
+	  }
+      }
 }
 
+/* Read-only and write-one-to-clear bits of a config space byte */
 static void
-dump_scan(struct pci_access *a UNUSED)
+dump_byte_masks(byte *cfg, int len, int pos, int *ro, int *w1c)
 {
+  int cap;
+
+  *ro = *w1c = 0;
+  if (pos <= PCI_DEVICE_ID + 1 || pos >= PCI_CLASS_REVISION && pos <= PCI_CLASS_REVISION + 3 ||
+      pos == PCI_HEADER_TYPE || pos == PCI_STATUS)
+    *ro = 0xff;
+  else if (pos == PCI_STATUS + 1)
+    *ro = 0x06, *w1c = 0xf9;
+  else if (cap = dump_find_cap(cfg, len, PCI_CAP_ID_PM), cap && pos >= cap && pos <= cap + PCI_PM_CTRL + 1)
+    {
+      if (pos < cap + PCI_PM_CTRL)
+	*ro = 0xff;
+      else if (pos == cap + PCI_PM_CTRL)
+	*ro = ~PCI_PM_CTRL_STATE_MASK & 0xff;
+      else
+	*ro = PCI_PM_CTRL_DATA_SCALE_MASK >> 8, *w1c = PCI_PM_CTRL_PME_STATUS >> 8;
+    }
+  else if (cap = dump_find_cap(cfg, len, PCI_CAP_ID_EXP), cap && pos >= cap && pos <= cap + PCI_EXP_LNKSTA + 1)
+    {
+      pos -= cap;
+      if (pos < PCI_EXP_DEVCTL || pos >= PCI_EXP_LNKCAP && pos < PCI_EXP_LNKCTL ||
+	  pos == PCI_EXP_DEVSTA + 1 || pos == PCI_EXP_LNKSTA)
+	*ro = 0xff;
+      else if (pos == PCI_EXP_DEVSTA)
+	*ro = 0xf0, *w1c = 0x0f;
+      else if (pos == PCI_EXP_LNKSTA + 1)
+	*ro = 0x3f, *w1c = (PCI_EXP_LNKSTA_BWMGMT | PCI_EXP_LNKSTA_AUTBW) >> 8;
+    }
 }
 
-static int
-dump_read(struct pci_dev *d, int pos, byte *buf, int len)
+static void
+dump_write_cfg(struct pci_access *a, struct dump_data *dd, int pos, byte *buf, int len)
+{
+  byte *cfg = dump_cow(a, dd);
+  int brctl = cfg[PCI_BRIDGE_CONTROL];
+  int exp = dump_find_cap(cfg, dd->len, PCI_CAP_ID_EXP);
+  int i, ro, w1c;
+
+  for (i=0; i<len; i++)
+    {
+      dump_byte_masks(cfg, dd->len, pos + i, &ro, &w1c);
+      cfg[pos + i] = (cfg[pos + i] & ro) | (buf[i] & ~ro & ~w1c) | (cfg[pos + i] & w1c & ~buf[i]);
+    }
+
+  if (exp && pos <= exp + PCI_EXP_LNKCTL && pos + len > exp + PCI_EXP_LNKCTL &&
+      (cfg[exp + PCI_EXP_LNKCTL] & PCI_EXP_LNKCTL_RETRAIN))
+    {
+      /* Training completes at once */
+      cfg[exp + PCI_EXP_LNKCTL] &= ~PCI_EXP_LNKCTL_RETRAIN;
+      cfg[exp + PCI_EXP_LNKSTA + 1] |= PCI_EXP_LNKSTA_BWMGMT >> 8;
+    }
+
+  if (dump_is_bridge(cfg, dd->len) &&
+      ((brctl ^ cfg[PCI_BRIDGE_CONTROL]) & PCI_BRIDGE_CTL_BUS_RESET))
+    {
+      int reset = cfg[PCI_BRIDGE_CONTROL] & PCI_BRIDGE_CTL_BUS_RESET;
+      if (exp)
+	{
+	  if (reset)
+	    cfg[exp + PCI_EXP_LNKSTA + 1] &= ~(PCI_EXP_LNKSTA_DL_ACT >> 8);
+	  else
+	    cfg[exp + PCI_EXP_LNKSTA + 1] |= PCI_EXP_LNKSTA_DL_ACT >> 8;
+	}
+      dump_reset_secondary(a, cfg, dd->domain, reset);
+    }
+  ((struct dump_access *) a->backend_data)->dirty = 1;
+}
+
+static void
+dump_load_overlay(struct pci_access *a, char *name)
 {
+  struct dump_access *da = a->backend_data;
   struct dump_data *dd;
-  if (!(dd = d->aux))
+  FILE *f;
+
+  if (!(f = fopen(name, "r")))
     {
-      struct pci_dev *e = d->access->devices;
-      while (e && (e->domain != d->domain || e->bus != d->bus || e->dev != d->dev || e->func != d->func))
-	e = e->next;
-      if (!e)
-	return 0;
-      dd = e->aux;
+      if (errno != ENOENT)
+	a->error("dump: Cannot open overlay %s: %s", name, strerror(errno));
+      return;
+    }
+  dump_parse(a, f, 1);
+
+  /* Bridges saved with Secondary Bus Reset set still hold their buses in reset */
+  for (dd = da->first; dd; dd = dd->next)
+    if (dd->cow && dump_is_bridge(dd->cow, dd->len) &&
+	(dd->cow[PCI_BRIDGE_CONTROL] & PCI_BRIDGE_CTL_BUS_RESET))
+      dump_reset_secondary(a, dd->cow, dd->domain, 1);
+}
+
+static void
+dump_save_overlay(struct pci_access *a, char *name)
+{
+  struct dump_access *da = a->backend_data;
+  struct dump_data *dd;
+  char *tmp = pci_malloc(a, strlen(name) + 5);
+  FILE *f;
+  int i;
+
+  sprintf(tmp, "%s.tmp", name);
+  if (!(f = fopen(tmp, "w")))
+    {
+      a->warning("dump: Cannot write overlay %s: %s", tmp, strerror(errno));
+      pci_mfree(tmp);
+      return;
+    }
+  for (dd = da->first; dd; dd = dd->next)
+    {
+      if (!dd->cow)
+	continue;
+      fprintf(f, "%04x:%02x:%02x.%d Modified\n", dd->domain, dd->bus, dd->dev, dd->func);
+      for (i=0; i<dd->len; i++)
+	{
+	  if (!(i % 16))
+	    fprintf(f, (dd->len > 256) ? "%03x:" : "%02x:", i);
+	  fprintf(f, " %02x", dd->cow[i]);
+	  if (i % 16 == 15 || i == dd->len - 1)
+	    fputc('\n', f);
+	}
+      fputc('\n', f);
+    }
+  if (fclose(f) || rename(tmp, name))
+    a->warning("dump: Cannot write overlay %s: %s", name, strerror(errno));
+  pci_mfree(tmp);
+}
+
+static void
+dump_init(struct pci_access *a)
+{
+  char *name = pci_get_param(a, "dump.name");
+  char *overlay = pci_get_param(a, "dump.overlay");
+  struct dump_access *da;
+  FILE *f;
+
+  if (!name)
+    a->error("dump: File name not given.");
+  if (!(f = fopen(name, "r")))
+    a->error("dump: Cannot open %s: %s", name, strerror(errno));
+
+  da = pci_malloc(a, sizeof(*da));
+  memset(da, 0, sizeof(*da));
+  da->writable = atoi(pci_get_param(a, "dump.writable"));
+  a->backend_data = da;
+
+  dump_parse(a, f, 0);
+  if (overlay && overlay[0])
+    dump_load_overlay(a, overlay);
+}
+
+static void
+dump_cleanup(struct pci_access *a)
+{
+  struct dump_access *da = a->backend_data;
+  char *overlay = pci_get_param(a, "dump.overlay");
+  struct dump_data *dd, *next;
+
+  if (!da)
+    return;
+  if (da->dirty && overlay && overlay[0])
+    dump_save_overlay(a, overlay);
+  for (dd = da->first; dd; dd = next)
+    {
+      next = dd->next;
+      pci_mfree(dd->cow);
+      pci_mfree(dd);
     }
+  pci_mfree(da);
+  a->backend_data = NULL;
+}
+
+static void
+dump_scan(struct pci_access *a UNUSED)
+{
+}
+
+/* Devices obtained by pci_get_dev() have no aux, look them up */
+static struct dump_data *
+dump_dev_data(struct pci_dev *d)
+{
+  if (d->aux)
+    return d->aux;
+  return dump_find(d->access, d->domain, d->bus, d->dev, d->func);
+}
+
+static int
+dump_read(struct pci_dev *d, int pos, byte *buf, int len)
+{
+  struct dump_data *dd = dump_dev_data(d);
+
+  if (!dd || dd->reset)
+    return 0;
   if (pos + len > dd->len)
     return 0;
-  memcpy(buf, dd->data + pos, len);
+  memcpy(buf, dump_cfg(dd) + pos, len);
   return 1;
 }
 
 static int
-dump_write(struct pci_dev *d UNUSED, int pos UNUSED, byte *buf UNUSED, int len UNUSED)
+dump_write(struct pci_dev *d, int pos, byte *buf, int len)
 {
-  d->access->error("Writing to dump files is not supported.");
-  return 0;
+  struct dump_access *da = d->access->backend_data;
+  struct dump_data *dd;
+
+  if (!da->writable)
+    {
+      d->access->error("Writing to dump files is not supported, set dump.writable to simulate it.");
+      return 0;
+    }
+  if (!(dd = dump_dev_data(d)) || pos + len > dd->len)
+    return 0;
+  if (!dd->reset)			/* Writes to a device in reset are lost */
+    dump_write_cfg(d->access, dd, pos, buf, len);
+  return 1;
 }
 
 static void
 dump_cleanup_dev(struct pci_dev *d)
 {
-  if (d->aux)
-    {
-      pci_mfree(d->aux);
-      d->aux = NULL;
-    }
+  /* The data belong to the dump, they are freed by dump_cleanup() */
+  d->aux = NULL;
 }
 
 struct pci_methods pm_dump = {
   "dump",
-  "Reading of register dumps (set the `dump.name' parameter)",
+  "Reading of register dumps (set the `dump.name' parameter, `dump.writable' to simulate writes)",
   dump_config,
   dump_detect,
   dump_init,
@@ -0,0 +1,356 @@
+/*
+ *	The PCI Library -- Direct Configuration Access via ECAM (MMCONFIG)
+ *
+ *	Copyright (c) 2023 Adnacom, Inc.
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "internal.h"
+
+/*
+ *  The ACPI MCFG table describes one ECAM window per segment group and bus
+ *  range, giving every bus 1 MB and every function 4 KB of configuration
+ *  space. Buses are mapped on first access and stay mapped until cleanup,
+ *  so reads and writes are plain loads and stores.
+ *
+ *  ecam.path normally points to /dev/mem, where the windows live at their
+ *  physical addresses. When it is a regular file, the windows are expected
+ *  back to back in the order of the MCFG table instead, so a file can stand
+ *  in for the hardware.
+ *
+ *  Writing through /dev/mem bypasses the kernel, so this method is never
+ *  probed automatically and has to be selected with -A ecam.
+ */
+
+#define ECAM_BUS_SIZE		(1 << 20)
+#define ECAM_FUNC_SIZE		4096
+#define MCFG_HEADER_LEN		44
+#define MCFG_ENTRY_LEN		16
+
+struct ecam_window {
+  u64 base;				/* Address of start_bus in ecam.path */
+  int domain;
+  int start_bus, end_bus;
+  byte **bus_map;			/* Mapped buses, indexed by bus - start_bus */
+};
+
+struct ecam_access {
+  int fd;
+  int nwindows;
+  struct ecam_window *windows;
+};
+
+static void
+ecam_config(struct pci_access *a)
+{
+  pci_define_param(a, "ecam.mcfg", PCI_PATH_ACPI_MCFG, "Path to the ACPI MCFG table");
+  pci_define_param(a, "ecam.path", PCI_PATH_DEV_MEM, "Path to the memory holding the ECAM windows");
+}
+
+static u64
+ecam_get_le(byte *p, int len)
+{
+  u64 x = 0;
+
+  while (len--)
+    x = (x << 8) | p[len];
+  return x;
+}
+
+/* Returns the number of windows found, 0 if the table is not usable */
+static int
+ecam_read_mcfg(struct pci_access *a, struct ecam_window **windowsp)
+{
+  char *name = pci_get_param(a, "ecam.mcfg");
+  struct ecam_window *w;
+  byte buf[4096];
+  int fd, len, n, i;
+
+  fd = open(name, O_RDONLY);
+  if (fd < 0)
+    {
+      a->debug("...cannot open %s", name);
+      return 0;
+    }
+  len = read(fd, buf, sizeof(buf));
+  close(fd);
+
+  if (len < MCFG_HEADER_LEN || memcmp(buf, "MCFG", 4))
+    {
+      a->debug("...%s is not an MCFG table", name);
+      return 0;
+    }
+  if ((int) ecam_get_le(buf + 4, 4) < len)
+    len = ecam_get_le(buf + 4, 4);
+  n = (len - MCFG_HEADER_LEN) / MCFG_ENTRY_LEN;
+  if (n <= 0)
+    {
+      a->debug("...%s lists no ECAM windows", name);
+      return 0;
+    }
+
+  w = pci_malloc(a, n * sizeof(*w));
+  memset(w, 0, n * sizeof(*w));
+  for (i=0; i<n; i++)
+    {
+      byte *e = buf + MCFG_HEADER_LEN + i * MCFG_ENTRY_LEN;
+      w[i].base = ecam_get_le(e, 8);
+      w[i].domain = ecam_get_le(e + 8, 2);
+      w[i].start_bus = e[10];
+      w[i].end_bus = e[11];
+      if (w[i].end_bus < w[i].start_bus)
+	w[i].end_bus = w[i].start_bus;
+    }
+  *windowsp = w;
+  return n;
+}
+
+static int
+ecam_detect(struct pci_access *a)
+{
+  struct ecam_window *w;
+  char *path = pci_get_param(a, "ecam.path");
+  int n;
+
+  if (!(n = ecam_read_mcfg(a, &w)))
+    return 0;
+  pci_mfree(w);
+  if (access(path, a->writeable ? R_OK | W_OK : R_OK))
+    {
+      a->debug("...cannot open %s", path);
+      return 0;
+    }
+  a->debug("...using %s, %d window(s)", path, n);
+  return 1;
+}
+
+static void
+ecam_init(struct pci_access *a)
+{
+  char *path = pci_get_param(a, "ecam.path");
+  struct ecam_access *e;
+  struct stat st;
+  u64 offset = 0;
+  int is_file, i;
+
+  e = pci_malloc(a, sizeof(*e));
+  memset(e, 0, sizeof(*e));
+  if (!(e->nwindows = ecam_read_mcfg(a, &e->windows)))
+    a->error("ecam: No usable MCFG table at %s", pci_get_param(a, "ecam.mcfg"));
+  e->fd = open(path, a->writeable ? O_RDWR | O_SYNC : O_RDONLY | O_SYNC);
+  if (e->fd < 0 || fstat(e->fd, &st) < 0)
+    a->error("ecam: Cannot open %s: %s", path, strerror(errno));
+  is_file = S_ISREG(st.st_mode);
+
+  for (i=0; i<e->nwindows; i++)
+    {
+      struct ecam_window *w = &e->windows[i];
+      int nbus = w->end_bus - w->start_bus + 1;
+
+      if (is_file)
+	{
+	  /* Windows are stored back to back, drop buses past the end of the file */
+	  w->base = offset;
+	  offset += (u64) nbus * ECAM_BUS_SIZE;
+	  if (w->base + (u64) nbus * ECAM_BUS_SIZE > (u64) st.st_size)
+	    {
+	      nbus = (u64) st.st_size > w->base ? ((u64) st.st_size - w->base) / ECAM_BUS_SIZE : 0;
+	      w->end_bus = w->start_bus + nbus - 1;
+	    }
+	}
+      w->bus_map = pci_malloc(a, (nbus ? nbus : 1) * sizeof(byte *));
+      memset(w->bus_map, 0, (nbus ? nbus : 1) * sizeof(byte *));
+      a->debug("ecam: window %04x:%02x-%02x at %llx", w->domain,
+	       w->start_bus, w->end_bus, (unsigned long long) w->base);
+    }
+  a->backend_data = e;
+}
+
+static void
+ecam_cleanup(struct pci_access *a)
+{
+  struct ecam_access *e = a->backend_data;
+  int i, j;
+
+  if (!e)
+    return;
+  for (i=0; i<e->nwindows; i++)
+    {
+      struct ecam_window *w = &e->windows[i];
+      for (j=0; j <= w->end_bus - w->start_bus; j++)
+	if (w->bus_map[j])
+	  munmap(w->bus_map[j], ECAM_BUS_SIZE);
+      pci_mfree(w->bus_map);
+    }
+  pci_mfree(e->windows);
+  if (e->fd >= 0)
+    close(e->fd);
+  pci_mfree(e);
+  a->backend_data = NULL;
+}
+
+static byte *
+ecam_map_bus(struct pci_access *a, int domain, int bus)
+{
+  struct ecam_access *e = a->backend_data;
+  int i;
+
+  for (i=0; i<e->nwindows; i++)
+    {
+      struct ecam_window *w = &e->windows[i];
+      byte **m;
+      void *map;
+
+      if (w->domain != domain || bus < w->start_bus || bus > w->end_bus)
+	continue;
+      m = &w->bus_map[bus - w->start_bus];
+      if (!*m)
+	{
+	  map = mmap(NULL, ECAM_BUS_SIZE, a->writeable ? PROT_READ | PROT_WRITE : PROT_READ,
+		     MAP_SHARED, e->fd, w->base + (u64) (bus - w->start_bus) * ECAM_BUS_SIZE);
+	  if (map == MAP_FAILED)
+	    {
+	      a->warning("ecam: Cannot map bus %04x:%02x: %s", domain, bus, strerror(errno));
+	      return NULL;
+	    }
+	  *m = map;
+	}
+      return *m;
+    }
+  return NULL;
+}
+
+static volatile byte *
+ecam_addr(struct pci_dev *d, int pos, int len)
+{
+  byte *bus;
+
+  if (pos < 0 || pos + len > ECAM_FUNC_SIZE)
+    return NULL;
+  if (!(bus = ecam_map_bus(d->access, d->domain, d->bus)))
+    return NULL;
+  return bus + (PCI_DEVFN(d->dev, d->func) << 12) + pos;
+}
+
+static void
+ecam_scan(struct pci_access *a)
+{
+  struct ecam_access *e = a->backend_data;
+  int i, bus;
+
+  for (i=0; i<e->nwindows; i++)
+    for (bus = e->windows[i].start_bus; bus <= e->windows[i].end_bus; bus++)
+      {
+	struct pci_dev *t = pci_alloc_dev(a);
+	int multi;
+
+	t->domain = e->windows[i].domain;
+	t->bus = bus;
+	for (t->dev=0; t->dev<32; t->dev++)
+	  {
+	    multi = 0;
+	    for (t->func=0; !t->func || multi && t->func<8; t->func++)
+	      {
+		u32 vd = pci_read_long(t, PCI_VENDOR_ID);
+		struct pci_dev *d;
+
+		if (!vd || vd == 0xffffffff)
+		  continue;
+		if (!t->func)
+		  multi = pci_read_byte(t, PCI_HEADER_TYPE) & 0x80;
+		d = pci_alloc_dev(a);
+		d->domain = t->domain;
+		d->bus = t->bus;
+		d->dev = t->dev;
+		d->func = t->func;
+		d->vendor_id = vd & 0xffff;
+		d->device_id = vd >> 16U;
+		d->known_fields = PCI_FILL_IDENT;
+		pci_link_dev(a, d);
+	      }
+	  }
+	pci_free_dev(t);
+      }
+}
+
+static int
+ecam_read(struct pci_dev *d, int pos, byte *buf, int len)
+{
+  volatile byte *p = ecam_addr(d, pos, len);
+
+  if (!p)
+    return 0;
+
+  switch (len)
+    {
+    case 1:
+      buf[0] = *p;
+      break;
+    case 2:
+      ((u16 *) buf)[0] = *(volatile u16 *) p;
+      break;
+    case 4:
+      ((u32 *) buf)[0] = *(volatile u32 *) p;
+      break;
+    default:
+      return pci_generic_block_read(d, pos, buf, len);
+    }
+  return 1;
+}
+
+static int
+ecam_write(struct pci_dev *d, int pos, byte *buf, int len)
+{
+  volatile byte *p;
+
+  if (!d->access->writeable)
+    {
+      d->access->warning("ecam: Cannot write to %04x:%02x:%02x.%d, access is read-only",
+			 d->domain, d->bus, d->dev, d->func);
+      return 0;
+    }
+  if (!(p = ecam_addr(d, pos, len)))
+    return 0;
+
+  switch (len)
+    {
+    case 1:
+      *p = buf[0];
+      break;
+    case 2:
+      *(volatile u16 *) p = ((u16 *) buf)[0];
+      break;
+    case 4:
+      *(volatile u32 *) p = ((u32 *) buf)[0];
+      break;
+    default:
+      return pci_generic_block_write(d, pos, buf, len);
+    }
+  return 1;
+}
+
+struct pci_methods pm_ecam = {
+  "ecam",
+  "Memory-mapped configuration access (ECAM) using the ACPI MCFG table",
+  ecam_config,
+  ecam_detect,
+  ecam_init,
+  ecam_cleanup,
+  ecam_scan,
+  pci_generic_fill_info,
+  ecam_read,
+  ecam_write,
+  NULL,					/* read_vpd */
+  NULL,					/* init_dev */
+  NULL					/* cleanup_dev */
+};
@@ -143,6 +143,201 @@ pci_filter_match_v33(struct pci_filter *f, struct pci_dev *d)
   return 1;
 }
 
+/*
+ *  Filter sets: many filters matched at once. Each filter is filed under the
+ *  combination of fields it specifies (its pattern) and hashed on the values
+ *  of these fields, so matching a device costs one hash lookup per distinct
+ *  pattern, no matter how many filters there are. Selections by full slot
+ *  or by vendor/device ID use a single pattern each.
+ */
+
+#define FSET_FIELDS 7
+#define FSET_PATTERNS (1 << FSET_FIELDS)
+#define FSET_IDENT 0x30				/* Pattern bits for vendor and device */
+#define FSET_CLASS 0x40
+#define FSET_INIT_BUCKETS 64
+
+struct pci_filter_set_entry {
+  struct pci_filter_set_entry *next;
+  unsigned int pattern, hash;
+  int key[FSET_FIELDS];
+  void *data;
+};
+
+struct pci_filter_set {
+  struct pci_access *access;
+  unsigned int nbuckets, count;
+  struct pci_filter_set_entry **buckets;
+  int npatterns;
+  unsigned int fields;			/* Union of all patterns */
+  unsigned char pattern_seen[FSET_PATTERNS];
+  unsigned int patterns[FSET_PATTERNS];
+};
+
+static void
+fset_key(struct pci_filter *f, int *key)
+{
+  key[0] = f->domain;
+  key[1] = f->bus;
+  key[2] = f->slot;
+  key[3] = f->func;
+  key[4] = f->vendor;
+  key[5] = f->device;
+  key[6] = f->device_class;
+}
+
+static unsigned int
+fset_hash(unsigned int pattern, int *key)
+{
+  unsigned int h = pattern * 0x9e3779b9;
+  int i;
+
+  for (i=0; i<FSET_FIELDS; i++)
+    if (pattern & (1 << i))
+      h = (h ^ (unsigned int) key[i]) * 0x01000193;
+  return h ^ (h >> 15);
+}
+
+static void
+fset_grow(struct pci_filter_set *s)
+{
+  unsigned int n = s->nbuckets * 2, i;
+  struct pci_filter_set_entry **b = pci_malloc(s->access, n * sizeof(*b));
+
+  memset(b, 0, n * sizeof(*b));
+  for (i=0; i<s->nbuckets; i++)
+    while (s->buckets[i])
+      {
+	struct pci_filter_set_entry *e = s->buckets[i];
+	s->buckets[i] = e->next;
+	e->next = b[e->hash & (n - 1)];
+	b[e->hash & (n - 1)] = e;
+      }
+  pci_mfree(s->buckets);
+  s->buckets = b;
+  s->nbuckets = n;
+}
+
+struct pci_filter_set *
+pci_filter_set_new(struct pci_access *a)
+{
+  struct pci_filter_set *s = pci_malloc(a, sizeof(*s));
+
+  memset(s, 0, sizeof(*s));
+  s->access = a;
+  s->nbuckets = FSET_INIT_BUCKETS;
+  s->buckets = pci_malloc(a, s->nbuckets * sizeof(*s->buckets));
+  memset(s->buckets, 0, s->nbuckets * sizeof(*s->buckets));
+  return s;
+}
+
+/* The data pointer is what pci_filter_set_lookup() returns for matching devices */
+void
+pci_filter_set_add(struct pci_filter_set *s, struct pci_filter *f, void *data)
+{
+  struct pci_filter_set_entry *e;
+  unsigned int pattern = 0, hash;
+  int key[FSET_FIELDS], i;
+
+  fset_key(f, key);
+  for (i=0; i<FSET_FIELDS; i++)
+    if (key[i] >= 0)
+      pattern |= 1 << i;
+  hash = fset_hash(pattern, key);
+
+  for (e = s->buckets[hash & (s->nbuckets - 1)]; e; e = e->next)
+    if (e->hash == hash && e->pattern == pattern && !memcmp(e->key, key, sizeof(key)))
+      return;				/* Already there, the first one wins */
+
+  if (s->count >= 2 * s->nbuckets)
+    fset_grow(s);
+  e = pci_malloc(s->access, sizeof(*e));
+  e->pattern = pattern;
+  e->hash = hash;
+  memcpy(e->key, key, sizeof(key));
+  e->data = data;
+  e->next = s->buckets[hash & (s->nbuckets - 1)];
+  s->buckets[hash & (s->nbuckets - 1)] = e;
+  s->count++;
+
+  if (!s->pattern_seen[pattern])
+    {
+      s->pattern_seen[pattern] = 1;
+      s->patterns[s->npatterns++] = pattern;
+      s->fields |= pattern;
+    }
+}
+
+static struct pci_filter_set_entry *
+fset_find(struct pci_filter_set *s, struct pci_dev *d)
+{
+  int key[FSET_FIELDS], i;
+
+  if (s->fields & FSET_IDENT)
+    pci_fill_info_v35(d, PCI_FILL_IDENT);
+  if (s->fields & FSET_CLASS)
+    pci_fill_info(d, PCI_FILL_CLASS);
+
+  key[0] = d->domain;
+  key[1] = d->bus;
+  key[2] = d->dev;
+  key[3] = d->func;
+  key[4] = d->vendor_id;
+  key[5] = d->device_id;
+  key[6] = d->device_class;
+
+  for (i=0; i<s->npatterns; i++)
+    {
+      unsigned int pattern = s->patterns[i];
+      unsigned int hash = fset_hash(pattern, key);
+      struct pci_filter_set_entry *e;
+      int j;
+
+      for (e = s->buckets[hash & (s->nbuckets - 1)]; e; e = e->next)
+	{
+	  if (e->hash != hash || e->pattern != pattern)
+	    continue;
+	  for (j=0; j<FSET_FIELDS; j++)
+	    if ((pattern & (1 << j)) && e->key[j] != key[j])
+	      break;
+	  if (j == FSET_FIELDS)
+	    return e;
+	}
+    }
+  return NULL;
+}
+
+int
+pci_filter_set_match(struct pci_filter_set *s, struct pci_dev *d)
+{
+  return fset_find(s, d) != NULL;
+}
+
+void *
+pci_filter_set_lookup(struct pci_filter_set *s, struct pci_dev *d)
+{
+  struct pci_filter_set_entry *e = fset_find(s, d);
+  return e ? e->data : NULL;
+}
+
+void
+pci_filter_set_free(struct pci_filter_set *s)
+{
+  unsigned int i;
+
+  if (!s)
+    return;
+  for (i=0; i<s->nbuckets; i++)
+    while (s->buckets[i])
+      {
+	struct pci_filter_set_entry *e = s->buckets[i];
+	s->buckets[i] = e->next;
+	pci_mfree(e);
+      }
+  pci_mfree(s->buckets);
+  pci_mfree(s);
+}
+
 /*
  * Before pciutils v3.3, struct pci_filter had fewer fields,
  * so we have to provide compatibility wrappers.
@@ -72,6 +72,11 @@ static struct pci_methods *pci_methods[PCI_ACCESS_MAX] = {
 #else
   NULL,
 #endif
+#ifdef PCI_HAVE_PM_ECAM
+  &pm_ecam,
+#else
+  NULL,
+#endif
 };
 
 // If PCI_ACCESS_AUTO is selected, we probe the access methods in this order
@@ -86,7 +91,7 @@ static int probe_sequence[] = {
   PCI_ACCESS_DARWIN,
   PCI_ACCESS_SYLIXOS_DEVICE,
   PCI_ACCESS_HURD,
-  // Low-level methods poking the hardware directly
+  // Low-level methods poking the hardware directly (ECAM only on request)
   PCI_ACCESS_I386_TYPE1,
   PCI_ACCESS_I386_TYPE2,
   -1,
@@ -43,6 +43,7 @@ enum pci_access_type {
   PCI_ACCESS_DARWIN,			/* Darwin */
   PCI_ACCESS_SYLIXOS_DEVICE,		/* SylixOS pci */
   PCI_ACCESS_HURD,			/* GNU/Hurd */
+  PCI_ACCESS_ECAM,			/* PCIe ECAM via ACPI MCFG table */
   PCI_ACCESS_MAX
 };
 
@@ -82,6 +83,7 @@ struct pci_access {
   int fd_pos;				/* proc/sys: current position */
   int fd_vpd;				/* sys: fd for VPD */
   struct pci_dev *cached_dev;		/* proc/sys: device the fds are for */
+  void *backend_data;			/* Private data of the access method */
 };
 
 /* Initialize PCI access */
@@ -242,6 +244,15 @@ char *pci_filter_parse_slot(struct pci_filter *, char *) PCI_ABI;
 char *pci_filter_parse_id(struct pci_filter *, char *) PCI_ABI;
 int pci_filter_match(struct pci_filter *, struct pci_dev *) PCI_ABI;
 
+/* Sets of filters, matched in constant time per device */
+struct pci_filter_set;
+
+struct pci_filter_set *pci_filter_set_new(struct pci_access *) PCI_ABI;
+void pci_filter_set_add(struct pci_filter_set *, struct pci_filter *, void *data) PCI_ABI;
+int pci_filter_set_match(struct pci_filter_set *, struct pci_dev *) PCI_ABI;
+void *pci_filter_set_lookup(struct pci_filter_set *, struct pci_dev *) PCI_ABI;
+void pci_filter_set_free(struct pci_filter_set *) PCI_ABI;
+
 /*
  *	Conversion of PCI ID's to names (according to the pci.ids file)
  *
@@ -13,19 +13,28 @@
 #include "adna.h"
 #include <stdbool.h>
 #include "eep.h"
+#include "regs.h"
 #include <unistd.h>
 #include <termios.h>
 #include <ctype.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <libgen.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
 
 #include "setpci.h"
 
 #define PLX_VENDOR_ID       (0x10B5)
 #define PLX_H1A_DEVICE_ID   (0x8608)
 #define ADNATOOL_VERSION    "0.0.4"
+#define TUNE_ROLLBACK_FILE  "h1a_tune_rollback.txt"
+#define P2P_ROLLBACK_FILE   "h1a_p2p_rollback.txt"
+#define QOS_DEVICE_RATE     10000   /* --qos status reads per second per device */
+#define QOS_HOST_RATE       40000   /* and over all devices */
 
 /* Options */
 
@@ -48,8 +57,11 @@ static struct eep_options EepOptions;
 struct pci_access *pacc;
 struct device *first_dev = NULL;
 static struct adna_device *first_adna = NULL;
+static struct pci_filter_set *list_set;     /* The -s/-d filter, for the listing */
+static struct pci_filter_set *adna_set;     /* Filters of first_adna, to their adna_device */
 static int seen_errors;
 static int need_topology;
+static bool scan_all;             /* Keep every device, not just Adnacom ones */
 
 struct adnatool_pci_device {
         u16 vid;
@@ -61,6 +73,8 @@ struct adnatool_pci_device {
 
 };
 
+#define PCI_OPTS_MAX  16
+
 struct eep_options {
   bool bVerbose;
   int bLoadFile;
@@ -71,27 +85,73 @@ struct eep_options {
   bool bSerialNumber;
   bool bIsInit;
   bool bIsNotPresent;
+  bool bSoak;
+  bool bModel;
+  bool bStation;
+  bool bStationReset;
+  bool bSlotReset;          /* Reset by slot power cycle rather than SBR */
+  bool bVerify;
+  bool bVerifyReport;
+  bool bVerifyIgnoreSerial;
+  char    VerifyFile[255];
+  int     nPciOpts;
+  struct {
+    int opt;                /* 'A' or 'O' as accepted by parse_generic_option() */
+    char *arg;
+  } PciOpts[PCI_OPTS_MAX];
+  unsigned int SoakCycles;
+  uint32_t SoakStart;
+  uint32_t SoakCount;
+  unsigned int ModelWear;
+  char    SysfsRoot[255];     /* Where sysfs PCI objects live, /sys/bus/pci */
+  bool    bDump;              /* Config space from a -F dump, no BARs or sysfs */
+  char    FakeSysfs[255];
+  int     FakeCount;
+  char    FakeServe[255];
+  char    GenerateFile[255];
+  char    GenerateDir[255];
+  uint32_t GenerateFirst, GenerateLast;
+  bool bGenerateSerials;
+  char    RecordDir[255];
+  uint32_t RecordWindow;      /* Seconds of history in a bundle */
+  uint32_t RecordInterval;    /* Milliseconds between samples */
+  char    MonitorFile[255];
+  uint32_t MonitorInterval;   /* Microseconds between samples */
+  char    QueryFile[255];
+  double  QueryFrom, QueryTo; /* Seconds since the monitor started, -1 for open */
+  bool bQueryChanges;
+  uint32_t WriteRetries;      /* Extra attempts per dword that does not verify */
+  uint32_t RetryBackoff;      /* Milliseconds before the first retry, doubled after */
+  char    TuneProfile[32];
+  char    TuneSave[255];      /* Rollback file written before tuning */
+  char    TuneRollback[255];
+  bool    bForce;             /* Replace an existing rollback file */
+  int     P2pMode;            /* 1 to inspect ACS, 2 to also clear the redirects */
+  char    P2pSave[255];       /* Rollback file written before clearing */
+  char    P2pRestore[255];
+  bool bAuditLinks;
+  bool bBandwidth;
+  int  AspmMode;              /* 1 to check the ASPM latency budget, 2 to apply it */
+  uint32_t AuditTimeout;      /* Milliseconds a retrain may take */
+  bool bAsync;                /* Program all listed H1As at once through eep-job.c */
+  bool bQos;                  /* Paced EEPROM controller polling */
+  uint32_t QosDeviceRate;     /* Status reads per second per device, 0 for no limit */
+  uint32_t QosHostRate;       /* Status reads per second over all devices */
 };
 
 struct adna_device {
   struct adna_device *next;
   struct pci_filter *this, *parent;
+  struct device *dev;  /* Listed device of this */
   bool bIsD3;         /* Power state */
   int devnum;         /* Assigned NumDevice */
+  struct eep_shadow *shadow;  /* EEPROM contents, kept across re-enumeration */
 };
 
 enum { BUFFSZ_BIG = 256, BUFFSZ_SMALL = 32 };
 
 int pci_get_devtype(struct pci_dev *pdev);
-bool pci_is_upstream(struct pci_dev *pdev);
-bool pcidev_is_adnacom(struct pci_dev *p);
-
-void eep_read(struct device *d, uint32_t offset, volatile uint32_t *read_buffer);
-void eep_read_16(struct device *d, uint32_t offset, uint16_t *read_buffer);
-void eep_write(struct device *d, uint32_t offset, uint32_t write_buffer);
-void eep_write_16(struct device *d, uint32_t offset, uint16_t write_buffer);
-void eep_init(struct device *d);
-void eep_erase(struct device *d);
+
 #ifndef ADNA
 static int adnatool_refresh_device_cache(void)
 {
@@ -118,11 +178,25 @@ static int adnatool_refresh_device_cache(void)
 }
 #endif
 
+/* Path of an object below the sysfs PCI root given by --sysfs */
+static void PCI_PRINTF(3, 4) adna_sysfs_path(char *path, size_t pathlen, const char *fmt, ...)
+{
+  va_list args;
+  int n;
+
+  n = snprintf(path, pathlen, "%s/", EepOptions.SysfsRoot);
+  if (n < 0 || (size_t)n >= pathlen)
+    return;
+  va_start(args, fmt);
+  vsnprintf(path + n, pathlen - n, fmt, args);
+  va_end(args);
+}
+
 static void pci_get_remove(struct pci_filter *f, char *path, size_t pathlen)
 {
-  snprintf(path,
+  adna_sysfs_path(path,
           pathlen,
-          "/sys/bus/pci/devices/%04x:%02x:%02x.%d/remove",
+          "devices/%04x:%02x:%02x.%d/remove",
           f->domain,
           f->bus,
           f->slot,
@@ -132,9 +206,9 @@ static void pci_get_remove(struct pci_filter *f, char *path, size_t pathlen)
 
 static void pci_get_res0(struct pci_dev *pdev, char *path, size_t pathlen)
 {
-  snprintf(path, 
+  adna_sysfs_path(path,
           pathlen,
-          "/sys/bus/pci/devices/%04x:%02x:%02x.%d/resource0",
+          "devices/%04x:%02x:%02x.%d/resource0",
           pdev->domain,
           pdev->bus,
           pdev->dev,
@@ -142,7 +216,8 @@ static void pci_get_res0(struct pci_dev *pdev, char *path, size_t pathlen)
   return;
 }
 
-static uint32_t pcimem(struct pci_dev *p, uint32_t reg, uint32_t data)
+/* Read a BAR0 register, or write data to it; zero is a value like any other */
+static uint32_t pcimem(struct pci_dev *p, uint32_t reg, uint32_t data, bool write)
 {
   int fd;
   void *map_base, *virt_addr;
@@ -156,6 +231,10 @@ static uint32_t pcimem(struct pci_dev *p, uint32_t reg, uint32_t data)
   int map_size = 4096UL;
 
   char filename[256] = "\0";
+
+  if (EepOptions.bDump)
+    die("BAR0 of %04x:%02x:%02x.%d is not part of a -F dump, the EEPROM cannot be accessed",
+        p->domain, p->bus, p->dev, p->func);
   pci_get_res0(p, filename, sizeof(filename));
   target = (off_t)reg;
 
@@ -242,7 +321,7 @@ static uint32_t pcimem(struct pci_dev *p, uint32_t reg, uint32_t data)
 
   fflush(stdout);
 
-  if (data)
+  if (write)
   {
     writeval = (uint64_t)data;
     switch (access_type)
@@ -273,16 +352,155 @@ static uint32_t pcimem(struct pci_dev *p, uint32_t reg, uint32_t data)
   if (munmap(map_base, map_size) == -1)
     PRINT_ERROR;
   close(fd);
-  return (data ? 0 : (uint32_t)read_result);
+  return (write ? 0 : (uint32_t)read_result);
+}
+
+static uint32_t eep_hw_read(struct device *d, uint32_t reg)
+{
+  d->poll.reads++;
+  if (d->bar0)
+    return d->bar0[reg / 4];
+  return pcimem(d->dev, reg, 0, false);
+}
+
+static void eep_hw_write(struct device *d, uint32_t reg, uint32_t data)
+{
+  if (d->bar0)
+    d->bar0[reg / 4] = data;
+  else
+    pcimem(d->dev, reg, data, true);
+}
+
+#define EEP_BAR0_MIN_SIZE   (4096)          /* The EEPROM registers are in the first page */
+
+/*
+ * Keep BAR0 mapped for a batch of accesses instead of mapping it per
+ * register. The whole resource is mapped, the recorder dumps all of it.
+ */
+bool eep_hw_map(struct device *d)
+{
+  char filename[BUFFSZ_BIG];
+  struct stat st;
+  void *map;
+  int fd;
+
+  if (eep_backend != &eep_hw_methods || d->bar0 || EepOptions.bDump)
+    return false;
+
+  pci_get_res0(d->dev, filename, sizeof(filename));
+  if ((fd = open(filename, O_RDWR | O_SYNC)) == -1)
+    return false;
+  if (fstat(fd, &st) || st.st_size < EEP_BAR0_MIN_SIZE) {
+    close(fd);
+    return false;
+  }
+  map = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return false;
+  d->bar0 = map;
+  d->bar0_size = st.st_size;
+  return true;
+}
+
+void eep_hw_unmap(struct device *d)
+{
+  if (d->bar0)
+    munmap((void *)d->bar0, d->bar0_size);
+  d->bar0 = NULL;
+  d->bar0_size = 0;
+}
+
+struct eep_methods eep_hw_methods = {
+  "bar0",
+  eep_hw_read,
+  eep_hw_write
+};
+
+struct eep_methods *eep_backend = &eep_hw_methods;
+
+/*
+ * QoS polling (--qos). Every status read is a non-posted read across the
+ * fabric, competing with the traffic of the other devices under the same
+ * root port. Instead of spinning, sleep until a little before the time the
+ * command in flight took on average so far, then poll no faster than the
+ * per-device and host-wide rates. The controller is not polled at all
+ * before a command when it was last seen idle and nothing was sent since.
+ */
+#define QOS_EARLY(ns)       ((ns) - (ns) / 8)   /* Wake before the expected finish */
+
+static u64 qos_host_next;   /* Earliest time of the next status read on the host */
+
+/* Wait for a read slot of the device and of the host, shared by all threads */
+static void qos_pace(struct device *d)
+{
+    u64 now = monotonic_ns(), slot, next;
+
+    if (EepOptions.QosDeviceRate && d->poll.last_ns)
+        sleep_until(d->poll.last_ns + 1000000000ULL / EepOptions.QosDeviceRate);
+    if (EepOptions.QosHostRate) {
+        now = monotonic_ns();
+        slot = __atomic_load_n(&qos_host_next, __ATOMIC_RELAXED);
+        do {
+            next = ((slot > now) ? slot : now) + 1000000000ULL / EepOptions.QosHostRate;
+        } while (!__atomic_compare_exchange_n(&qos_host_next, &slot, next, false,
+                                              __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        sleep_until(next - 1000000000ULL / EepOptions.QosHostRate);
+    }
+    d->poll.last_ns = monotonic_ns();
+}
+
+/* Write a command to the controller, noting when for check_for_ready_or_done() */
+static void eep_command(struct device *d, uint32_t cmd)
+{
+    eep_reg_write(d, EEP_STAT_N_CTRL_ADDR, cmd);
+    d->poll.cmd = eep_cmd_get(cmd);
+    d->poll.issued_ns = monotonic_ns();
+    d->poll.pending = true;
+    d->poll.idle = false;
 }
 
 static void check_for_ready_or_done(struct device *d)
 {
     volatile uint32_t eepCmdStatus = EEP_CMD_STAT_MAX;
-    do {
-        for (volatile int delay = 0; delay < 10000; delay++) {}
-        eepCmdStatus = ((pcimem(d->dev, EEP_STAT_N_CTRL_ADDR, 0)) >> EEP_CMD_STATUS_OFFSET) & 1;
-    } while (CMD_COMPLETE != eepCmdStatus);
+    struct eep_poll *p = &d->poll;
+    u64 est = p->pending ? p->est_ns[p->cmd] : 0, busy = 0;
+
+    if (EepOptions.bQos && p->idle)
+        return;
+    if (EepOptions.bQos && est)
+        sleep_until(p->issued_ns + QOS_EARLY(est));
+    for (;;) {
+        if (EepOptions.bQos)
+            qos_pace(d);
+        else
+            for (volatile int delay = 0; delay < 10000; delay++) {}
+        eepCmdStatus = eep_cmd_status_get(eep_reg_read(d, EEP_STAT_N_CTRL_ADDR));
+        if (CMD_COMPLETE == eepCmdStatus)
+            break;
+        busy = monotonic_ns();
+    }
+
+    /*
+     * Running average of the time to completion, weighted to recent
+     * commands. It finished between the last busy read and this one; if
+     * the first read after the sleep found it done, it may have been done
+     * well before, so aim a little earlier next time.
+     */
+    if (p->pending) {
+        u64 now = monotonic_ns(), took;
+
+        if (busy)
+            took = busy + (now - busy) / 2 - p->issued_ns;
+        else if (est)
+            took = QOS_EARLY(est);
+        else
+            took = now - p->issued_ns;
+
+        p->est_ns[p->cmd] = est ? (3 * est + took) / 4 : took;
+        p->pending = false;
+    }
+    p->idle = true;
     if (EepOptions.bVerbose)
         printf("Controller is ready\n");
 }
@@ -292,130 +510,177 @@ static void eep_data(struct device *d, uint32_t cmd, volatile uint32_t *buffer)
     if (EepOptions.bVerbose)
         printf("  EEPROM Control: 0x%08x\n", cmd);
     check_for_ready_or_done(d);
-    pcimem(d->dev, EEP_STAT_N_CTRL_ADDR, cmd);
+    eep_command(d, cmd);
     check_for_ready_or_done(d);
 
-    if (RD_4B_FR_BLKADDR_TO_BUFF == ((cmd >> EEP_CMD_OFFSET) & 0x7)) {
-        *buffer = pcimem(d->dev, EEP_BUFFER_ADDR, 0);
+    if (RD_4B_FR_BLKADDR_TO_BUFF == eep_cmd_get(cmd)) {
+        *buffer = eep_reg_read(d, EEP_BUFFER_ADDR);
         if (EepOptions.bVerbose)
             printf("Read buffer: 0x%08x\n", *buffer);
     }
     check_for_ready_or_done(d);
 }
 
-void eep_read(struct device *d, uint32_t offset, volatile uint32_t *read_buffer)
+struct eep_shadow *eep_shadow_new(void)
+{
+    struct eep_shadow *s = xmalloc(sizeof(*s));
+
+    eep_shadow_invalidate(s);
+    return s;
+}
+
+void eep_shadow_invalidate(struct eep_shadow *s)
+{
+    memset(s->valid, 0, sizeof(s->valid));
+}
+
+static inline bool eep_shadow_get(struct device *d, uint32_t offset, uint32_t *value)
+{
+    struct eep_shadow *s = d->shadow;
+
+    if (!s || offset >= EEP_MAX_DWORDS || !(s->valid[offset / 32] & (1U << (offset % 32))))
+        return false;
+    *value = s->data[offset];
+    return true;
+}
+
+static inline void eep_shadow_set(struct device *d, uint32_t offset, uint32_t value)
 {
-    union eep_status_and_control_reg ctrl_reg = {0};
-    // Section 6.8.2 step#2
-    ctrl_reg.cmd_n_status_struct.cmd = RD_4B_FR_BLKADDR_TO_BUFF;
-    ctrl_reg.cmd_n_status_struct.blk_addr = offset;
-    // Section 6.8.2 step#3 and step#4
-    eep_data(d, ctrl_reg.cmd_u32, read_buffer);
+    struct eep_shadow *s = d->shadow;
+
+    if (!s || offset >= EEP_MAX_DWORDS)
+        return;
+    s->data[offset] = value;
+    s->valid[offset / 32] |= 1U << (offset % 32);
+}
+
+/* Always reads the EEPROM, for checking what a write really left there */
+uint32_t eep_read_uncached(struct device *d, uint32_t offset)
+{
+    uint32_t value = 0;
+
+    // Section 6.8.2 step#2 to step#4
+    eep_data(d, EEP_COMMAND(RD_4B_FR_BLKADDR_TO_BUFF, offset), &value);
+    eep_shadow_set(d, offset, value);
     fflush(stdout);
+    return value;
+}
+
+void eep_read(struct device *d, uint32_t offset, volatile uint32_t *read_buffer)
+{
+    uint32_t value;
+
+    if (!eep_shadow_get(d, offset, &value))
+        value = eep_read_uncached(d, offset);
+    *read_buffer = value;
+}
+
+/*
+ * Read a run of dwords for dump and verify. The controller is idle after
+ * each buffer read, so every dword needs a single completion wait instead
+ * of the three done by eep_data().
+ */
+void eep_read_range(struct device *d, uint32_t offset, uint32_t count, uint32_t *buffer)
+{
+    bool mapped = false, ready = false;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (eep_shadow_get(d, offset + i, &buffer[i]))
+            continue;
+        if (!ready) {
+            mapped = eep_hw_map(d);
+            check_for_ready_or_done(d);
+            ready = true;
+        }
+        eep_command(d, EEP_COMMAND(RD_4B_FR_BLKADDR_TO_BUFF, offset + i));
+        check_for_ready_or_done(d);
+        buffer[i] = eep_reg_read(d, EEP_BUFFER_ADDR);
+        eep_shadow_set(d, offset + i, buffer[i]);
+    }
+    if (mapped)
+        eep_hw_unmap(d);
 }
 
 void eep_read_16(struct device *d, uint32_t offset, uint16_t *read_buffer)
 {
-    union eep_status_and_control_reg ctrl_reg = {0};
     uint32_t buffer_32 = 0;
 
-    ctrl_reg.cmd_n_status_struct.cmd = RD_4B_FR_BLKADDR_TO_BUFF;
-    ctrl_reg.cmd_n_status_struct.blk_addr = offset;
-    eep_data(d, ctrl_reg.cmd_u32, &buffer_32);
+    eep_read(d, offset, &buffer_32);
 
     *read_buffer = (buffer_32 & 0xFFFFFFFF);
-    fflush(stdout);
 }
 
 void eep_write(struct device *d, uint32_t offset, uint32_t write_buffer)
 {
-    union eep_status_and_control_reg ctrl_reg = {0};
 
     // Section 6.8.1 step#2
     check_for_ready_or_done(d);
-    pcimem(d->dev, EEP_BUFFER_ADDR, write_buffer);
+    eep_reg_write(d, EEP_BUFFER_ADDR, write_buffer);
     check_for_ready_or_done(d);
     // Section 6.8.1 step#3
-    ctrl_reg.cmd_n_status_struct.cmd = SET_WR_EN_LATCH;
     check_for_ready_or_done(d);
-    pcimem(d->dev, EEP_STAT_N_CTRL_ADDR, ctrl_reg.cmd_u32);
+    eep_command(d, EEP_COMMAND(SET_WR_EN_LATCH, 0));
     check_for_ready_or_done(d);
     // Section 6.8.1 step#4
-    ctrl_reg.cmd_n_status_struct.cmd = WR_4B_FR_BUFF_TO_BLKADDR;
-    ctrl_reg.cmd_n_status_struct.blk_addr = offset;
-    eep_data(d, ctrl_reg.cmd_u32, NULL);
+    eep_data(d, EEP_COMMAND(WR_4B_FR_BUFF_TO_BLKADDR, offset), NULL);
+    eep_shadow_set(d, offset, write_buffer);
 
     fflush(stdout);
 }
 
 void eep_write_16(struct device *d, uint32_t offset, uint16_t write_buffer)
 {
-    union eep_status_and_control_reg ctrl_reg = {0};
     uint32_t buffer_32 = 0xffff0000 | (uint32_t)write_buffer; // set the 16bit MSB side to 0xffff (so write won't be ignored)
 
     // Section 6.8.1 step#2
     check_for_ready_or_done(d);
-    pcimem(d->dev, EEP_BUFFER_ADDR, buffer_32);
+    eep_reg_write(d, EEP_BUFFER_ADDR, buffer_32);
     check_for_ready_or_done(d);
     // Section 6.8.1 step#3
-    ctrl_reg.cmd_n_status_struct.cmd = SET_WR_EN_LATCH;
     check_for_ready_or_done(d);
-    pcimem(d->dev, EEP_STAT_N_CTRL_ADDR, ctrl_reg.cmd_u32);
+    eep_command(d, EEP_COMMAND(SET_WR_EN_LATCH, 0));
     check_for_ready_or_done(d);
     // Section 6.8.1 step#4
-    ctrl_reg.cmd_n_status_struct.cmd = WR_4B_FR_BUFF_TO_BLKADDR;
-    ctrl_reg.cmd_n_status_struct.blk_addr = offset;
-    eep_data(d, ctrl_reg.cmd_u32, NULL);
+    eep_data(d, EEP_COMMAND(WR_4B_FR_BUFF_TO_BLKADDR, offset), NULL);
+    eep_shadow_set(d, offset, buffer_32);
 
     fflush(stdout);
 }
 
 void eep_init(struct device *d)
 {
-    union eep_status_and_control_reg ctrl_reg = {0};
     uint32_t init_buffer = 0x0000005a;
 
     // Section 6.8.3 step#2
     check_for_ready_or_done(d);
-    pcimem(d->dev, EEP_BUFFER_ADDR, init_buffer);
+    eep_reg_write(d, EEP_BUFFER_ADDR, init_buffer);
     check_for_ready_or_done(d);
     // Section 6.8.3 step#3
-    ctrl_reg.cmd_n_status_struct.cmd = SET_WR_EN_LATCH;
-    ctrl_reg.cmd_n_status_struct.addr_width_override = ADDR_WIDTH_WRITABLE;
-    ctrl_reg.cmd_n_status_struct.addr_width = TWO_BYTES;
     check_for_ready_or_done(d);
-    pcimem(d->dev, EEP_STAT_N_CTRL_ADDR, ctrl_reg.cmd_u32);
+    eep_command(d, EEP_COMMAND_WIDTH(SET_WR_EN_LATCH));
     check_for_ready_or_done(d);
     // Section 6.8.3 step#4
-    ctrl_reg.cmd_n_status_struct.cmd = WR_4B_FR_BUFF_TO_BLKADDR;
-    ctrl_reg.cmd_n_status_struct.addr_width_override = ADDR_WIDTH_WRITABLE;
-    ctrl_reg.cmd_n_status_struct.addr_width = TWO_BYTES;
-    eep_data(d, ctrl_reg.cmd_u32, NULL);
+    eep_data(d, EEP_COMMAND_WIDTH(WR_4B_FR_BUFF_TO_BLKADDR), NULL);
+    eep_shadow_set(d, 0, init_buffer);
 
     fflush(stdout);
 }
 
 void eep_erase(struct device *d)
 {
-    union eep_status_and_control_reg ctrl_reg = {0};
     uint32_t init_buffer = 0xffffffff;
 
     // Section 6.8.3 step#2
     check_for_ready_or_done(d);
-    pcimem(d->dev, EEP_BUFFER_ADDR, init_buffer);
+    eep_reg_write(d, EEP_BUFFER_ADDR, init_buffer);
     check_for_ready_or_done(d);
     // Section 6.8.3 step#3
-    ctrl_reg.cmd_n_status_struct.cmd = SET_WR_EN_LATCH;
-    ctrl_reg.cmd_n_status_struct.addr_width_override = ADDR_WIDTH_WRITABLE;
-    ctrl_reg.cmd_n_status_struct.addr_width = TWO_BYTES;
     check_for_ready_or_done(d);
-    pcimem(d->dev, EEP_STAT_N_CTRL_ADDR, ctrl_reg.cmd_u32);
+    eep_command(d, EEP_COMMAND_WIDTH(SET_WR_EN_LATCH));
     check_for_ready_or_done(d);
     // Section 6.8.3 step#4
-    ctrl_reg.cmd_n_status_struct.cmd = WR_4B_FR_BUFF_TO_BLKADDR;
-    ctrl_reg.cmd_n_status_struct.addr_width_override = ADDR_WIDTH_WRITABLE;
-    ctrl_reg.cmd_n_status_struct.addr_width = TWO_BYTES;
-    eep_data(d, ctrl_reg.cmd_u32, NULL);
+    eep_data(d, EEP_COMMAND_WIDTH(WR_4B_FR_BUFF_TO_BLKADDR), NULL);
+    eep_shadow_set(d, 0, init_buffer);
 
     fflush(stdout);
 }
@@ -482,10 +747,10 @@ struct device *scan_device(struct pci_dev *p)
 
   if (p->domain && !opt_domains)
     opt_domains = 1;
-  if (!pci_filter_match(&filter, p) && !need_topology)
+  if (!pci_filter_set_match(list_set, p) && !need_topology)
     return NULL;
 
-  if (!pcidev_is_adnacom(p))
+  if (!scan_all && !pcidev_is_adnacom(p))
     return NULL;
 
   d = xmalloc(sizeof(struct device));
@@ -1057,6 +1322,8 @@ static void show_verbose(struct device *d)
     show_htype2(d);
     break;
   }
+  if (opt_kernel)
+    show_kernel(d);
   printf("\n");
 }
 
@@ -1182,34 +1449,86 @@ void show_device(struct device *d)
     putchar('\n');
 }
 
+static struct pci_access *adna_pacc_alloc(void);
+
 static void show(void)
 {
-  struct device *d;
+  struct device *d, **devs;
+  int cnt = 0;
+
+  /* Other methods share I/O ports or state between access structures */
+  if (pacc->method != PCI_ACCESS_SYS_BUS_PCI) {
+    for (d=first_dev; d; d=d->next)
+      if (pci_filter_set_match(list_set, d->dev))
+        show_verbose(d);
+    return;
+  }
 
   for (d=first_dev; d; d=d->next)
-    if (pci_filter_match(&filter, d->dev))
-      show_verbose(d);
+    cnt++;
+  devs = xmalloc((cnt + 1) * sizeof(*devs));
+  cnt = 0;
+  for (d=first_dev; d; d=d->next)
+    if (pci_filter_set_match(list_set, d->dev))
+      devs[cnt++] = d;
+  list_devices(devs, cnt, show_verbose, adna_pacc_alloc);
+  free(devs);
 }
 
-/*! @brief Removes the H1A downstream port */
-static void adna_remove_downstream(struct pci_filter *f)
+/*! @brief Removes the H1A downstream port, EXIT_FAILURE if sysfs refused */
+int adna_remove_downstream(struct pci_filter *f)
 {
   char filename[256] = "\0";
   int dsfd, res;
+
+  /* A dump has no sysfs, and the one of this machine must not be touched */
+  if (EepOptions.bDump) {
+    printf("Dump mode: not removing %04x:%02x:%02x.%d from sysfs\n",
+           f->domain, f->bus, f->slot, f->func);
+    return EXIT_SUCCESS;
+  }
   pci_get_remove(f, filename, sizeof(filename));
-  if((dsfd = open(filename, O_WRONLY )) == -1) PRINT_ERROR;
-  if((res = write( dsfd, "1", 1 )) == -1) PRINT_ERROR;
+  if ((dsfd = open(filename, O_WRONLY)) == -1) {
+    printf("ERROR: Unable to open \"%s\" (%s)\n", filename, strerror(errno));
+    return EXIT_FAILURE;
+  }
+  res = write(dsfd, "1", 1);
+  if (res == -1)
+    printf("ERROR: Unable to write \"%s\" (%s)\n", filename, strerror(errno));
   close(dsfd);
+  return (res == -1) ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
-/*! @brief Rescans the pci bus */
-static void adna_rescan_pci(void)
+/*! @brief Rescans the pci bus, EXIT_FAILURE if sysfs refused */
+int adna_rescan_pci(void)
 {
+    char filename[BUFFSZ_BIG];
     int scanfd, res;
-    if((scanfd = open("/sys/bus/pci/rescan", O_WRONLY )) == -1) PRINT_ERROR;
-    if((res = write( scanfd, "1", 1 )) == -1) PRINT_ERROR;
+    if (EepOptions.bDump) {
+      printf("Dump mode: not rescanning the bus\n");
+      return EXIT_SUCCESS;
+    }
+    adna_sysfs_path(filename, sizeof(filename), "rescan");
+    if ((scanfd = open(filename, O_WRONLY)) == -1) {
+      printf("ERROR: Unable to open \"%s\" (%s)\n", filename, strerror(errno));
+      return EXIT_FAILURE;
+    }
+    res = write(scanfd, "1", 1);
+    if (res == -1)
+      printf("ERROR: Unable to write \"%s\" (%s)\n", filename, strerror(errno));
     close(scanfd);
+    if (res == -1)
+      return EXIT_FAILURE;
     sleep(1);
+    return EXIT_SUCCESS;
+}
+
+static void adna_device_free(struct adna_device *a)
+{
+  free(a->shadow);
+  free(a->this);
+  free(a->parent);
+  free(a);
 }
 
 static int adna_delete_list(void)
@@ -1217,16 +1536,29 @@ static int adna_delete_list(void)
   struct adna_device *a, *b;
   for (a=first_adna;a;a=b) {
     b=a->next;
-    free(a->this);
-    free(a->parent);
-    free(a);
+    adna_device_free(a);
   }
   return 0;
 }
 
-static int save_to_adna_list(void)
+/* Bridge whose secondary bus is dev's, for trees without sysfs links */
+static void adna_bridge_above(char *buf, size_t len, struct pci_dev *dev)
+{
+  struct pci_dev *p;
+
+  snprintf(buf, len, "%04x:00:00.0", dev->domain);
+  for (p = pacc->devices; p; p = p->next) {
+    if (p->domain == dev->domain &&
+        (pci_read_byte(p, PCI_HEADER_TYPE) & 0x7f) == PCI_HEADER_TYPE_BRIDGE &&
+        pci_read_byte(p, PCI_SECONDARY_BUS) == dev->bus) {
+      pcie_name(buf, len, p);
+      return;
+    }
+  }
+}
+
+static struct adna_device *adna_device_new(struct device *d)
 {
-  struct device *d;
   struct adna_device *a;
   struct pci_filter *this, *parent;
   char bdf_str[BUFFSZ_SMALL];
@@ -1235,58 +1567,98 @@ static int save_to_adna_list(void)
   char buf[BUFFSZ_BIG];
   char base[BUFFSZ_BIG];
 
-  for (d=first_dev; d; d=d->next) {
-    if (d->NumDevice) {
-      a = xmalloc(sizeof(struct adna_device));
-      memset(a, 0, sizeof(*a));
-      a->devnum = d->NumDevice;
-      this = xmalloc(sizeof(struct pci_filter));
-      memset(this, 0, sizeof(*this));
-      snprintf(bdf_str, sizeof(bdf_str), "%04x:%02x:%02x.%d",
-               d->dev->domain, d->dev->bus, d->dev->dev, d->dev->func);
-      snprintf(mfg_str, sizeof(mfg_str), "%04x:%04x:%04x",
-               d->dev->vendor_id, d->dev->device_id, d->dev->device_class);
-      snprintf(bdf_path, sizeof(bdf_path), "/sys/bus/pci/devices/%s", bdf_str);
-
-      pci_filter_parse_slot(this, bdf_str);
-      pci_filter_parse_id(this, mfg_str);
-      a->this = this;
-      a->bIsD3 = false;
-
-      parent = xmalloc(sizeof(struct pci_filter));
-      memset(parent, 0, sizeof(*parent));
-
-      ssize_t len = readlink(bdf_path, buf, sizeof(buf)-1);
-      if (len != -1) {
-        buf[len] = '\0';
-      } else {
-        /* handle error condition */
-      }
-      snprintf(base, sizeof(base), "%s", basename(dirname(buf)));
+  a = xmalloc(sizeof(struct adna_device));
+  memset(a, 0, sizeof(*a));
+  a->devnum = d->NumDevice;
+  this = xmalloc(sizeof(struct pci_filter));
+  memset(this, 0, sizeof(*this));
+  snprintf(bdf_str, sizeof(bdf_str), "%04x:%02x:%02x.%d",
+           d->dev->domain, d->dev->bus, d->dev->dev, d->dev->func);
+  snprintf(mfg_str, sizeof(mfg_str), "%04x:%04x:%04x",
+           d->dev->vendor_id, d->dev->device_id, d->dev->device_class);
+  adna_sysfs_path(bdf_path, sizeof(bdf_path), "devices/%s", bdf_str);
+
+  pci_filter_parse_slot(this, bdf_str);
+  pci_filter_parse_id(this, mfg_str);
+  a->this = this;
+  a->bIsD3 = false;
+
+  parent = xmalloc(sizeof(struct pci_filter));
+  memset(parent, 0, sizeof(*parent));
+
+  ssize_t len = readlink(bdf_path, buf, sizeof(buf)-1);
+  if (len != -1) {
+    buf[len] = '\0';
+    snprintf(base, sizeof(base), "%s", basename(dirname(buf)));
+  } else {
+    /* No sysfs link (a -F dump), take the bridge whose bus range holds ours */
+    adna_bridge_above(base, sizeof(base), d->dev);
+  }
 
-      pci_filter_parse_slot(parent, base);
-      a->parent = parent;
+  pci_filter_parse_slot(parent, base);
+  a->parent = parent;
+  return a;
+}
+
+static int save_to_adna_list(void)
+{
+  struct device *d;
+  struct adna_device *a;
 
+  for (d=first_dev; d; d=d->next) {
+    if (d->NumDevice) {
+      a = adna_device_new(d);
       a->next = first_adna;
       first_adna = a;
     }
   }
+
+  /* One set for all lookups between listed devices and H1As */
+  adna_set = pci_filter_set_new(pacc);
+  for (a = first_adna; a; a = a->next)
+    pci_filter_set_add(adna_set, a->this, a);
+  for (d = first_dev; d; d = d->next)
+    if ((a = pci_filter_set_lookup(adna_set, d->dev)))
+      a->dev = d;
   return 0;
 }
 
 static int adna_pacc_cleanup(void)
 {
+  pci_filter_set_free(adna_set);
+  pci_filter_set_free(list_set);
+  adna_set = list_set = NULL;
   show_kernel_cleanup();
   pci_cleanup(pacc);
   return 0;
 }
 
+/*
+ * Every access structure gets the -A/-O settings from the command line.
+ * The modes that watch registers take a fresh one, the listing one caches
+ * config space.
+ */
+static struct pci_access *adna_pacc_alloc(void)
+{
+  struct pci_access *a = pci_alloc();
+  char *arg;
+
+  a->error = die;
+  for (int i = 0; i < EepOptions.nPciOpts; i++) {
+    arg = xstrdup(EepOptions.PciOpts[i].arg);   /* parse_generic_option() edits it */
+    parse_generic_option(EepOptions.PciOpts[i].opt, a, arg);
+    free(arg);
+  }
+  return a;
+}
+
 static int adna_pacc_init(void)
 {
-  pacc = pci_alloc();
-  pacc->error = die;
+  pacc = adna_pacc_alloc();
   pci_filter_init(pacc, &filter);
   pci_init(pacc);
+  list_set = pci_filter_set_new(pacc);
+  pci_filter_set_add(list_set, &filter, &filter);
   return 0;
 }
 
@@ -1299,14 +1671,80 @@ static int adna_preprocess(void)
   return 0;
 }
 
+/*
+ * The bus is enumerated once per run. The device list and pacc stay up
+ * until adna_dev_list_free() at exit, and every later phase works on them.
+ * Whatever a phase changes on the bus (a power state, a reset card) is
+ * read back with adna_refresh_device() on just the devices it touched.
+ */
+static bool dev_list_ready;
+
 static void adna_dev_list_init(void)
 {
+  if (dev_list_ready)
+    return;
   adna_preprocess();
   NumDevices = count_upstream();
   if (NumDevices == 0) {
     printf("No Adnacom device detected.\n");
     exit(-1);
   }
+  dev_list_ready = true;
+}
+
+static void adna_dev_list_free(void)
+{
+  if (!dev_list_ready)
+    return;
+  adna_pacc_cleanup();
+  dev_list_ready = false;
+}
+
+/* Add the devices adna_preprocess() skipped, from the scan it already did */
+static void adna_dev_list_all(void)
+{
+  struct device *d;
+  struct pci_dev *p;
+
+  scan_all = true;
+  for (p=pacc->devices; p; p=p->next) {
+    if (pcidev_is_adnacom(p))
+      continue;
+    if ((d = scan_device(p))) {
+      d->next = first_dev;
+      first_dev = d;
+    }
+  }
+  sort_them();
+}
+
+/*! @brief Reads one device again after something changed it behind our back */
+static int adna_refresh_device(struct device *d)
+{
+  struct pci_dev *old = d->dev, **pp;
+
+  /* The old pci_dev may hold a descriptor of a sysfs node since removed */
+  d->dev = pci_get_dev(pacc, old->domain, old->bus, old->dev, old->func);
+  for (pp = &pacc->devices; *pp; pp = &(*pp)->next)
+    if (*pp == old) {
+      d->dev->next = old->next;
+      *pp = d->dev;
+      break;
+    }
+  pci_free_dev(old);
+
+  d->config_cached = 256;
+  memset(d->present, 0, d->config_bufsize);
+  d->poll.pending = d->poll.idle = false;
+  if (!pci_read_block(d->dev, 0, d->config, 256)) {
+    fprintf(stderr, "adna: Unable to read the standard configuration space header of device %04x:%02x:%02x.%d\n",
+            d->dev->domain, d->dev->bus, d->dev->dev, d->dev->func);
+    return EXIT_FAILURE;
+  }
+  memset(d->present, 1, 256);
+  pci_setup_cache(d->dev, d->config, d->config_cached);
+  pci_fill_info(d->dev, PCI_FILL_IDENT | PCI_FILL_CLASS);
+  return EXIT_SUCCESS;
 }
 
 static int adna_pci_process(void)
@@ -1316,8 +1754,6 @@ static int adna_pci_process(void)
   save_to_adna_list();
   show();
 
-  adna_pacc_cleanup();
-
   return 0;
 }
 
@@ -1332,13 +1768,7 @@ void adna_set_d3_flag(int devnum)
 
 static struct device *adna_get_device_from_adnadevice(struct adna_device *a)
 {
-  struct device *d;
-  for (d=first_dev; d; d=d->next) { // loop through the pacc list
-    if (pci_filter_match(a->this, d->dev)) { // to locate the pci dev
-      return d;
-    }
-  }
-  return NULL;
+  return a->dev;     // found through adna_set in save_to_adna_list()
 }
 
 static struct adna_device *adna_get_adnadevice_from_devnum(int num)
@@ -1352,46 +1782,44 @@ static struct adna_device *adna_get_adnadevice_from_devnum(int num)
   return NULL;
 }
 
-#define SETPCI_STR_SZ   (32)
+/* Bridge control value the parent port is left with around a hot reset */
+#define H1A_BRCTL_DEFAULT   (REG_MASK(brctl_serr) | REG_MASK(brctl_vga16))
+
+/*
+ * Power state and bridge control writes go straight through the listing
+ * pacc. A fresh pci_dev has no config cache, so nothing stale is read and
+ * the bus is not scanned again.
+ */
 static int adna_setpci_cmd(int command, struct pci_filter *f)
 {
-  char *argv[4];
-  volatile int status = EXIT_SUCCESS;
-
-  for (int i = 0; i < 4; i++) {
-    argv[i] = malloc(SETPCI_STR_SZ);
-  }
-
-  snprintf(argv[0], SETPCI_STR_SZ, "%s", "setpci");
-  snprintf(argv[1], SETPCI_STR_SZ, "%s", "-s");
-  snprintf(argv[2], SETPCI_STR_SZ, "%02x:%02x.%d", f->bus, f->slot, f->func);
+  struct pci_dev *p = pci_get_dev(pacc, f->domain, f->bus, f->slot, f->func);
+  struct pci_cap *cap;
+  int status = EXIT_SUCCESS;
 
   switch (command) {
     case D3_TO_D0:
-      snprintf(argv[3], SETPCI_STR_SZ, "%s","CAP_PM+4.b=0");
-    break;
     case D0_TO_D3:
-      snprintf(argv[3], SETPCI_STR_SZ, "%s","CAP_PM+4.b=3");
+      pci_fill_info(p, PCI_FILL_CAPS);
+      if (!(cap = pci_find_cap(p, PCI_CAP_ID_PM, PCI_CAP_NORMAL))) {
+        status = EXIT_FAILURE;
+        break;
+      }
+      pci_write_byte(p, cap->addr + pmcsr_state_reg,
+                     REG_VAL(pmcsr_state, command == D3_TO_D0 ? PCI_CAP_PM_STATE_D0
+                                                              : PCI_CAP_PM_STATE_D3_HOT));
     break;
     case HOTRESET_ENABLE:
-      snprintf(argv[3], SETPCI_STR_SZ, "%s","BRIDGE_CONTROL.b=0x52");
+      pci_write_byte(p, PCI_BRIDGE_CONTROL, H1A_BRCTL_DEFAULT | REG_MASK(brctl_sec_reset));
     break;
     case HOTRESET_DISABLE:
-      snprintf(argv[3], SETPCI_STR_SZ, "%s","BRIDGE_CONTROL.b=0x12");
+      pci_write_byte(p, PCI_BRIDGE_CONTROL, H1A_BRCTL_DEFAULT);
     break;
     default:
-      snprintf(argv[3], SETPCI_STR_SZ, "%s","BRIDGE_CONTROL");
+      status = EXIT_FAILURE;
     break;
   }
 
-  status = setpci(4, argv);
-
-  if (EXIT_SUCCESS == status) {
-    for (int i = 0; i < 4; i++) {
-      free(argv[i]);
-    }
-  }
-
+  pci_free_dev(p);
   return status;
 }
 
@@ -1402,10 +1830,14 @@ static int adna_d3_to_d0(void)
 
   for (a=first_adna; a; a=a->next) {
     if (a->bIsD3 == true) {
+      struct device *d = adna_get_device_from_adnadevice(a);
+
       status = adna_setpci_cmd(D3_TO_D0, a->this);
       if (EXIT_FAILURE == status) {
         seen_errors++;
         printf("Cannot change power state of this H1A\n");
+      } else if (d) {
+        adna_refresh_device(d);
       }
     }
   }
@@ -1423,49 +1855,87 @@ static int adna_populate_parent(int num)
   if (NULL == a)
     return EXIT_FAILURE;
 
-  pacc = pci_alloc();
-  pacc->error = die;
-  pci_filter_init(pacc, &filter);
-  pci_init(pacc);
-  pci_scan_bus(pacc);
-  for (p=pacc->devices; p; p=p->next) {
-    pci_fill_info(p, PCI_FILL_IDENT | PCI_FILL_BASES | PCI_FILL_CLASS);
-    if ((a->parent->domain == p->domain) &&
-        (a->parent->bus == p->bus) &&
-        (a->parent->slot == p->dev) &&
-        (a->parent->func == p->func)) {
-      snprintf(mfg_str, sizeof(mfg_str), "%04x:%04x:%04x",
-               p->vendor_id, p->device_id, p->device_class);
-      pci_filter_parse_id(a->parent, mfg_str);
-    }
-  }
-  pci_cleanup(pacc);
+  /* The parent is not in the list unless it is an H1A, read it directly */
+  p = pci_get_dev(pacc, a->parent->domain, a->parent->bus, a->parent->slot, a->parent->func);
+  pci_fill_info(p, PCI_FILL_IDENT | PCI_FILL_CLASS);
+  snprintf(mfg_str, sizeof(mfg_str), "%04x:%04x:%04x",
+           p->vendor_id, p->device_id, p->device_class);
+  pci_filter_parse_id(a->parent, mfg_str);
+  pci_free_dev(p);
   return EXIT_SUCCESS;
 }
 
-static int adna_hotreset(int num)
+/*! @brief Power cycles the slot the H1A sits in (--slot-reset), EXIT_SUCCESS if it did */
+static int adna_slot_reset(struct adna_device *a)
+{
+  struct slot_timing t;
+  struct pci_dev *p;
+  int status;
+
+  /* On the listing pacc, so a -F dump sees its own writes */
+  p = pci_get_dev(pacc, a->parent->domain, a->parent->bus, a->parent->slot, a->parent->func);
+  status = slot_power_cycle(p, &t);
+  pci_free_dev(p);
+
+  if (status == EXIT_SUCCESS)
+    printf("Slot power cycle: link down %.3f s, present %.3f s, link up %.3f s, total %.2f s\n",
+           t.off_ns / 1e9, t.present_ns / 1e9, t.link_ns / 1e9, t.total_ns / 1e9);
+  else if (status == SLOT_NO_POWER)
+    printf("Slot has no power control, resetting through the bridge\n");
+  else
+    printf("Slot power cycle failed, resetting through the bridge\n");
+  return status;
+}
+
+static int adna_hotreset_dev(struct adna_device *a)
 {
-  struct adna_device *a;
   int status = EXIT_SUCCESS;
 
-  a = adna_get_adnadevice_from_devnum(num);
-  if (NULL == a)
-    return EXIT_FAILURE;
+  /* The card reloads from its EEPROM, nothing read so far can be trusted */
+  if (a->shadow)
+    eep_shadow_invalidate(a->shadow);
+
   status = adna_setpci_cmd(D0_TO_D3, a->this);
   if (EXIT_FAILURE == status) {
     printf("Cannot change power state of this H1A\n");
     return status;
   }
-  adna_remove_downstream(a->this);
+  if (adna_remove_downstream(a->this) != EXIT_SUCCESS) {
+    adna_setpci_cmd(D3_TO_D0, a->this);
+    return EXIT_FAILURE;
+  }
+
+  status = EepOptions.bSlotReset ? adna_slot_reset(a) : SLOT_NO_POWER;
+  if (status != EXIT_SUCCESS) {
+    adna_setpci_cmd(HOTRESET_ENABLE, a->parent);
+    sleep(1);
+    adna_setpci_cmd(HOTRESET_DISABLE, a->parent);
+    sleep(1);
+    status = adna_remove_downstream(a->parent);
+    sleep(1);
+  }
+
+  /* Rescan even after a failure, whatever was removed should come back */
+  if (adna_rescan_pci() != EXIT_SUCCESS)
+    status = EXIT_FAILURE;
+  return status;
+}
+
+static int adna_hotreset(int num)
+{
+  struct adna_device *a;
+  struct device *d;
+  int status;
 
-  adna_setpci_cmd(HOTRESET_ENABLE, a->parent);
-  sleep(1);
-  adna_setpci_cmd(HOTRESET_DISABLE, a->parent);
-  sleep(1);
-  adna_remove_downstream(a->parent);
-  sleep(1);
+  a = adna_get_adnadevice_from_devnum(num);
+  if (NULL == a)
+    return EXIT_FAILURE;
+  d = adna_get_device_from_adnadevice(a);
+  status = adna_hotreset_dev(a);
 
-  adna_rescan_pci();
+  /* Only the card went away and came back, the rest of the list holds */
+  if (d && adna_refresh_device(d) != EXIT_SUCCESS)
+    status = EXIT_FAILURE;
   return status;
 }
 
@@ -1513,19 +1983,17 @@ static bool is_file_exist(FILE **pFile)
   return true;
 }
 
-static uint8_t EepromFileLoad(struct device *d)
+/* Image file contents, read once and kept for the whole session */
+static uint8_t *eep_image;
+static uint32_t eep_image_size;
+
+static uint8_t eep_image_load(void)
 {
-    printf("Function: %s\n", __func__);
-    uint8_t rc;
-    uint8_t four_byte_count;
-    uint16_t Verify_Value_16 = 0;
-    uint32_t value;
-    uint32_t Verify_Value = 0;
-    uint32_t offset;
     uint32_t FileSize;
     FILE *pFile;
 
-    g_pBuffer   = NULL;
+    if (eep_image != NULL)
+      return EXIT_SUCCESS;
 
     printf("Load EEPROM file... \n");
     fflush(stdout);
@@ -1544,15 +2012,15 @@ static uint8_t EepromFileLoad(struct device *d)
     fseek(pFile, 0, SEEK_SET);
 
     // Allocate a buffer for the data
-    g_pBuffer = malloc(FileSize);
-    if (g_pBuffer == NULL) {
+    eep_image = malloc(FileSize);
+    if (eep_image == NULL) {
         fclose(pFile);
         return EEP_FAIL;
     }
 
     // Read data from file
     if (fread(
-            g_pBuffer,        // Buffer for data
+            eep_image,        // Buffer for data
             sizeof(uint8_t),// Item size
             FileSize,       // Buffer size
             pFile           // File pointer
@@ -1563,28 +2031,137 @@ static uint8_t EepromFileLoad(struct device *d)
     // Close the file
     fclose(pFile);
 
+    eep_image_size = FileSize;
     printf("Ok (%dB)\n", (int)FileSize);
+    return EXIT_SUCCESS;
+}
 
-    if (!EepOptions.bIsInit) {
-      for (uint8_t i = 0; i < FileSize; i++) {
-        if ((g_pBuffer[i] == 0x42) &&
-            (g_pBuffer[i+1] == 0x00)) {
-          // Load serial number
-          printf("Load Serial Number to buffer\n");
-          g_pBuffer[i+5] = EepOptions.SerialNumber[0];
-          g_pBuffer[i+4] = EepOptions.SerialNumber[1];
-          g_pBuffer[i+3] = EepOptions.SerialNumber[2];
-          g_pBuffer[i+2] = EepOptions.SerialNumber[3];
-          break;
-        }
-      }
+/* Offset of the 4 serial number bytes in an image, -1 if it has none */
+int eep_serial_offset(const uint8_t *buf, uint32_t size)
+{
+    for (uint32_t i = 0; i + 5 < size; i++) {
+      if ((buf[i] == 0x42) &&
+          (buf[i+1] == 0x00))
+        return i + 2;
     }
-    printf("Ok\n");
+    return -1;
+}
 
-    // Default to successful operation
+static void eep_patch_serial(uint8_t *buf, uint32_t size)
+{
+    int i = eep_serial_offset(buf, size);
+
+    if (i < 0)
+      return;
+    // Load serial number
+    printf("Load Serial Number to buffer\n");
+    buf[i+3] = EepOptions.SerialNumber[0];
+    buf[i+2] = EepOptions.SerialNumber[1];
+    buf[i+1] = EepOptions.SerialNumber[2];
+    buf[i]   = EepOptions.SerialNumber[3];
+}
+
+#define EEP_RETRY_MAX_BACKOFF   (4000)          /* ms, the doubling stops here */
+
+/*
+ * Retry a dword write that did not read back as written. Between attempts
+ * wait with doubling backoff, up to EEP_RETRY_MAX_BACKOFF, for the
+ * controller to go idle and drop a write enable latch left set by the
+ * failed attempt, so each retry starts from the same state as a first
+ * write. Half selects a 16-bit write. *read is always set, to the last
+ * value read back or PCI_MEM_ERROR.
+ */
+bool eep_write_retry(struct device *d, uint32_t dword, uint32_t value,
+                     bool half, uint32_t *read)
+{
+    u64 delay = EepOptions.RetryBackoff;
+    uint32_t status;
+
+    *read = PCI_MEM_ERROR;		/* Nothing read back if no attempt gets to write */
+    for (uint32_t attempt = 1; attempt <= EepOptions.WriteRetries; attempt++) {
+        sleep_until(monotonic_ns() + delay * 1000000);
+        delay = (delay * 2 < EEP_RETRY_MAX_BACKOFF) ? delay * 2 : EEP_RETRY_MAX_BACKOFF;
+
+        status = eep_reg_read(d, EEP_STAT_N_CTRL_ADDR);
+        if (status == PCI_MEM_ERROR) {
+            printf("ERROR: Device not responding, giving up on retries\n");
+            return false;
+        }
+        if (eep_blk_wr_protect_get(status)) {
+            printf("ERROR: EEPROM is write protected (status 0x%08X)\n", status);
+            return false;
+        }
+        if (eep_ready_get(status) != EEP_READY_TO_TX ||
+            eep_cmd_status_get(status) != CMD_COMPLETE)
+            continue;		/* Still busy, back off further */
+        if (eep_wr_enable_get(status) == EEP_WR_ENABLED)
+            eep_data(d, EEP_COMMAND(RST_WR_EN_LATCH, 0), NULL);
+
+        if (half)
+            eep_write_16(d, dword, (uint16_t)value);
+        else
+            eep_write(d, dword, value);
+        *read = eep_read_uncached(d, dword);
+        if (half ? (uint16_t)*read == (uint16_t)value : *read == value) {
+            if (EepOptions.bVerbose)
+                printf("  dword 0x%X verified after %u retry(s)\n", dword, attempt);
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Controller reads an operation sent over the fabric */
+static void eep_report_reads(struct device *d, u64 since, uint32_t bytes)
+{
+    u64 reads = d->poll.reads - since;
+
+    if (EepOptions.bQos || EepOptions.bVerbose)
+        printf("%llu controller read(s), %.1f per dword\n", (unsigned long long)reads,
+               bytes ? reads / ((bytes + 3) / 4.0) : 0.0);
+}
+
+static uint8_t EepromFileLoad(struct device *d)
+{
+    printf("Function: %s\n", __func__);
+    uint8_t rc;
+    uint32_t four_byte_count;
+    uint16_t Verify_Value_16 = 0;
+    uint32_t value;
+    uint32_t Verify_Value = 0;
+    uint32_t offset;
+    uint32_t FileSize;
+    uint32_t unchanged = 0, retried = 0, nfailed = 0;
+    uint32_t *failed = NULL;
+    u64 reads = d->poll.reads;
+    bool mapped;
+
+    g_pBuffer   = NULL;
+
+    if (eep_image_load() != EXIT_SUCCESS)
+      return EEP_FAIL;
+    FileSize = eep_image_size;
+
+    // Work on a copy so the serial number patch does not touch the image
+    g_pBuffer = malloc(FileSize);
+    if (g_pBuffer == NULL)
+      return EEP_FAIL;
+    memcpy(g_pBuffer, eep_image, FileSize);
+
+    if (!EepOptions.bIsInit)
+      eep_patch_serial(g_pBuffer, FileSize);
+    printf("Ok\n");
+
+    // Default to successful operation
     rc = EXIT_SUCCESS;
 
     printf("Program EEPROM..... \n");
+    mapped = eep_hw_map(d);
+    failed = malloc((FileSize / sizeof(uint32_t) + 1) * sizeof(*failed));
+    if (failed == NULL) {
+        rc = EEP_FAIL;
+        goto _Exit_File_Load;
+    }
 
     // Write 32-bit aligned buffer into EEPROM
     for (offset = 0, four_byte_count = 0; offset < (FileSize & ~0x3); ++four_byte_count, offset += sizeof(uint32_t))
@@ -1599,15 +2176,28 @@ static uint8_t EepromFileLoad(struct device *d)
         // Get next value
         value = *(uint32_t*)(g_pBuffer + offset);
 
+        // Leave dwords alone the shadow knows already hold the value; the
+        // others are written and checked with the one read after the write
+        if (eep_shadow_get(d, four_byte_count, &Verify_Value) && Verify_Value == value) {
+            unchanged++;
+            continue;
+        }
+
         // Write value & read back to verify
         eep_write(d, four_byte_count, value);
-        eep_read(d, four_byte_count, &Verify_Value);
+        Verify_Value = eep_read_uncached(d, four_byte_count);
 
         if (Verify_Value != value) {
-            printf("ERROR W32: offset:0x%02X  wrote:0x%08X  read:0x%08X\n",
-                   offset, value, Verify_Value);
-            rc = EEP_FAIL;
-            goto _Exit_File_Load;
+            if (!EepOptions.WriteRetries) {
+                printf("ERROR W32: offset:0x%02X  wrote:0x%08X  read:0x%08X\n",
+                       offset, value, Verify_Value);
+                rc = EEP_FAIL;
+                goto _Exit_File_Load;
+            }
+            retried++;
+            // Leave persistent failures for the re-pass and keep going
+            if (!eep_write_retry(d, four_byte_count, value, false, &Verify_Value))
+                failed[nfailed++] = four_byte_count;
         }
     }
 
@@ -1618,18 +2208,68 @@ static uint8_t EepromFileLoad(struct device *d)
         value |= 0xFFFF0000;                      // so set the 16bit on MSB half to 0xffff (this is only for the comparison)
 
         // Write value & read back to verify
-        eep_write_16(d, four_byte_count, (uint16_t)value); // then only half was written? what's the sense of the OR operation above?
-        eep_read_16(d, four_byte_count, &Verify_Value_16); // why was the last written 32bit value read here? write of zero is ignored?
+        if (eep_shadow_get(d, four_byte_count, &Verify_Value) &&
+            (uint16_t)Verify_Value == (uint16_t)value) {
+            Verify_Value_16 = (uint16_t)value;
+            unchanged++;
+        } else {
+            eep_write_16(d, four_byte_count, (uint16_t)value); // then only half was written? what's the sense of the OR operation above?
+            Verify_Value_16 = eep_read_uncached(d, four_byte_count); // why was the last written 32bit value read here? write of zero is ignored?
+        }
 
         if (Verify_Value_16 != (uint16_t)value) {
-            printf("ERROR W16: offset:0x%02X  wrote:0x%08X  read:0x%08X\n",
-                   offset, value, Verify_Value_16);
+            uint32_t read = Verify_Value_16;
+            bool verified = false;
+
+            /* A failed retry is a failure, whatever it read back last */
+            if (EepOptions.WriteRetries) {
+                retried++;
+                verified = eep_write_retry(d, four_byte_count, value, true, &read);
+            }
+            if (!verified) {
+                printf("ERROR W16: offset:0x%02X  wrote:0x%08X  read:0x%08X\n",
+                       offset, value, read);
+                rc = EEP_FAIL;
+                goto _Exit_File_Load;
+            }
+        }
+    }
+
+    // Targeted re-pass over the dwords that kept failing, with fresh retries
+    if (nfailed) {
+        uint32_t left = 0;
+
+        printf("Retry %u failed dword(s)... \n", nfailed);
+        for (uint32_t i = 0; i < nfailed; i++) {
+            uint32_t dword = failed[i];
+
+            value = *(uint32_t*)(g_pBuffer + dword * sizeof(uint32_t));
+            eep_write(d, dword, value);
+            Verify_Value = eep_read_uncached(d, dword);
+            if (Verify_Value == value ||
+                eep_write_retry(d, dword, value, false, &Verify_Value))
+                continue;
+            printf("ERROR W32: offset:0x%02X  wrote:0x%08X  read:0x%08X\n",
+                   (unsigned int)(dword * sizeof(uint32_t)), value, Verify_Value);
+            left++;
+        }
+        if (left) {
+            printf("ERROR: %u dword(s) could not be programmed\n", left);
+            rc = EEP_FAIL;
             goto _Exit_File_Load;
         }
     }
-    printf("Ok \n");
+    printf("Ok (%u dword(s) already up to date", unchanged);
+    if (retried)
+        printf(", %u recovered by retry", retried);
+    printf(")\n");
+    eep_report_reads(d, reads, FileSize);
 
 _Exit_File_Load:
+    if (mapped)
+        eep_hw_unmap(d);
+    free(failed);
+
     // Release the buffer
     if (g_pBuffer != NULL) {
         free(g_pBuffer);
@@ -1643,37 +2283,28 @@ static uint8_t EepromFileSave(struct device *d)
     printf("Function: %s\n", __func__);
     volatile uint32_t value = 0;
     uint32_t offset;
-    uint8_t four_byte_count;
     uint32_t EepSize;
     FILE *pFile;
+    u64 reads = d->poll.reads;
 
     printf("Get EEPROM data size.. \n");
 
     g_pBuffer = NULL;
 
-    // Start with EEPROM header size
-    EepSize = sizeof(uint32_t);
-
     // Get EEPROM header
     eep_read(d, 0x0, &value);
 
-    // Add register byte count
-    EepSize += (value >> 16);
-
-    printf("Ok (%d Bytes", EepSize);
+    // Header size plus register byte count
+    printf("Ok (%d Bytes", eep_dump_size(value, 0));
 
     /* ExtraBytes may not be needed */
-    if (EepOptions.ExtraBytes) {
+    if (EepOptions.ExtraBytes)
         printf(" + %dB extra", EepOptions.ExtraBytes);
-
-        // Adjust for extra bytes
-        EepSize += EepOptions.ExtraBytes;
-
-        // Make sure size aligned on 16-bit boundary
-        EepSize = (EepSize + 1) & ~(uint32_t)0x1;
-    }
     printf(")\n");
 
+    // Extra bytes are rounded up to a 16-bit boundary
+    EepSize = eep_dump_size(value, EepOptions.ExtraBytes);
+
     printf("Read EEPROM data...... \n");
     fflush(stdout);
 
@@ -1684,14 +2315,12 @@ static uint8_t EepromFileSave(struct device *d)
     }
 
     // Each EEPROM read via BAR0 is 4 bytes so offset is represented in bytes (aligned in 32 bits)
-    // while four_byte_count is represented in count of 4-byte access
-    for (offset = 0, four_byte_count = 0; offset < (EepSize & ~0x3); offset += sizeof(uint32_t), four_byte_count++) {
-        eep_read(d, four_byte_count, (uint32_t*)(g_pBuffer + offset));
-    }
+    offset = EepSize & ~0x3;
+    eep_read_range(d, 0, offset / sizeof(uint32_t), (uint32_t*)g_pBuffer);
 
     // Read any remaining 16-bit aligned byte
     if (offset < EepSize) {
-        eep_read_16(d, four_byte_count, (uint16_t*)(g_pBuffer + offset));
+        eep_read_16(d, offset / sizeof(uint32_t), (uint16_t*)(g_pBuffer + offset));
     }
     printf("Ok\n");
 
@@ -1745,6 +2374,7 @@ static uint8_t EepromFileSave(struct device *d)
     }
 
     printf("Ok %s\n", (EepOptions.bLoadFile == true) ? "" : EepOptions.FileName);
+    eep_report_reads(d, reads, EepSize);
 
     return EXIT_SUCCESS;
 }
@@ -1762,32 +2392,21 @@ static uint8_t EepFile(struct device *d)
   }
 }
 
-static int eep_process(int j)
+static int eep_check_presence(struct device *d)
 {
-  struct device *d;
-  struct adna_device *a;
   int eep_present = EEP_PRSNT_MAX;
   uint32_t read;
   int status = EXIT_FAILURE;
 
-  adna_dev_list_init();
-
-  a = adna_get_adnadevice_from_devnum(j);
-  if (NULL == a)
-    exit(-1);
-  d = adna_get_device_from_adnadevice(a);
-  if (NULL == d)
-    exit(-1);
-
   check_for_ready_or_done(d);
-  read = pcimem(d->dev, EEP_STAT_N_CTRL_ADDR, 0);
+  read = eep_reg_read(d, EEP_STAT_N_CTRL_ADDR);
   check_for_ready_or_done(d);
   if (read == PCI_MEM_ERROR) {
     printf("Unexpected error. Exiting.\n");
     exit(-1);
   }
 
-  eep_present = (read >> EEP_PRSNT_OFFSET) & 3;;
+  eep_present = eep_prsnt_get(read);
 
   switch (eep_present) {
   case NOT_PRSNT:
@@ -1809,11 +2428,550 @@ static int eep_process(int j)
     printf("This code should not be reached\n");
   break;
   }
+  return status;
+}
+
+/* Give the device its session shadow, seeded with anything prefetched */
+static void adna_attach_shadow(struct adna_device *a, struct device *d)
+{
+  const struct eep_cache_entry *c;
+
+  if (!a->shadow) {
+    a->shadow = eep_shadow_new();
+    if ((c = eep_prefetch_get(d->dev))) {
+      for (uint32_t i = 0; i < c->len / 4; i++) {
+        a->shadow->data[i] = ((uint32_t *)c->data)[i];
+        a->shadow->valid[i / 32] |= 1U << (i % 32);
+      }
+    }
+  }
+  d->shadow = a->shadow;
+}
+
+static int eep_process(int j)
+{
+  struct device *d;
+  struct adna_device *a;
+  int status = EXIT_FAILURE;
+
+  adna_dev_list_init();
+
+  a = adna_get_adnadevice_from_devnum(j);
+  if (NULL == a)
+    exit(-1);
+  d = adna_get_device_from_adnadevice(a);
+  if (NULL == d)
+    exit(-1);
+  adna_attach_shadow(a, d);
 
+  status = eep_check_presence(d);
   if (EXIT_SUCCESS == status)
-    status = EepFile(d);
+    status = EepOptions.bSoak ? eep_soak(d, EepOptions.SoakCycles,
+                                         EepOptions.SoakStart, EepOptions.SoakCount)
+                              : EepFile(d);
+
+  return status;
+}
+
+/*** Station mode ***/
+
+#define STATION_SKIP        (-1)
+#define STATION_RESET_HOLD  (30ULL * 1000000000)   /* Ignore re-arrival after our own reset */
+
+static volatile sig_atomic_t station_stop;
+static char station_reset_slot[BUFFSZ_SMALL];
+static u64 station_reset_until;
+
+static void station_signal(int sig UNUSED)
+{
+  station_stop = 1;
+}
+
+static void serial_increment(char *sn)
+{
+  for (int i = 3; i >= 0; i--)
+    if (++((uint8_t *)sn)[i])
+      break;
+}
+
+/* The add event can precede the creation of the BAR files in sysfs */
+static bool station_wait_resource(struct pci_dev *p)
+{
+  char path[BUFFSZ_BIG];
+
+  pci_get_res0(p, path, sizeof(path));
+  for (int i = 0; i < 500; i++) {
+    if (!access(path, R_OK | W_OK))
+      return true;
+    usleep(10000);
+  }
+  return false;
+}
+
+static uint8_t eep_verify_buffer(struct device *d, const uint8_t *buf, uint32_t size)
+{
+  volatile uint32_t value = 0;
+  uint16_t value_16 = 0;
+  uint32_t offset;
+
+  for (offset = 0; offset + 4 <= size; offset += 4) {
+    eep_read(d, offset / 4, &value);
+    if (value != *(uint32_t *)(buf + offset)) {
+      printf("ERROR VERIFY: offset:0x%02X  expected:0x%08X  read:0x%08X\n",
+             offset, *(uint32_t *)(buf + offset), value);
+      return EEP_FAIL;
+    }
+  }
+  if (offset < size) {
+    eep_read_16(d, offset / 4, &value_16);
+    if (value_16 != *(uint16_t *)(buf + offset)) {
+      printf("ERROR VERIFY: offset:0x%02X  expected:0x%04X  read:0x%04X\n",
+             offset, *(uint16_t *)(buf + offset), value_16);
+      return EEP_FAIL;
+    }
+  }
+  return EXIT_SUCCESS;
+}
+
+static void station_free_device(struct device *d)
+{
+  free(d->config);
+  free(d->present);
+  free(d);
+}
+
+static int station_card(struct uevent *ev)
+{
+  struct pci_filter f;
+  struct pci_dev *p;
+  struct device *d;
+  struct adna_device *a;
+  uint8_t *expected;
+  u64 t0 = monotonic_ns();
+  int status;
+
+  pci_filter_init(pacc, &f);
+  if (pci_filter_parse_slot(&f, ev->slot))
+    return STATION_SKIP;
+  p = pci_get_dev(pacc, f.domain, f.bus, f.slot, f.func);
+  if (!station_wait_resource(p) || !(d = scan_device(p))) {
+    pci_free_dev(p);
+    return STATION_SKIP;
+  }
+  if (!pci_is_upstream(p)) {
+    station_free_device(d);
+    pci_free_dev(p);
+    return STATION_SKIP;
+  }
+
+  printf("\nCard %s arrived, serial %02X%02X%02X%02X\n", ev->slot,
+         (uint8_t)EepOptions.SerialNumber[0], (uint8_t)EepOptions.SerialNumber[1],
+         (uint8_t)EepOptions.SerialNumber[2], (uint8_t)EepOptions.SerialNumber[3]);
+
+  status = eep_check_presence(d);
+  if (status == EEP_BLANK_INVALID)
+    status = EXIT_SUCCESS;    /* Header was initialized, the image rewrites the rest */
+  if (status == EXIT_SUCCESS)
+    status = EepromFileLoad(d);
+  if (status == EXIT_SUCCESS) {
+    printf("Verify EEPROM...\n");
+    expected = xmalloc(eep_image_size);
+    memcpy(expected, eep_image, eep_image_size);
+    eep_patch_serial(expected, eep_image_size);
+    status = eep_verify_buffer(d, expected, eep_image_size);
+    free(expected);
+  }
+  if (status == EXIT_SUCCESS && EepOptions.bStationReset) {
+    a = adna_device_new(d);
+    snprintf(station_reset_slot, sizeof(station_reset_slot), "%s", ev->slot);
+    station_reset_until = monotonic_ns() + STATION_RESET_HOLD;
+    status = adna_hotreset_dev(a);
+    adna_device_free(a);
+  }
+
+  printf("Card %s: %s (%.2f s)\n", ev->slot,
+         (status == EXIT_SUCCESS) ? "PASS" : "FAIL", (monotonic_ns() - t0) / 1e9);
+  fflush(stdout);
+  if (status == EXIT_SUCCESS)
+    serial_increment(EepOptions.SerialNumber);
+
+  station_free_device(d);
+  pci_free_dev(p);
+  return (status == EXIT_SUCCESS) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int adna_station(void)
+{
+  struct sigaction sa;
+  struct uevent ev;
+  unsigned int passed = 0, failed = 0;
+  int fd, rc;
 
+  fd = uevent_open();
+  if (fd < 0) {
+    printf("ERROR: Cannot listen for hotplug events (%s)\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
+  if (eep_image_load() != EXIT_SUCCESS) {
+    close(fd);
+    return EXIT_FAILURE;
+  }
+  adna_pacc_init();
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = station_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  printf("Station ready, waiting for H1A cards (Ctrl-C to stop)\n");
+  fflush(stdout);
+  while (!station_stop) {
+    rc = uevent_recv(fd, &ev);
+    if (rc < 0 && errno != EINTR && errno != ENOBUFS) {
+      printf("ERROR: Hotplug event stream failed (%s)\n", strerror(errno));
+      break;
+    }
+    if (rc <= 0 ||
+        strcmp(ev.action, "add") ||
+        ev.vendor != PLX_VENDOR_ID ||
+        ev.device != PLX_H1A_DEVICE_ID)
+      continue;
+    if (!strcmp(ev.slot, station_reset_slot) && monotonic_ns() < station_reset_until)
+      continue;
+
+    rc = station_card(&ev);
+    if (rc == EXIT_SUCCESS)
+      passed++;
+    else if (rc != STATION_SKIP)
+      failed++;
+  }
+
+  close(fd);
   adna_pacc_cleanup();
+  printf("\nStation summary: %u passed, %u failed\n", passed, failed);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Read ahead what the selected operation will need while the operator chooses */
+static void adna_prefetch_start(void)
+{
+  struct pci_filter **devs;
+  struct adna_device *a;
+  int count = 0;
+
+  /* With -n programming needs nothing from the card before it starts */
+  if (EepOptions.bSoak || EepOptions.bDump ||
+      (EepOptions.bLoadFile == true && EepOptions.bSerialNumber))
+    return;
+  devs = xmalloc(NumDevices * sizeof(*devs));
+  for (a = first_adna; a; a = a->next)
+    if (!a->bIsD3)
+      devs[count++] = a->this;
+  eep_prefetch_start(adna_pacc_alloc, devs, count, !EepOptions.bLoadFile, EepOptions.ExtraBytes);
+  free(devs);
+}
+
+/*** Asynchronous programming ***/
+
+static const char *async_result(const struct eep_job_stats *st)
+{
+  if (st->state == EEP_JOB_DONE)
+    return "Ok";
+  switch (st->status) {
+  case EEP_NOT_EXIST:
+    return "ERROR: No EEPROM present";
+  case EEP_BLANK_INVALID:
+    return "ERROR: EEPROM was blank, initialized it; reset the card and run again";
+  default:
+    return "ERROR: Programming failed";
+  }
+}
+
+/* One job per card, driven from a poll() loop the way an event-driven caller would */
+static int adna_async(void)
+{
+  struct adna_device *a;
+  struct eep_job **jobs;
+  struct eep_job_stats st;
+  struct pollfd pfd;
+  uint64_t events;
+  int *devnum, count = 0, running, failed = 0;
+
+  if (eep_image_load() != EXIT_SUCCESS)
+    return EXIT_FAILURE;
+  if ((pfd.fd = eep_job_init(adna_pacc_alloc)) < 0) {
+    printf("ERROR: Unable to create an eventfd (%s)\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
+  pfd.events = POLLIN;
+
+  jobs = xmalloc(NumDevices * sizeof(*jobs));
+  devnum = xmalloc(NumDevices * sizeof(*devnum));
+  for (a = first_adna; a; a = a->next) {
+    if (a->bIsD3)
+      continue;
+    if (!(jobs[count] = eep_job_write(a->this, eep_image, eep_image_size, true))) {
+      printf("[%d] ERROR: Unable to start programming\n", a->devnum);
+      failed++;
+      continue;
+    }
+    devnum[count++] = a->devnum;
+  }
+  printf("Program EEPROM of %d H1A device(s)...\n", count);
+
+  for (running = count; running; ) {
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+      break;
+    if (read(pfd.fd, &events, sizeof(events)) < 0)
+      continue;
+    running = 0;
+    for (int i = 0; i < count; i++) {
+      eep_job_stats(jobs[i], &st);
+      printf("[%d] %3u%%  ", devnum[i], st.total ? st.done * 100 / st.total : 0);
+      if (st.state == EEP_JOB_QUEUED || st.state == EEP_JOB_RUNNING)
+        running++;
+    }
+    printf("\r");
+    fflush(stdout);
+  }
+  printf("\n");
+
+  for (int i = 0; i < count; i++) {
+    eep_job_stats(jobs[i], &st);
+    printf("[%d] %s (%u dword(s) written, %u up to date, %u retried) in %.1f s\n",
+           devnum[i], async_result(&st), st.written, st.unchanged, st.retried,
+           (st.end_ns - st.start_ns) / 1e9);
+    if (EepOptions.bQos || EepOptions.bVerbose)
+      printf("    %llu controller read(s)\n", (unsigned long long)st.reads);
+    if (st.state != EEP_JOB_DONE)
+      failed++;
+    eep_job_free(jobs[i]);
+  }
+  free(jobs);
+  free(devnum);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*** Verify mode ***/
+
+/* Scanned devices of all listed H1As in bus order, one pass over the bus */
+static int adna_get_devices(struct device **devs, int max)
+{
+  struct adna_device *a;
+  struct device *d;
+  int count = 0;
+
+  for (d = first_dev; d && count < max; d = d->next)
+    if ((a = pci_filter_set_lookup(adna_set, d->dev))) {
+      adna_attach_shadow(a, d);
+      devs[count++] = d;
+    }
+  return count;
+}
+
+static int adna_verify(void)
+{
+  struct eep_mapped_image img;
+  struct device **devs;
+  int count, status;
+
+  if (eep_image_map(EepOptions.VerifyFile, &img) != EXIT_SUCCESS)
+    return EXIT_FAILURE;
+
+  adna_dev_list_init();
+  devs = xmalloc(NumDevices * sizeof(*devs));
+  count = adna_get_devices(devs, NumDevices);
+
+  status = eep_verify_devices(devs, count, &img,
+                              (EepOptions.bVerifyReport ? EEP_VERIFY_REPORT : 0) |
+                              (EepOptions.bVerifyIgnoreSerial ? EEP_VERIFY_IGNORE_SERIAL : 0));
+
+  free(devs);
+  eep_image_unmap(&img);
+  return status;
+}
+
+/* Queue an access option for every pci_access we create */
+static bool add_pci_opt(int opt, char *arg)
+{
+  if (EepOptions.nPciOpts == PCI_OPTS_MAX) {
+    printf("ERROR: Too many access options (-A/-O/-F/--sysfs)\n");
+    return false;
+  }
+  EepOptions.PciOpts[EepOptions.nPciOpts].opt = opt;
+  EepOptions.PciOpts[EepOptions.nPciOpts].arg = arg;
+  EepOptions.nPciOpts++;
+  return true;
+}
+
+static char *concat_arg(const char *prefix, const char *arg)
+{
+  char *s = xmalloc(strlen(prefix) + strlen(arg) + 1);
+
+  sprintf(s, "%s%s", prefix, arg);
+  return s;
+}
+
+/* The listed H1A devices and, if wanted, their parent ports as arrays */
+static int adna_port_arrays(struct pci_filter ***h1a, struct pci_filter ***parent)
+{
+  struct adna_device *a;
+  int count = 0;
+
+  for (a = first_adna; a; a = a->next)
+    count++;
+  *h1a = xmalloc(count * sizeof(**h1a));
+  if (parent)
+    *parent = xmalloc(count * sizeof(**parent));
+  count = 0;
+  for (a = first_adna; a; a = a->next) {
+    (*h1a)[count] = a->this;
+    if (parent)
+      (*parent)[count] = a->parent;
+    count++;
+  }
+  return count;
+}
+
+/*** Flight recorder ***/
+
+static int adna_record(void)
+{
+  struct recorder_options opt;
+  struct pci_filter **h1a, **parent;
+  struct pci_access *acc;
+  int count, status;
+
+  count = adna_port_arrays(&h1a, &parent);
+
+  opt.dir = EepOptions.RecordDir;
+  opt.window_ms = EepOptions.RecordWindow * 1000;
+  opt.interval_ms = EepOptions.RecordInterval;
+
+  acc = adna_pacc_alloc();
+  pci_init(acc);
+  status = recorder_run(acc, h1a, parent, count, &opt);
+  pci_cleanup(acc);
+
+  free(h1a);
+  free(parent);
+  return status;
+}
+
+/*** Port monitor ***/
+
+static int adna_monitor(void)
+{
+  struct pci_filter **h1a, **parent;
+  struct pci_access *acc;
+  int count, status;
+
+  count = adna_port_arrays(&h1a, &parent);
+
+  acc = adna_pacc_alloc();
+  pci_init(acc);
+  status = monitor_run(acc, h1a, parent, count, EepOptions.MonitorFile,
+                       EepOptions.MonitorInterval);
+  pci_cleanup(acc);
+
+  free(h1a);
+  free(parent);
+  return status;
+}
+
+/*** Tuning profiles ***/
+
+static int adna_tune(void)
+{
+  struct pci_filter **h1a;
+  struct pci_access *acc;
+  int count, status;
+
+  count = adna_port_arrays(&h1a, NULL);
+
+  acc = adna_pacc_alloc();
+  pci_init(acc);
+  status = tune_apply(acc, h1a, count, EepOptions.TuneProfile, EepOptions.TuneSave,
+                      EepOptions.bForce);
+  pci_cleanup(acc);
+
+  free(h1a);
+  return status;
+}
+
+static int adna_tune_rollback(void)
+{
+  struct pci_access *acc = adna_pacc_alloc();
+  int status;
+
+  pci_init(acc);
+  status = tune_rollback(acc, EepOptions.TuneRollback);
+  pci_cleanup(acc);
+  return status;
+}
+
+/*** Peer-to-peer ACS ***/
+
+static int adna_p2p(void)
+{
+  adna_dev_list_all();
+  grow_tree();
+  return p2p_control(first_dev, EepOptions.P2pMode == 2, EepOptions.P2pSave, EepOptions.bForce);
+}
+
+static int adna_p2p_restore(void)
+{
+  struct pci_access *acc = adna_pacc_alloc();
+  int status;
+
+  pci_init(acc);
+  status = p2p_restore(acc, EepOptions.P2pRestore);
+  pci_cleanup(acc);
+  return status;
+}
+
+/*** Path bandwidth ***/
+
+static int adna_bandwidth(void)
+{
+  int status;
+
+  /* The whole bus this time, for the path from the root ports down */
+  adna_dev_list_all();
+  grow_tree();
+  status = path_bandwidth(first_dev);
+  return status;
+}
+
+/*** ASPM latency budget ***/
+
+static int adna_aspm(void)
+{
+  int status;
+
+  adna_dev_list_all();
+  grow_tree();
+  status = aspm_budget(first_dev, EepOptions.AspmMode == 2);
+  return status;
+}
+
+/*** Link audit ***/
+
+static int adna_audit_links(void)
+{
+  struct pci_filter **h1a, **parent;
+  struct pci_access *acc;
+  int count, status;
+
+  count = adna_port_arrays(&h1a, &parent);
+
+  acc = adna_pacc_alloc();
+  pci_init(acc);
+  status = link_audit(acc, h1a, parent, count, EepOptions.AuditTimeout, adna_pacc_alloc);
+  pci_cleanup(acc);
+
+  free(h1a);
+  free(parent);
   return status;
 }
 
@@ -1823,15 +2981,97 @@ static void DisplayHelp(void)
         "\n"
         "EEPROM file utility for Adnacom devices.\n"
         "\n"
-        " Usage: h1a_ee [-w|-s file | -e] [-n serial_num] [-v]\n"
+        " Usage: h1a_ee [-w|-s file | -e [-k]] [-n serial_num] [-v]\n"
+        "        h1a_ee --eep-soak cycles [--soak-range offset:count] [--eep-model]\n"
+        "        h1a_ee --station -w file -n first_serial [--station-reset]\n"
+        "        h1a_ee --async -w file\n"
+        "        h1a_ee --verify file [--verify-report] [--verify-ignore-serial]\n"
+        "        h1a_ee --generate base_file --serials first-last --out dir\n"
+        "        h1a_ee --record dir [--record-window sec] [--record-interval ms]\n"
+        "        h1a_ee --monitor file [--monitor-interval us]\n"
+        "        h1a_ee --tune latency|throughput|power [--tune-save file] [--force]\n"
+        "        h1a_ee --tune-rollback file\n"
+        "        h1a_ee --audit-links [--audit-timeout ms]\n"
+        "        h1a_ee --bandwidth\n"
+        "        h1a_ee --aspm-check | --aspm-budget\n"
+        "        h1a_ee --p2p | --p2p-enable [--p2p-save file] [--force]\n"
+        "        h1a_ee --p2p-restore file\n"
+        "        h1a_ee --query file [--from sec] [--to sec] [--changes]\n"
+        "        h1a_ee --fake-sysfs dir [--fake-count n] | --fake-serve dir\n"
         "\n"
         " Options:\n"
         "   -w | -s       Write (-w) file to EEPROM -OR- Save (-s) EEPROM to file\n"
         "   file          Specifies the file to load or save\n"
         "   -e            Enumerate (-e) Adnacom devices\n"
+        "   -k            Show the kernel driver and modules of each listed device\n"
+        "   --pcimap      modules.pcimap to look modules up in (default for this kernel)\n"
         "   -n            Specifies the serial number to write\n"
         "   -v            Verbose output (for debug purposes)\n"
+        "   --write-retries  Retries for a dword that does not verify after -w, failures\n"
+        "                 are retried once more at the end (default 3, 0 stops at once)\n"
+        "   --retry-backoff  Milliseconds before the first retry, doubled after up to\n"
+        "                 4 s (default 1)\n"
+        "   -A method     Use the given PCI access method, e.g. ecam (-A help for a list)\n"
+        "   -O par=val    Set a PCI access parameter, e.g. ecam.path (-O help for a list)\n"
+        "   -F file       Read the bus from an lspci -x dump instead of the hardware;\n"
+        "                 -O dump.writable=1 accepts writes, -O dump.overlay=file keeps them\n"
+        "                 BAR0 (so the EEPROM) and sysfs remove/rescan are not used\n"
         "   -h or -?      This help screen\n"
+        "   --eep-soak    Write/verify patterns for the given number of cycles\n"
+        "   --soak-range  EEPROM dword offset and count to soak (required on hardware)\n"
+        "   --eep-model   Use the software EEPROM controller model instead of a card\n"
+        "   --eep-model-wear  Writes per dword before the model starts failing\n"
+        "   --station     Stay resident and program every H1A that gets hot-inserted,\n"
+        "                 incrementing the serial number after each passing card\n"
+        "   --station-reset  Hot reset each card after it has been programmed\n"
+        "   --slot-reset  Reset cards by power cycling their slot instead of a secondary\n"
+        "                 bus reset, which is still used if the slot cannot do it\n"
+        "   --async       Program every listed H1A at the same time, each card keeps\n"
+        "                 its serial number\n"
+        "   --qos         Poll the EEPROM controller sparingly, for hosts under load:\n"
+        "                 sleep through the expected command time, then pace reads\n"
+        "   --qos-rate    Status reads per second per device with --qos (default 10000,\n"
+        "                 0 for no limit)\n"
+        "   --qos-host-rate  Status reads per second over all devices (default 40000)\n"
+        "   --verify      Compare the EEPROM of every listed H1A against file, read-only\n"
+        "   --verify-report  List all mismatches instead of stopping at the first one\n"
+        "   --verify-ignore-serial  Do not compare the serial number bytes\n"
+        "   --generate    Write one image per serial number in --serials to --out,\n"
+        "                 plus index.txt with the FNV-1a hash of each; no device needed\n"
+        "   --record dir  Watch the H1As for link errors and write a bundle to dir\n"
+        "                 with the register state at the time of each error\n"
+        "   --record-window  Seconds of sampled status kept in a bundle (default 10)\n"
+        "   --record-interval  Milliseconds between status samples (default 10)\n"
+        "   --monitor file  Sample the H1A and parent port status registers into file\n"
+        "                 until interrupted; unchanged values take almost no space\n"
+        "   --monitor-interval  Microseconds between samples (default 1000)\n"
+        "   --query file  Print the samples in a monitor file as CSV, no device needed\n"
+        "   --from, --to  Time range of the query in seconds since the monitor started\n"
+        "   --changes     Print only the register values that changed\n"
+        "   --tune        Set MPS, MRRS, ASPM, Extended Tags, Relaxed Ordering and\n"
+        "                 No Snoop on everything below the root port of each H1A\n"
+        "   --tune-save   Where the previous settings are saved (default " TUNE_ROLLBACK_FILE ")\n"
+        "   --tune-rollback  Restore the settings saved by --tune, deletes the file\n"
+        "   --force       Replace a rollback file that has not been restored yet\n"
+        "   --audit-links  Check the links of each H1A against their capabilities and\n"
+        "                 retrain the ones running slower or narrower\n"
+        "   --audit-timeout  Milliseconds to wait for a retrain (default 1000)\n"
+        "   --bandwidth   Show the links from the root port to each device behind an\n"
+        "                 H1A and the throughput the slowest of them allows\n"
+        "   --aspm-check  Compare the ASPM exit latencies on the path to each device\n"
+        "                 behind an H1A with what the device accepts\n"
+        "   --aspm-budget Same, then enable on each link just the ASPM states that\n"
+        "                 fit the budget of every device below it\n"
+        "   --p2p         Show ACS on the ports below each H1A and which pairs of\n"
+        "                 devices below it can reach each other directly\n"
+        "   --p2p-enable  Same, then clear ACS Request and Completion Redirect on\n"
+        "                 those ports so peer-to-peer traffic stays in the switch\n"
+        "   --p2p-save    Where the previous settings are saved (default " P2P_ROLLBACK_FILE ")\n"
+        "   --p2p-restore  Restore the settings saved by --p2p-enable\n"
+        "   --sysfs dir   Use dir instead of /sys/bus/pci for all sysfs accesses\n"
+        "   --fake-sysfs dir  Create a fake sysfs tree in dir for use with --sysfs\n"
+        "   --fake-count  Number of H1A devices in the fake tree (default 1)\n"
+        "   --fake-serve dir  Emulate device remove and bus rescan in a fake tree\n"
         "\n"
         "  Sample command\n"
         "  -----------------\n"
@@ -1840,6 +3080,25 @@ static void DisplayHelp(void)
         );
 }
 
+static char *next_arg(int argc, char *argv[], uint16_t *i, const char *what)
+{
+    if ((*i + 1) == argc || argv[*i + 1][0] == '-') {
+        printf("ERROR: %s not specified\n", what);
+        return NULL;
+    }
+    return argv[++*i];
+}
+
+static bool parse_u32(const char *str, uint32_t *value)
+{
+    char *end;
+    unsigned long x = strtoul(str, &end, 0);
+    if (!*str || *end || x > 0xffffffffUL)
+        return false;
+    *value = x;
+    return true;
+}
+
 static uint8_t ProcessCommandLine(int argc, char *argv[])
 {
     uint16_t i;
@@ -1902,9 +3161,264 @@ static uint8_t ProcessCommandLine(int argc, char *argv[])
             bGetFileName = true;
         } else if (strcasecmp(argv[i], "-e") == 0) {
             EepOptions.bListOnly = true;
+        } else if (strcmp(argv[i], "-k") == 0) {
+            opt_kernel = 1;
+        } else if (strcasecmp(argv[i], "--pcimap") == 0) {
+            if (!(opt_pcimap = next_arg(argc, argv, &i, "pcimap file")))
+                return CMD_LINE_ERR;
         } else if (strcasecmp(argv[i], "-n") == 0) {
             EepOptions.bSerialNumber = true;
             bGetSerialNumber = true;
+        } else if (strcasecmp(argv[i], "--eep-soak") == 0) {
+            char *arg = next_arg(argc, argv, &i, "Soak cycle count");
+            if (!arg || !parse_u32(arg, &EepOptions.SoakCycles) || !EepOptions.SoakCycles) {
+                printf("ERROR: Invalid soak cycle count\n");
+                return CMD_LINE_ERR;
+            }
+            EepOptions.bSoak = true;
+        } else if (strcasecmp(argv[i], "--soak-range") == 0) {
+            char *arg = next_arg(argc, argv, &i, "Soak range");
+            char *sep = arg ? strchr(arg, ':') : NULL;
+            if (!sep) {
+                printf("ERROR: Soak range should be given as offset:count\n");
+                return CMD_LINE_ERR;
+            }
+            *sep++ = '\0';
+            if (!parse_u32(arg, &EepOptions.SoakStart) ||
+                !parse_u32(sep, &EepOptions.SoakCount) ||
+                !EepOptions.SoakCount ||
+                EepOptions.SoakStart >= EEP_MODEL_DWORDS ||
+                EepOptions.SoakCount > EEP_MODEL_DWORDS - EepOptions.SoakStart) {
+                printf("ERROR: Invalid soak range\n");
+                return CMD_LINE_ERR;
+            }
+        } else if (strcasecmp(argv[i], "--station") == 0) {
+            EepOptions.bStation = true;
+        } else if (strcasecmp(argv[i], "--station-reset") == 0) {
+            EepOptions.bStationReset = true;
+        } else if (strcasecmp(argv[i], "--slot-reset") == 0) {
+            EepOptions.bSlotReset = true;
+        } else if ((strcmp(argv[i], "-A") == 0) ||
+                   (strcmp(argv[i], "-O") == 0) ||
+                   (strcmp(argv[i], "-F") == 0)) {
+            int opt = argv[i][1];
+            char *arg = next_arg(argc, argv, &i, (opt == 'A') ? "Access method" :
+                                 (opt == 'O') ? "Access parameter" : "Dump file");
+            if (!arg)
+                return CMD_LINE_ERR;
+            if (opt == 'F') {
+                /* Spelled out as the method and its dump.name */
+                if (!add_pci_opt('A', "dump") || !add_pci_opt('O', concat_arg("dump.name=", arg)))
+                    return CMD_LINE_ERR;
+            } else if (!add_pci_opt(opt, arg)) {
+                return CMD_LINE_ERR;
+            }
+            if (opt == 'F' || (opt == 'A' && !strcmp(arg, "dump")))
+                EepOptions.bDump = true;
+        } else if (strcasecmp(argv[i], "--sysfs") == 0) {
+            char *arg = next_arg(argc, argv, &i, "sysfs root");
+            if (!arg)
+                return CMD_LINE_ERR;
+            snprintf(EepOptions.SysfsRoot, sizeof(EepOptions.SysfsRoot), "%s", arg);
+            if (!add_pci_opt('A', "linux-sysfs") || !add_pci_opt('O', concat_arg("sysfs.path=", arg)))
+                return CMD_LINE_ERR;
+        } else if (strcasecmp(argv[i], "--generate") == 0) {
+            char *arg = next_arg(argc, argv, &i, "Base image");
+            if (!arg)
+                return CMD_LINE_ERR;
+            snprintf(EepOptions.GenerateFile, sizeof(EepOptions.GenerateFile), "%s", arg);
+        } else if (strcasecmp(argv[i], "--serials") == 0) {
+            char *arg = next_arg(argc, argv, &i, "Serial number range");
+            char *dash = arg ? strchr(arg, '-') : NULL;
+            if (!dash || dash - arg != 8 || strlen(dash + 1) != 8) {
+                printf("ERROR: Serial number range should be first-last, 8 hex digits each\n");
+                return CMD_LINE_ERR;
+            }
+            *dash = 0;
+            if (!is_valid_hex(arg) || !is_valid_hex(dash + 1)) {
+                printf("ERROR: Invalid hexadecimal input. It should be a valid hexadecimal input (e.g., 0011AABB)\n");
+                return CMD_LINE_ERR;
+            }
+            EepOptions.GenerateFirst = strtoul(arg, NULL, 16);
+            EepOptions.GenerateLast = strtoul(dash + 1, NULL, 16);
+            if (EepOptions.GenerateLast < EepOptions.GenerateFirst) {
+                printf("ERROR: Serial number range is empty\n");
+                return CMD_LINE_ERR;
+            }
+            EepOptions.bGenerateSerials = true;
+        } else if (strcasecmp(argv[i], "--out") == 0) {
+            char *arg = next_arg(argc, argv, &i, "Output directory");
+            if (!arg)
+                return CMD_LINE_ERR;
+            snprintf(EepOptions.GenerateDir, sizeof(EepOptions.GenerateDir), "%s", arg);
+        } else if (strcasecmp(argv[i], "--record") == 0) {
+            char *arg = next_arg(argc, argv, &i, "Recorder directory");
+            if (!arg)
+                return CMD_LINE_ERR;
+            snprintf(EepOptions.RecordDir, sizeof(EepOptions.RecordDir), "%s", arg);
+        } else if (strcasecmp(argv[i], "--record-window") == 0) {
+            char *arg = next_arg(argc, argv, &i, "Recorder window");
+            if (!arg || !parse_u32(arg, &EepOptions.RecordWindow) ||
+                !EepOptions.RecordWindow || EepOptions.RecordWindow > 3600) {
+                printf("ERROR: Invalid recorder window\n");
+                return CMD_LINE_ERR;
+            }
+        } else if (strcasecmp(argv[i], "--record-interval") == 0) {
+            char *arg = next_arg(argc, argv, &i, "Recorder interval");
+            if (!arg || !parse_u32(arg, &EepOptions.RecordInterval) ||
+                !EepOptions.RecordInterval || EepOptions.RecordInterval > 60000) {
+                printf("ERROR: Invalid recorder interval\n");
+                return CMD_LINE_ERR;
+            }
+        } else if (strcasecmp(argv[i], "--write-retries") == 0) {
+            char *arg = next_arg(argc, argv, &i, "Write retries");
+            if (!arg || !parse_u32(arg, &EepOptions.WriteRetries) ||
+                EepOptions.WriteRetries > 16) {
+                printf("ERROR: Invalid write retry count\n");
+                return CMD_LINE_ERR;
+            }
+        } else if (strcasecmp(argv[i], "--retry-backoff") == 0) {
+            char *arg = next_arg(argc, argv, &i, "Retry backoff");
+            if (!arg || !parse_u32(arg, &EepOptions.RetryBackoff) ||
+                EepOptions.RetryBackoff > 1000) {
+                printf("ERROR: Invalid retry backoff\n");
+                return CMD_LINE_ERR;
+            }
+        } else if (strcasecmp(argv[i], "--tune") == 0) {
+            char *arg = next_arg(argc, argv, &i, "Tuning profile");
+            if (!arg)
+                return CMD_LINE_ERR;
+            snprintf(EepOptions.TuneProfile, sizeof(EepOptions.TuneProfile), "%s", arg);
+        } else if (strcasecmp(argv[i], "--tune-save") == 0) {
+            char *arg = next_arg(argc, argv, &i, "Rollback file");
+            if (!arg)
+                return CMD_LINE_ERR;
+            snprintf(EepOptions.TuneSave, sizeof(EepOptions.TuneSave), "%s", arg);
+        } else if (strcasecmp(argv[i], "--tune-rollback") == 0) {
+            char *arg = next_arg(argc, argv, &i, "Rollback file");
+            if (!arg)
+                return CMD_LINE_ERR;
+            snprintf(EepOptions.TuneRollback, sizeof(EepOptions.TuneRollback), "%s", arg);
+        } else if (strcasecmp(argv[i], "--force") == 0) {
+            EepOptions.bForce = true;
+        } else if (strcasecmp(argv[i], "--aspm-check") == 0) {
+            EepOptions.AspmMode = 1;
+        } else if (strcasecmp(argv[i], "--aspm-budget") == 0) {
+            EepOptions.AspmMode = 2;
+        } else if (strcasecmp(argv[i], "--p2p") == 0) {
+            EepOptions.P2pMode = 1;
+        } else if (strcasecmp(argv[i], "--p2p-enable") == 0) {
+            EepOptions.P2pMode = 2;
+        } else if (strcasecmp(argv[i], "--p2p-save") == 0) {
+            char *arg = next_arg(argc, argv, &i, "Rollback file");
+            if (!arg)
+                return CMD_LINE_ERR;
+            snprintf(EepOptions.P2pSave, sizeof(EepOptions.P2pSave), "%s", arg);
+        } else if (strcasecmp(argv[i], "--p2p-restore") == 0) {
+            char *arg = next_arg(argc, argv, &i, "Rollback file");
+            if (!arg)
+                return CMD_LINE_ERR;
+            snprintf(EepOptions.P2pRestore, sizeof(EepOptions.P2pRestore), "%s", arg);
+        } else if (strcasecmp(argv[i], "--qos") == 0) {
+            EepOptions.bQos = true;
+        } else if (strcasecmp(argv[i], "--qos-rate") == 0) {
+            char *arg = next_arg(argc, argv, &i, "QoS poll rate");
+            if (!arg || !parse_u32(arg, &EepOptions.QosDeviceRate) ||
+                EepOptions.QosDeviceRate > 1000000000) {
+                printf("ERROR: Invalid QoS poll rate\n");
+                return CMD_LINE_ERR;
+            }
+            EepOptions.bQos = true;
+        } else if (strcasecmp(argv[i], "--qos-host-rate") == 0) {
+            char *arg = next_arg(argc, argv, &i, "QoS host poll rate");
+            if (!arg || !parse_u32(arg, &EepOptions.QosHostRate) ||
+                EepOptions.QosHostRate > 1000000000) {
+                printf("ERROR: Invalid QoS host poll rate\n");
+                return CMD_LINE_ERR;
+            }
+            EepOptions.bQos = true;
+        } else if (strcasecmp(argv[i], "--async") == 0) {
+            EepOptions.bAsync = true;
+        } else if (strcasecmp(argv[i], "--bandwidth") == 0) {
+            EepOptions.bBandwidth = true;
+        } else if (strcasecmp(argv[i], "--audit-links") == 0) {
+            EepOptions.bAuditLinks = true;
+        } else if (strcasecmp(argv[i], "--audit-timeout") == 0) {
+            char *arg = next_arg(argc, argv, &i, "Audit timeout");
+            if (!arg || !parse_u32(arg, &EepOptions.AuditTimeout) ||
+                !EepOptions.AuditTimeout || EepOptions.AuditTimeout > 60000) {
+                printf("ERROR: Invalid audit timeout\n");
+                return CMD_LINE_ERR;
+            }
+        } else if (strcasecmp(argv[i], "--monitor") == 0) {
+            char *arg = next_arg(argc, argv, &i, "Monitor file");
+            if (!arg)
+                return CMD_LINE_ERR;
+            snprintf(EepOptions.MonitorFile, sizeof(EepOptions.MonitorFile), "%s", arg);
+        } else if (strcasecmp(argv[i], "--monitor-interval") == 0) {
+            char *arg = next_arg(argc, argv, &i, "Monitor interval");
+            if (!arg || !parse_u32(arg, &EepOptions.MonitorInterval) ||
+                EepOptions.MonitorInterval < 100 || EepOptions.MonitorInterval > 60000000) {
+                printf("ERROR: Invalid monitor interval\n");
+                return CMD_LINE_ERR;
+            }
+        } else if (strcasecmp(argv[i], "--query") == 0) {
+            char *arg = next_arg(argc, argv, &i, "Monitor file");
+            if (!arg)
+                return CMD_LINE_ERR;
+            snprintf(EepOptions.QueryFile, sizeof(EepOptions.QueryFile), "%s", arg);
+        } else if (strcasecmp(argv[i], "--from") == 0 ||
+                   strcasecmp(argv[i], "--to") == 0) {
+            bool from = !strcasecmp(argv[i], "--from");
+            char *arg = next_arg(argc, argv, &i, from ? "Query start" : "Query end");
+            char *end;
+            double t;
+            if (!arg)
+                return CMD_LINE_ERR;
+            t = strtod(arg, &end);
+            if (!*arg || *end || t < 0) {
+                printf("ERROR: Invalid query time\n");
+                return CMD_LINE_ERR;
+            }
+            *(from ? &EepOptions.QueryFrom : &EepOptions.QueryTo) = t;
+        } else if (strcasecmp(argv[i], "--changes") == 0) {
+            EepOptions.bQueryChanges = true;
+        } else if (strcasecmp(argv[i], "--fake-sysfs") == 0) {
+            char *arg = next_arg(argc, argv, &i, "Fake sysfs directory");
+            if (!arg)
+                return CMD_LINE_ERR;
+            snprintf(EepOptions.FakeSysfs, sizeof(EepOptions.FakeSysfs), "%s", arg);
+        } else if (strcasecmp(argv[i], "--fake-serve") == 0) {
+            char *arg = next_arg(argc, argv, &i, "Fake sysfs directory");
+            if (!arg)
+                return CMD_LINE_ERR;
+            snprintf(EepOptions.FakeServe, sizeof(EepOptions.FakeServe), "%s", arg);
+        } else if (strcasecmp(argv[i], "--fake-count") == 0) {
+            char *arg = next_arg(argc, argv, &i, "Fake device count");
+            uint32_t count;
+            if (!arg || !parse_u32(arg, &count) || !count || count > 0x10000) {
+                printf("ERROR: Invalid fake device count\n");
+                return CMD_LINE_ERR;
+            }
+            EepOptions.FakeCount = count;
+        } else if (strcasecmp(argv[i], "--verify") == 0) {
+            char *arg = next_arg(argc, argv, &i, "Verify image");
+            if (!arg)
+                return CMD_LINE_ERR;
+            snprintf(EepOptions.VerifyFile, sizeof(EepOptions.VerifyFile), "%s", arg);
+            EepOptions.bVerify = true;
+        } else if (strcasecmp(argv[i], "--verify-report") == 0) {
+            EepOptions.bVerifyReport = true;
+        } else if (strcasecmp(argv[i], "--verify-ignore-serial") == 0) {
+            EepOptions.bVerifyIgnoreSerial = true;
+        } else if (strcasecmp(argv[i], "--eep-model") == 0) {
+            EepOptions.bModel = true;
+        } else if (strcasecmp(argv[i], "--eep-model-wear") == 0) {
+            char *arg = next_arg(argc, argv, &i, "Model wear limit");
+            if (!arg || !parse_u32(arg, &EepOptions.ModelWear)) {
+                printf("ERROR: Invalid model wear limit\n");
+                return CMD_LINE_ERR;
+            }
         } else {
             printf("ERROR: Invalid argument \'%s\'\n", argv[i]);
             return CMD_LINE_ERR;
@@ -1927,6 +3441,60 @@ static uint8_t ProcessCommandLine(int argc, char *argv[])
     // Make sure required parameters were provided
     if (EepOptions.bListOnly == true) {
         // Allow list only
+    } else if (EepOptions.bSoak == true) {
+        if (EepOptions.SoakCount == 0) {
+            if (!EepOptions.bModel) {
+                printf("ERROR: --soak-range is required when soaking a real EEPROM\n");
+                return CMD_LINE_ERR;
+            }
+            EepOptions.SoakCount = EEP_MODEL_DWORDS;
+        }
+    } else if (EepOptions.bVerify == true) {
+        // Image is checked when it gets mapped
+    } else if (EepOptions.FakeSysfs[0] || EepOptions.FakeServe[0]) {
+        // Nothing else needed
+    } else if (EepOptions.GenerateFile[0]) {
+        if (!EepOptions.bGenerateSerials || !EepOptions.GenerateDir[0]) {
+            printf("ERROR: --generate needs --serials and --out\n");
+            return CMD_LINE_ERR;
+        }
+    } else if (EepOptions.RecordDir[0]) {
+        // Runs until interrupted
+    } else if (EepOptions.MonitorFile[0]) {
+        // Runs until interrupted
+    } else if (EepOptions.TuneProfile[0] || EepOptions.TuneRollback[0]) {
+        // Profile name is checked when tuning
+    } else if (EepOptions.bAuditLinks == true || EepOptions.bBandwidth == true ||
+               EepOptions.AspmMode || EepOptions.P2pMode || EepOptions.P2pRestore[0]) {
+        // Nothing else needed
+    } else if (EepOptions.QueryFile[0]) {
+        if (EepOptions.QueryTo >= 0 && EepOptions.QueryFrom > EepOptions.QueryTo) {
+            printf("ERROR: Query time range is empty\n");
+            return CMD_LINE_ERR;
+        }
+    } else if (EepOptions.bAsync == true) {
+        if ((EepOptions.bLoadFile != true) || (EepOptions.FileName[0] == '\0')) {
+            printf("ERROR: --async needs an image (-w)\n");
+            return CMD_LINE_ERR;
+        }
+        if (EepOptions.bSerialNumber == true) {
+            printf("ERROR: --async keeps the serial number of each card, -n is not supported\n");
+            return CMD_LINE_ERR;
+        }
+        if (!is_file_exist(&pFile))
+          return EXIT_FAILURE;
+        fclose(pFile);
+    } else if (EepOptions.bStation == true) {
+        if ((EepOptions.bLoadFile != true) || (EepOptions.bSerialNumber != true)) {
+            printf("ERROR: Station mode needs an image (-w) and a first serial number (-n)\n");
+            return CMD_LINE_ERR;
+        }
+        if (!is_file_exist(&pFile))
+          return EXIT_FAILURE;
+        fclose(pFile);
+    } else if (EepOptions.bModel == true) {
+        printf("ERROR: --eep-model is only supported with --eep-soak\n");
+        return CMD_LINE_ERR;
     } else if ((EepOptions.bLoadFile == 0xFF) || (EepOptions.FileName[0] == '\0')) {
         printf("ERROR: EEPROM operation not specified. Use 'h1a_ee -h' for usage.\n");
         return EXIT_FAILURE;
@@ -1950,6 +3518,20 @@ int main(int argc, char **argv)
   EepOptions.bListOnly = false;
   EepOptions.bIsInit = false;
   EepOptions.bIsNotPresent = false;
+  snprintf(EepOptions.SysfsRoot, sizeof(EepOptions.SysfsRoot), "%s", PCI_PATH_SYS_BUS_PCI);
+  EepOptions.FakeCount = 1;
+  EepOptions.RecordWindow = 10;
+  EepOptions.RecordInterval = 10;
+  EepOptions.MonitorInterval = 1000;
+  EepOptions.WriteRetries = 3;
+  EepOptions.RetryBackoff = 1;
+  snprintf(EepOptions.TuneSave, sizeof(EepOptions.TuneSave), "%s", TUNE_ROLLBACK_FILE);
+  snprintf(EepOptions.P2pSave, sizeof(EepOptions.P2pSave), "%s", P2P_ROLLBACK_FILE);
+  EepOptions.AuditTimeout = 1000;
+  EepOptions.QosDeviceRate = QOS_DEVICE_RATE;
+  EepOptions.QosHostRate = QOS_HOST_RATE;
+  EepOptions.QueryFrom = -1;
+  EepOptions.QueryTo = -1;
 
   if (argc == 2 && !strcmp(argv[1], "--version")) {
     puts("Adnacom version " ADNATOOL_VERSION);
@@ -1960,6 +3542,60 @@ int main(int argc, char **argv)
   if (status != EXIT_SUCCESS)
     exit(1);
 
+  if (EepOptions.bModel) {
+    struct device model_dev;
+
+    memset(&model_dev, 0, sizeof(model_dev));
+    eep_backend = &eep_model_methods;
+    eep_model_setup(1, EepOptions.ModelWear, 2);
+    status = eep_soak(&model_dev, EepOptions.SoakCycles,
+                      EepOptions.SoakStart, EepOptions.SoakCount);
+    return (status == EXIT_SUCCESS) ? 0 : 1;
+  }
+
+  /* A dump has no BAR0, its EEPROM reads as absent and the recovery runs on the dump */
+  if (EepOptions.bDump) {
+    eep_backend = &eep_model_methods;
+    eep_model_setup(0, 0, 0);
+  }
+
+  if (EepOptions.GenerateFile[0]) {
+    status = eep_generate(EepOptions.GenerateFile, EepOptions.GenerateFirst,
+                          EepOptions.GenerateLast, EepOptions.GenerateDir);
+    return (status == EXIT_SUCCESS) ? 0 : 1;
+  }
+
+  if (EepOptions.QueryFile[0]) {
+    status = monitor_query(EepOptions.QueryFile, EepOptions.QueryFrom,
+                           EepOptions.QueryTo, EepOptions.bQueryChanges);
+    return (status == EXIT_SUCCESS) ? 0 : 1;
+  }
+
+  if (EepOptions.TuneRollback[0]) {
+    status = adna_tune_rollback();
+    return (status == EXIT_SUCCESS) ? 0 : 1;
+  }
+
+  if (EepOptions.P2pRestore[0]) {
+    status = adna_p2p_restore();
+    return (status == EXIT_SUCCESS) ? 0 : 1;
+  }
+
+  if (EepOptions.FakeSysfs[0]) {
+    status = fake_sysfs_create(EepOptions.FakeSysfs, EepOptions.FakeCount);
+    return (status == EXIT_SUCCESS) ? 0 : 1;
+  }
+
+  if (EepOptions.FakeServe[0]) {
+    status = fake_sysfs_serve(EepOptions.FakeServe);
+    return (status == EXIT_SUCCESS) ? 0 : 1;
+  }
+
+  if (EepOptions.bStation) {
+    status = adna_station();
+    return (status == EXIT_SUCCESS) ? 0 : 1;
+  }
+
   status = adna_pci_process();
   if (status != EXIT_SUCCESS)
     exit(1);
@@ -1971,6 +3607,62 @@ int main(int argc, char **argv)
   if (EepOptions.bListOnly == true)
     goto __exit;
 
+  if (EepOptions.bVerify == true) {
+    if (adna_verify() != EXIT_SUCCESS)
+      seen_errors++;
+    goto __exit;
+  }
+
+  if (EepOptions.RecordDir[0]) {
+    if (adna_record() != EXIT_SUCCESS)
+      seen_errors++;
+    goto __exit;
+  }
+
+  if (EepOptions.MonitorFile[0]) {
+    if (adna_monitor() != EXIT_SUCCESS)
+      seen_errors++;
+    goto __exit;
+  }
+
+  if (EepOptions.TuneProfile[0]) {
+    if (adna_tune() != EXIT_SUCCESS)
+      seen_errors++;
+    goto __exit;
+  }
+
+  if (EepOptions.bAuditLinks) {
+    if (adna_audit_links() != EXIT_SUCCESS)
+      seen_errors++;
+    goto __exit;
+  }
+
+  if (EepOptions.bBandwidth) {
+    if (adna_bandwidth() != EXIT_SUCCESS)
+      seen_errors++;
+    goto __exit;
+  }
+
+  if (EepOptions.AspmMode) {
+    if (adna_aspm() != EXIT_SUCCESS)
+      seen_errors++;
+    goto __exit;
+  }
+
+  if (EepOptions.P2pMode) {
+    if (adna_p2p() != EXIT_SUCCESS)
+      seen_errors++;
+    goto __exit;
+  }
+
+  if (EepOptions.bAsync) {
+    if (adna_async() != EXIT_SUCCESS)
+      seen_errors++;
+    goto __exit;
+  }
+
+  adna_prefetch_start();
+
   printf("[0] Cancel\n\n");
   char line[10];
   int num;
@@ -1989,7 +3681,9 @@ int main(int argc, char **argv)
     }
   }
 
+  eep_prefetch_stop();
   status = eep_process(num); // first check
+  eep_prefetch_free();      // the recovery below resets the card
 
   if (status == EXIT_SUCCESS)
     goto __exit;
@@ -2008,6 +3702,8 @@ int main(int argc, char **argv)
   else {}
 
 __exit:
+  eep_prefetch_free();
   adna_delete_list();
+  adna_dev_list_free();
   return (seen_errors ? 2 : 0);
 }
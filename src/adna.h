@@ -60,6 +60,17 @@ void get_subid(struct device *d, word *subvp, word *subdp);
 #define PCI_CAP_PM_STATE_D2                     0x02
 #define PCI_CAP_PM_STATE_D3_HOT                 0x03
 
+/* EEPROM controller polling of one device, see check_for_ready_or_done() */
+struct eep_poll {
+  u64 issued_ns;			/* When the command in flight was written */
+  u64 last_ns;				/* Last status read */
+  u64 est_ns[8];			/* Learned time to completion, by command */
+  u64 reads;				/* Controller register reads, each one crosses the fabric */
+  int cmd;
+  bool pending;				/* A command was written and not yet seen complete */
+  bool idle;				/* Seen complete, nothing written since */
+};
+
 struct device {
   struct device *next;
   struct pci_dev *dev;
@@ -71,6 +82,10 @@ struct device {
   unsigned int config_cached, config_bufsize;
   byte *config;				/* Cached configuration space data */
   byte *present;			/* Maps which configuration bytes are present */
+  volatile uint32_t *bar0;		/* BAR0 mapping held by eep_hw_map() */
+  size_t bar0_size;			/* Length of the mapping, all of BAR0 */
+  struct eep_shadow *shadow;		/* EEPROM contents seen so far, owned by adna_device */
+  struct eep_poll poll;
   int NumDevice;
 };
 
@@ -92,6 +107,38 @@ struct bus {
   struct device *first_dev, **last_dev;
 };
 
+/* common.c */
+
+#define ROLLBACK_MAX_REGS 4
+
+struct rollback_line {
+  struct pci_dev *dev;			/* Caller frees */
+  int nregs;
+  int reg[ROLLBACK_MAX_REGS];
+  u16 val[ROLLBACK_MAX_REGS];
+};
+
+int pcie_cap(struct pci_dev *p);
+int pcie_dev_cap(struct device *d);
+int pcie_type(struct device *d, int exp);
+struct device *pcie_parent(struct device *d);
+bool pcie_is_h1a(struct device *d);
+void pcie_name(char *buf, size_t len, struct pci_dev *p);
+const char *pcie_speed_name(int speed);
+FILE *rollback_create(const char *name, const char *what, const char *restore, bool force);
+void rollback_entry(FILE *f, struct pci_dev *p, int nregs, const int *reg, const u16 *val);
+int rollback_close(FILE *f, const char *name);
+int rollback_read(FILE *f, const char *name, int *lineno, int nregs, struct pci_access *a,
+                  struct rollback_line *l);
+void rollback_remove(const char *name);
+
+/* adna.c */
+
+bool pci_is_upstream(struct pci_dev *pdev);
+bool pcidev_is_adnacom(struct pci_dev *p);
+int adna_remove_downstream(struct pci_filter *f);
+int adna_rescan_pci(void);
+
 /* ls-vpd.c */
 
 void cap_vpd(struct device *d);
@@ -125,3 +172,114 @@ void show_forest(struct pci_filter *filter);
 
 void map_the_bus(void);
 void adna_set_d3_flag(int devnum);
+
+/* uevent.c */
+
+struct uevent {
+  char action[16];
+  char subsystem[32];
+  char slot[32];			/* PCI_SLOT_NAME */
+  unsigned int vendor, device;		/* PCI_ID */
+};
+
+int uevent_open(void);
+int uevent_recv(int fd, struct uevent *ev);
+
+/* fake-sysfs.c */
+
+int fake_sysfs_create(const char *root, int count);
+int fake_sysfs_serve(const char *root);
+
+/* p2p.c */
+
+int p2p_control(struct device *first, bool enable, const char *rollback, bool force);
+int p2p_restore(struct pci_access *a, const char *name);
+
+/* slot-reset.c */
+
+#define SLOT_NO_POWER  2			/* No slot power controller, reset another way */
+
+struct slot_timing {
+  u64 off_ns;				/* Power off to link down */
+  u64 present_ns, link_ns;		/* Power on to presence, to link up */
+  u64 total_ns;
+};
+
+int slot_power_cycle(struct pci_dev *p, struct slot_timing *t);
+
+/* recorder.c */
+
+struct recorder_options {
+  const char *dir;			/* Where bundles are written */
+  unsigned int window_ms;		/* History kept in the ring */
+  unsigned int interval_ms;		/* Sampling period */
+};
+
+int recorder_run(struct pci_access *a, struct pci_filter **h1a, struct pci_filter **parent,
+                 int count, const struct recorder_options *opt);
+
+/* mon-store.c */
+
+struct mon_column {
+  u16 domain;
+  u8 bus, dev, func;
+  u8 width;				/* Register width in bytes */
+  u16 reg;				/* Config space offset */
+  char name[24];
+};
+
+struct mon_header {
+  char magic[8];
+  u32 ncolumns, pad;
+  u64 start_ns;				/* CLOCK_REALTIME at tick 0 */
+  u64 interval_ns;			/* Time between ticks */
+  u64 used;				/* Valid bytes, the header included */
+  u64 last_index;			/* Newest index block, 0 if none */
+  u64 index_end;			/* End of the data covered by the index */
+  u64 data_start;			/* First segment, past the column table */
+  struct mon_column columns[];		/* ncolumns of them */
+};
+
+typedef void mon_sample_fn(void *ctx, u64 tick, const u32 *values);
+
+struct mon_writer;
+struct mon_reader;
+
+struct mon_writer *mon_create(const char *name, const struct mon_column *cols,
+                              int ncols, u64 interval_ns);
+int mon_append(struct mon_writer *w, u64 tick, const u32 *values);
+int mon_close(struct mon_writer *w);
+struct mon_reader *mon_open(const char *name);
+const struct mon_header *mon_info(struct mon_reader *r);
+int mon_scan(struct mon_reader *r, u64 from, u64 to, mon_sample_fn *fn, void *ctx);
+void mon_close_reader(struct mon_reader *r);
+
+/* monitor.c */
+
+int monitor_run(struct pci_access *a, struct pci_filter **h1a, struct pci_filter **parent,
+                int count, const char *name, unsigned int interval_us);
+int monitor_query(const char *name, double from, double to, bool changes);
+
+/* tune.c */
+
+int tune_apply(struct pci_access *a, struct pci_filter **h1a, int count,
+               const char *profile, const char *rollback, bool force);
+int tune_rollback(struct pci_access *a, const char *name);
+
+/* link-audit.c */
+
+int link_audit(struct pci_access *a, struct pci_filter **h1a, struct pci_filter **parent,
+               int count, unsigned int timeout_ms, struct pci_access *(*new_access)(void));
+
+/* path-bw.c */
+
+int path_bandwidth(struct device *first);
+
+/* aspm.c */
+
+int aspm_budget(struct device *first, bool apply);
+
+/* ls-pipeline.c */
+
+void list_devices(struct device **devs, int count, void (*show)(struct device *),
+                  struct pci_access *(*new_access)(void));
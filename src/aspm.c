@@ -0,0 +1,290 @@
+/*
+ *	H1A EEPROM Tool -- ASPM Exit Latency Budget
+ *
+ *	Copyright (c) 2023 Adnacom, Inc.
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "adna.h"
+
+/*
+ * Decides per link whether L0s and L1 can be enabled without an endpoint
+ * behind it seeing more exit latency than it declares acceptable in DevCap.
+ * This is the check the Linux ASPM driver does: the L0s exit latency of
+ * every link on the path must be within the endpoint's L0s budget on its
+ * own, while for L1 the exit latency of each link is counted together with
+ * 1us for every switch the wakeup has to travel through on the way down.
+ * A link runs between a port and the component below it, so it is kept
+ * once per component: it gets the states allowed by all the endpoints
+ * below it and supported by both of its ends and every function of the
+ * downstream component, and LnkCtl of all those functions is written
+ * together. Links with no endpoint below them are left as they are.
+ */
+
+#define ASPM_L0S        1
+#define ASPM_L1         2
+#define ASPM_UNLIMITED  (~0U)
+
+struct aspm_link {
+  struct device *up, *down;
+  int supported, allowed, current;
+  unsigned int l0s_ns, l1_ns;		/* Exit latency, worse of the two ends */
+  bool used;
+};
+
+/*
+ * Exit latencies in LnkCap. Encoding 7 means more than the largest step,
+ * which Linux counts as 5us and 65us in calc_l0s_latency() and
+ * calc_l1_latency().
+ */
+static unsigned int aspm_l0s_exit_ns(int value)
+{
+  return (value == 7) ? 5000 : 64U << value;
+}
+
+static unsigned int aspm_l1_exit_ns(int value)
+{
+  return (value == 7) ? 65000 : 1000U << value;
+}
+
+/* Acceptable latencies in DevCap, where encoding 7 means no limit */
+static unsigned int aspm_l0s_acc_ns(int value)
+{
+  return (value == 7) ? ASPM_UNLIMITED : 64U << value;
+}
+
+static unsigned int aspm_l1_acc_ns(int value)
+{
+  return (value == 7) ? ASPM_UNLIMITED : 1000U << value;
+}
+
+static unsigned int aspm_max(unsigned int a, unsigned int b)
+{
+  return (a > b) ? a : b;
+}
+
+static const char *aspm_name(int states)
+{
+  static const char *names[] = { "off", "L0s", "L1", "L0s L1" };
+  return names[states & 3];
+}
+
+static const char *aspm_ns(char *buf, size_t len, unsigned int ns)
+{
+  if (ns == ASPM_UNLIMITED)
+    snprintf(buf, len, "unlimited");
+  else if (ns >= 1000)
+    snprintf(buf, len, "%uus", ns / 1000);
+  else
+    snprintf(buf, len, "%uns", ns);
+  return buf;
+}
+
+static bool aspm_same_component(struct device *a, struct device *b)
+{
+  return a->dev->domain == b->dev->domain && a->dev->bus == b->dev->bus &&
+         a->dev->dev == b->dev->dev;
+}
+
+/* The link above the component of d, created on first use, d's caps folded in */
+static struct aspm_link *aspm_link(struct aspm_link *links, int *n, struct device *d, struct device *up)
+{
+  struct aspm_link *l = NULL;
+  int dexp = pcie_dev_cap(d), uexp = pcie_dev_cap(up);
+  u32 dcap, ucap;
+
+  for (int i = 0; i < *n && !l; i++)
+    if (aspm_same_component(links[i].down, d))
+      l = &links[i];
+  if (!uexp)
+    return NULL;
+
+  dcap = get_conf_long(d, dexp + PCI_EXP_LNKCAP);
+  ucap = get_conf_long(up, uexp + PCI_EXP_LNKCAP);
+  if (!l) {
+    l = &links[(*n)++];
+    memset(l, 0, sizeof(*l));
+    l->up = up;
+    l->down = d;
+    l->supported = l->allowed = PCI_EXP_LNKCAP_ASPM >> 10;
+  }
+  l->supported &= (dcap & ucap & PCI_EXP_LNKCAP_ASPM) >> 10;
+  l->allowed &= l->supported;
+  l->current |= get_conf_word(d, dexp + PCI_EXP_LNKCTL) & PCI_EXP_LNKCTL_ASPM;
+  l->l0s_ns = aspm_max(l->l0s_ns, aspm_max(aspm_l0s_exit_ns((dcap & PCI_EXP_LNKCAP_L0S) >> 12),
+                                           aspm_l0s_exit_ns((ucap & PCI_EXP_LNKCAP_L0S) >> 12)));
+  l->l1_ns = aspm_max(l->l1_ns, aspm_max(aspm_l1_exit_ns((dcap & PCI_EXP_LNKCAP_L1) >> 15),
+                                         aspm_l1_exit_ns((ucap & PCI_EXP_LNKCAP_L1) >> 15)));
+  return l;
+}
+
+/* Apply the budget of one endpoint to the links above it, false if not behind an H1A */
+static bool aspm_endpoint(struct aspm_link *links, int *n, struct device *ep, int exp)
+{
+  u32 devcap = get_conf_long(ep, exp + PCI_EXP_DEVCAP);
+  unsigned int acc_l0s = aspm_l0s_acc_ns((devcap & PCI_EXP_DEVCAP_L0S) >> 6);
+  unsigned int acc_l1 = aspm_l1_acc_ns((devcap & PCI_EXP_DEVCAP_L1) >> 9);
+  unsigned int switch_ns = 0;
+  struct aspm_link *path[16];
+  struct device *d, *up;
+  bool behind_h1a = false;
+  int npath = 0;
+
+  for (d = ep; d && npath < 16; d = up) {
+    int dexp = pcie_dev_cap(d), type;
+    struct aspm_link *l;
+
+    up = pcie_parent(d);
+    if (!dexp)
+      break;
+    if (pcidev_is_adnacom(d->dev) && pci_is_upstream(d->dev))
+      behind_h1a = true;
+    type = pcie_type(d, dexp);
+    if (!up || type == PCI_EXP_TYPE_ROOT_PORT || type == PCI_EXP_TYPE_DOWNSTREAM)
+      continue;
+    if (!(l = aspm_link(links, n, d, up)))
+      continue;
+    path[npath++] = l;
+  }
+  if (!behind_h1a)
+    return false;
+
+  for (int i = 0; i < npath; i++) {
+    struct aspm_link *l = path[i];
+
+    l->used = true;
+    if (l->l0s_ns > acc_l0s)
+      l->allowed &= ~ASPM_L0S;
+    if (acc_l1 != ASPM_UNLIMITED && l->l1_ns + switch_ns > acc_l1)
+      l->allowed &= ~ASPM_L1;
+    switch_ns += 1000;
+  }
+  return true;
+}
+
+/*
+ * LnkCtl ASPM Control of one port, or of every function of the component
+ * below a link. Functions of the component above a link can be separate
+ * ports with links of their own, as the root ports of a root complex are.
+ */
+static void aspm_write(struct device *first, struct device *end, bool component, int states)
+{
+  for (struct device *d = first; d; d = d->next) {
+    int exp;
+
+    if (component ? !aspm_same_component(d, end) : d != end)
+      continue;
+    if (!(exp = pcie_dev_cap(d)))
+      continue;
+    pci_write_word(d->dev, exp + PCI_EXP_LNKCTL,
+                   (get_conf_word(d, exp + PCI_EXP_LNKCTL) & ~PCI_EXP_LNKCTL_ASPM) | states);
+  }
+}
+
+/* Read one end back past the config cache set up by scan_device() */
+static bool aspm_verify(struct device *d, int states)
+{
+  int exp = pcie_dev_cap(d);
+  char name[16];
+
+  pci_setup_cache(d->dev, NULL, 0);
+  if ((pci_read_word(d->dev, exp + PCI_EXP_LNKCTL) & PCI_EXP_LNKCTL_ASPM) == states)
+    return true;
+  pcie_name(name, sizeof(name), d->dev);
+  printf("ERROR: %s did not take ASPM %s\n", name, aspm_name(states));
+  return false;
+}
+
+/*
+ * States are turned off at the downstream end first and turned on at the
+ * upstream end first, so the ends never disagree in the unsafe direction.
+ */
+static void aspm_set(struct device *first, struct aspm_link *l)
+{
+  int keep = l->current & l->allowed;
+
+  if (keep != l->current) {
+    aspm_write(first, l->down, true, keep);
+    aspm_write(first, l->up, false, keep);
+  }
+  if (l->allowed != keep) {
+    aspm_write(first, l->up, false, l->allowed);
+    aspm_write(first, l->down, true, l->allowed);
+  }
+}
+
+int aspm_budget(struct device *first, bool apply)
+{
+  struct aspm_link *links;
+  struct device *d;
+  int n = 0, max = 0, endpoints = 0, changed = 0, bad = 0;
+  char a[16], b[16], l0s[16], l1[16];
+
+  for (d = first; d; d = d->next)
+    max++;
+  links = xmalloc((max + 1) * sizeof(*links));
+
+  for (d = first; d; d = d->next) {
+    int exp = pcie_dev_cap(d), type;
+
+    if (!exp)
+      continue;
+    type = pcie_type(d, exp);
+    if ((type == PCI_EXP_TYPE_ENDPOINT || type == PCI_EXP_TYPE_LEG_END) &&
+        aspm_endpoint(links, &n, d, exp))
+      endpoints++;
+  }
+  if (!endpoints) {
+    printf("No endpoints found behind the H1A device(s)\n");
+    free(links);
+    return EXIT_SUCCESS;
+  }
+
+  printf("%-13s    %-13s %-8s %-9s %-9s %-8s %-8s\n",
+         "Upstream", "Downstream", "Support", "L0s exit", "L1 exit", "Current", "Allowed");
+  for (int i = 0; i < n; i++) {
+    struct aspm_link *l = &links[i];
+
+    if (!l->used)
+      continue;
+    pcie_name(a, sizeof(a), l->up->dev);
+    pcie_name(b, sizeof(b), l->down->dev);
+    printf("%s -> %s  %-8s %-9s %-9s %-8s %-8s\n", a, b, aspm_name(l->supported),
+           aspm_ns(l0s, sizeof(l0s), l->l0s_ns), aspm_ns(l1, sizeof(l1), l->l1_ns),
+           aspm_name(l->current), aspm_name(l->allowed));
+    if (l->current & ~l->allowed)
+      bad++;
+  }
+
+  if (!apply) {
+    printf("%d link(s) with ASPM states over the latency budget\n", bad);
+    free(links);
+    return EXIT_SUCCESS;
+  }
+
+  for (int i = 0; i < n; i++)
+    if (links[i].used && links[i].current != links[i].allowed) {
+      aspm_set(first, &links[i]);
+      changed++;
+    }
+
+  bad = 0;
+  for (int i = 0; i < n; i++) {
+    struct aspm_link *l = &links[i];
+
+    if (!l->used)
+      continue;
+    if (!aspm_verify(l->up, l->allowed))
+      bad++;
+    if (!aspm_verify(l->down, l->allowed))
+      bad++;
+  }
+  printf("ASPM changed on %d link(s)%s\n", changed, bad ? ", some did not verify" : "");
+  free(links);
+  return bad ? EXIT_FAILURE : EXIT_SUCCESS;
+}
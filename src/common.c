@@ -11,8 +11,11 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <unistd.h>
+#include <time.h>
+#include <errno.h>
 
 #include "pciutils.h"
+#include "adna.h"
 
 void NONRET
 die(char *msg, ...)
@@ -53,6 +56,29 @@ xstrdup(const char *str)
   return copy;
 }
 
+u64
+monotonic_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Sleep until a monotonic_ns() deadline, at once if it has passed */
+void
+sleep_until(u64 deadline)
+{
+  u64 now = monotonic_ns();
+  struct timespec ts;
+
+  if (now >= deadline)
+    return;
+  ts.tv_sec = (deadline - now) / 1000000000;
+  ts.tv_nsec = (deadline - now) % 1000000000;
+  nanosleep(&ts, NULL);
+}
+
 static void
 set_pci_method(struct pci_access *pacc, char *arg)
 {
@@ -133,3 +159,165 @@ parse_generic_option(int i, struct pci_access *pacc, char *arg)
     }
   return 1;
 }
+
+/*
+ *  PCI Express helpers shared by the port tools (tuning, link audit, path
+ *  bandwidth, ASPM and peer-to-peer), and the rollback files written by
+ *  the ones that change registers.
+ */
+
+int
+pcie_cap(struct pci_dev *p)
+{
+  struct pci_cap *cap;
+
+  pci_fill_info(p, PCI_FILL_CAPS);
+  cap = pci_find_cap(p, PCI_CAP_ID_EXP, PCI_CAP_NORMAL);
+  return cap ? cap->addr : 0;
+}
+
+/* PCI Express capability of a listed device, cached up to Link Status */
+int
+pcie_dev_cap(struct device *d)
+{
+  int exp = pcie_cap(d->dev);
+
+  if (!exp || !config_fetch(d, exp, PCI_EXP_LNKSTA + 2))
+    return 0;
+  return exp;
+}
+
+int
+pcie_type(struct device *d, int exp)
+{
+  return (get_conf_word(d, exp + PCI_EXP_FLAGS) & PCI_EXP_FLAGS_TYPE) >> 4;
+}
+
+/* Bridge above d in the tree from grow_tree(), NULL below the host bridge */
+struct device *
+pcie_parent(struct device *d)
+{
+  struct bridge *b = d->parent_bus ? d->parent_bus->parent_bridge : NULL;
+
+  return (b && b != &host_bridge) ? b->br_dev : NULL;
+}
+
+bool
+pcie_is_h1a(struct device *d)
+{
+  return pcidev_is_adnacom(d->dev) && pci_is_upstream(d->dev);
+}
+
+void
+pcie_name(char *buf, size_t len, struct pci_dev *p)
+{
+  snprintf(buf, len, "%04x:%02x:%02x.%d", p->domain, p->bus, p->dev, p->func);
+}
+
+/* Link Speed code as in LnkCap and LnkSta */
+const char *
+pcie_speed_name(int speed)
+{
+  static const char *names[] = { "?", "2.5GT/s", "5GT/s", "8GT/s", "16GT/s", "32GT/s", "64GT/s" };
+  return (speed > 0 && speed < (int)(sizeof(names) / sizeof(*names))) ? names[speed] : "?";
+}
+
+/*
+ * A rollback file holds one line per function, its address and the old
+ * values of the registers about to change:
+ *
+ *   dddd:bb:dd.f rrr.w=vvvv [rrr.w=vvvv ...]
+ *
+ * An existing file is never replaced unless forced, since a second run
+ * would save its own settings over the original ones.
+ */
+FILE *
+rollback_create(const char *name, const char *what, const char *restore, bool force)
+{
+  FILE *f = fopen(name, force ? "w" : "wx");
+
+  if (!f && errno == EEXIST) {
+    printf("ERROR: \"%s\" holds settings saved before, restore them with %s\n"
+           "       first or replace them with --force\n", name, restore);
+    return NULL;
+  }
+  if (!f) {
+    printf("ERROR: Unable to write \"%s\" (%s)\n", name, strerror(errno));
+    return NULL;
+  }
+  fprintf(f, "# H1A %s rollback, apply with %s\n", what, restore);
+  return f;
+}
+
+void
+rollback_entry(FILE *f, struct pci_dev *p, int nregs, const int *reg, const u16 *val)
+{
+  fprintf(f, "%04x:%02x:%02x.%d", p->domain, p->bus, p->dev, p->func);
+  for (int i = 0; i < nregs; i++)
+    fprintf(f, " %03x.w=%04x", reg[i], val[i]);
+  fputc('\n', f);
+}
+
+/* The rollback must be on disk before the first register changes */
+int
+rollback_close(FILE *f, const char *name)
+{
+  if (fflush(f) || fsync(fileno(f)) || fclose(f)) {
+    printf("ERROR: Unable to write \"%s\" (%s)\n", name, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Next line of a rollback file, which must hold nregs registers, and its
+ * function looked up in a. Returns 1 for a function that is present, 0 at
+ * the end of the file and -1 for a line that is invalid or names a missing
+ * function, reported here.
+ */
+int
+rollback_read(FILE *f, const char *name, int *lineno, int nregs, struct pci_access *a,
+              struct rollback_line *l)
+{
+  char line[256], *s;
+  unsigned int dom, bus, dev, func, reg, val;
+  int len;
+
+  do {
+    if (!fgets(line, sizeof(line), f))
+      return 0;
+    (*lineno)++;
+  } while (line[0] == '#' || line[0] == '\n');
+
+  l->nregs = 0;
+  if (sscanf(line, "%x:%x:%x.%x%n", &dom, &bus, &dev, &func, &len) != 4)
+    goto invalid;
+  for (s = line + len; sscanf(s, " %x.w=%x%n", &reg, &val, &len) == 2; s += len) {
+    if (l->nregs >= ROLLBACK_MAX_REGS || reg > 0xffe || val > 0xffff)
+      goto invalid;
+    l->reg[l->nregs] = reg;
+    l->val[l->nregs++] = val;
+  }
+  if (l->nregs != nregs || strspn(s, " \t\r\n") != strlen(s))
+    goto invalid;
+
+  l->dev = pci_get_dev(a, dom, bus, dev, func);
+  if (pci_read_word(l->dev, PCI_VENDOR_ID) == 0xffff) {
+    printf("ERROR: %04x:%02x:%02x.%d is not present\n", dom, bus, dev, func);
+    pci_free_dev(l->dev);
+    return -1;
+  }
+  return 1;
+
+invalid:
+  printf("ERROR: %s:%d: Invalid line\n", name, *lineno);
+  return -1;
+}
+
+/* A rollback that was applied in full is not kept around */
+void
+rollback_remove(const char *name)
+{
+  if (unlink(name))
+    printf("WARNING: Unable to delete \"%s\" (%s)\n", name, strerror(errno));
+}
@@ -0,0 +1,194 @@
+/*
+ *	H1A EEPROM Tool -- Offline Generation of Serialized Images
+ *
+ *	Copyright (c) 2023 Adnacom, Inc.
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "adna.h"
+#include "eep.h"
+
+/*
+ * One image per serial number, each the base image with the serial field
+ * replaced. A worker keeps a single copy of the base and only rewrites the
+ * four serial bytes between units, so the work per unit is one write() of
+ * the whole file and the FNV-1a hash for the index, which starts from the
+ * state after the unchanging bytes in front of the serial.
+ */
+
+#define GEN_BATCH        64			/* Units claimed by a worker at once */
+#define GEN_MAX_THREADS  16
+
+#define FNV1A_OFFSET     0xcbf29ce484222325ULL
+#define FNV1A_PRIME      0x100000001b3ULL
+
+struct gen_job {
+  const struct eep_mapped_image *img;
+  const char *dir;
+  uint32_t first;
+  u64 count;
+  u64 next;				/* Next unit to claim */
+  u64 prefix_hash;			/* FNV-1a state after the bytes before the serial */
+  u64 *hashes;
+  int failed;
+};
+
+static u64 fnv1a(u64 h, const uint8_t *p, size_t len)
+{
+  while (len--) {
+    h ^= *p++;
+    h *= FNV1A_PRIME;
+  }
+  return h;
+}
+
+static void gen_name(char *name, size_t len, const char *dir, uint32_t serial)
+{
+  snprintf(name, len, "%s/%08X.bin", dir, serial);
+}
+
+static int gen_write(const char *name, const uint8_t *buf, uint32_t size)
+{
+  int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  ssize_t n = -1;
+
+  if (fd >= 0) {
+    n = write(fd, buf, size);
+    if (close(fd))
+      n = -1;
+  }
+  if (n != (ssize_t)size) {
+    printf("ERROR: Unable to write \"%s\" (%s)\n", name, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static void *gen_thread(void *arg)
+{
+  struct gen_job *job = arg;
+  const struct eep_mapped_image *img = job->img;
+  uint8_t *buf = xmalloc(img->size);
+  char name[PATH_MAX];
+  u64 unit, end;
+
+  memcpy(buf, img->data, img->size);
+  while (!__atomic_load_n(&job->failed, __ATOMIC_RELAXED)) {
+    unit = __atomic_fetch_add(&job->next, GEN_BATCH, __ATOMIC_RELAXED);
+    if (unit >= job->count)
+      break;
+    end = (unit + GEN_BATCH < job->count) ? unit + GEN_BATCH : job->count;
+
+    for (; unit < end; unit++) {
+      uint32_t serial = job->first + unit;
+
+      /* Same byte order as the serial number patched in when programming */
+      buf[img->serial]     = serial;
+      buf[img->serial + 1] = serial >> 8;
+      buf[img->serial + 2] = serial >> 16;
+      buf[img->serial + 3] = serial >> 24;
+
+      gen_name(name, sizeof(name), job->dir, serial);
+      if (gen_write(name, buf, img->size)) {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        break;
+      }
+      job->hashes[unit] = fnv1a(job->prefix_hash, buf + img->serial, img->size - img->serial);
+    }
+  }
+  free(buf);
+  return NULL;
+}
+
+static int gen_write_index(struct gen_job *job)
+{
+  char name[PATH_MAX];
+  FILE *f;
+
+  snprintf(name, sizeof(name), "%s/index.txt", job->dir);
+  if (!(f = fopen(name, "w"))) {
+    printf("ERROR: Unable to write \"%s\" (%s)\n", name, strerror(errno));
+    return -1;
+  }
+  /* Buffered, so the index also goes out in large writes */
+  setvbuf(f, NULL, _IOFBF, 1 << 20);
+  fprintf(f, "# serial file fnv1a64\n");
+  for (u64 i = 0; i < job->count; i++)
+    fprintf(f, "%08X %08X.bin %016llx\n", (uint32_t)(job->first + i),
+            (uint32_t)(job->first + i), (unsigned long long)job->hashes[i]);
+  if (fclose(f)) {
+    printf("ERROR: Unable to write \"%s\" (%s)\n", name, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+int eep_generate(const char *base, uint32_t first, uint32_t last, const char *dir)
+{
+  struct eep_mapped_image img;
+  struct gen_job job;
+  pthread_t threads[GEN_MAX_THREADS];
+  int nthreads, started = 0, status = EXIT_FAILURE;
+  long ncpu;
+  u64 t0;
+
+  if (eep_image_map(base, &img) != EXIT_SUCCESS)
+    return EXIT_FAILURE;
+  if (img.serial < 0 || (uint32_t)img.serial + 4 > img.size) {
+    printf("ERROR: \"%s\" has no serial number field\n", base);
+    goto out;
+  }
+  if (mkdir(dir, 0755) && errno != EEXIST) {
+    printf("ERROR: Unable to create \"%s\" (%s)\n", dir, strerror(errno));
+    goto out;
+  }
+
+  memset(&job, 0, sizeof(job));
+  job.img = &img;
+  job.dir = dir;
+  job.first = first;
+  job.count = (u64)last - first + 1;
+  job.prefix_hash = fnv1a(FNV1A_OFFSET, img.data, img.serial);
+  job.hashes = xmalloc(job.count * sizeof(*job.hashes));
+
+  ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  nthreads = (ncpu < 1) ? 1 : (ncpu > GEN_MAX_THREADS) ? GEN_MAX_THREADS : ncpu;
+  if ((u64)nthreads > (job.count + GEN_BATCH - 1) / GEN_BATCH)
+    nthreads = (job.count + GEN_BATCH - 1) / GEN_BATCH;
+
+  printf("Generate %llu image(s) of %u bytes in %s, %d thread(s)...\n",
+         (unsigned long long)job.count, img.size, dir, nthreads);
+  fflush(stdout);
+
+  t0 = monotonic_ns();
+  for (int i = 0; i < nthreads; i++)
+    if (!pthread_create(&threads[started], NULL, gen_thread, &job))
+      started++;
+  if (!started)
+    gen_thread(&job);			/* Out of threads, do it here */
+  for (int i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+
+  if (!job.failed && !gen_write_index(&job)) {
+    double s = (monotonic_ns() - t0) / 1e9;
+    printf("Generated %llu image(s) in %.2f s (%.0f/s, %.1f MB/s)\n",
+           (unsigned long long)job.count, s, job.count / s,
+           job.count * (double)img.size / s / 1e6);
+    status = EXIT_SUCCESS;
+  }
+  free(job.hashes);
+out:
+  eep_image_unmap(&img);
+  return status;
+}
@@ -0,0 +1,527 @@
+/*
+ *	H1A EEPROM Tool -- Asynchronous Jobs
+ *
+ *	Copyright (c) 2023 Adnacom, Inc.
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <time.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "adna.h"
+#include "eep.h"
+#include "regs.h"
+
+/*
+ * EEPROM programming, EEPROM reads, hot resets and power state changes as
+ * jobs for a caller that must not block, such as an event loop driving
+ * many cards. Submitting a job starts a thread for it with its own access
+ * structure and device, and returns at once. Every job bumps one shared
+ * eventfd when it makes progress and when it finishes, so the caller puts
+ * that fd in its poll set, and on a wakeup reads it and collects the
+ * snapshots of its jobs with eep_job_stats(), which never waits for the
+ * job. Jobs on different cards share nothing but the fd; two jobs on the
+ * same card at once are the caller's problem, as are jobs on the software
+ * EEPROM model, which has a single controller. A job that hits an error,
+ * in libpci or in sysfs, ends as EEP_JOB_FAILED and never exits.
+ */
+
+#define JOB_PROGRESS_DWORDS  256		/* Wake the caller this often while programming */
+#define JOB_CHUNK_DWORDS     16
+
+struct eep_job {
+  int kind;
+  struct pci_filter dev, parent;
+  uint8_t *data;			/* Image to program, or what was read */
+  uint32_t size;
+  uint16_t extra;
+  bool keep_serial;
+  int power_state;
+  bool slot_reset;			/* Power cycle the slot, SBR if that fails */
+  pthread_t thread;
+  bool started;
+  int cancel;
+  pthread_mutex_t lock;
+  struct eep_job_stats stats;
+};
+
+static int job_fd = -1;
+static struct pci_access *(*job_new_access)(void);
+
+int eep_job_init(struct pci_access *(*new_access)(void))
+{
+  job_new_access = new_access;
+  if (job_fd < 0)
+    job_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  return job_fd;
+}
+
+static void job_signal(void)
+{
+  uint64_t one = 1;
+
+  /* Only fails when the counter is about to overflow, the caller is awake then */
+  if (write(job_fd, &one, sizeof(one)) < 0) {}
+}
+
+static bool job_cancelled(struct eep_job *j)
+{
+  return __atomic_load_n(&j->cancel, __ATOMIC_RELAXED);
+}
+
+static void job_progress(struct eep_job *j, uint32_t done)
+{
+  bool wake;
+
+  pthread_mutex_lock(&j->lock);
+  wake = done / JOB_PROGRESS_DWORDS != j->stats.done / JOB_PROGRESS_DWORDS;
+  j->stats.done = done;
+  pthread_mutex_unlock(&j->lock);
+  if (wake)
+    job_signal();
+}
+
+static void job_count(struct eep_job *j, uint32_t *counter)
+{
+  pthread_mutex_lock(&j->lock);
+  (*counter)++;
+  pthread_mutex_unlock(&j->lock);
+}
+
+static void job_set_total(struct eep_job *j, uint32_t total)
+{
+  pthread_mutex_lock(&j->lock);
+  j->stats.total = total;
+  pthread_mutex_unlock(&j->lock);
+}
+
+static void job_sleep_ms(unsigned int ms)
+{
+  struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+
+  nanosleep(&ts, NULL);
+}
+
+/*** EEPROM ***/
+
+/* Copy the serial number already on the card into the image, if both have one */
+static void job_keep_serial(struct eep_job *j, struct device *d)
+{
+  int serial = eep_serial_offset(j->data, j->size), card = -1;
+  uint32_t header, dwords, dw;
+  uint32_t *buf;
+
+  if (serial < 0)
+    return;
+  eep_read_range(d, 0, 1, &header);
+  dwords = (eep_dump_size(header, 0) + 3) / 4;
+  if (dwords > EEP_MAX_DWORDS)
+    dwords = EEP_MAX_DWORDS;
+  buf = xmalloc(dwords * 4);
+  buf[0] = header;
+  for (dw = 1; dw < dwords; dw += JOB_CHUNK_DWORDS) {
+    uint32_t n = (dwords - dw < JOB_CHUNK_DWORDS) ? dwords - dw : JOB_CHUNK_DWORDS;
+
+    eep_read_range(d, dw, n, buf + dw);
+    card = eep_serial_offset((uint8_t *)buf, (dw + n) * 4);
+    if (card >= 0 && (uint32_t)card + 4 <= (dw + n) * 4)
+      break;
+  }
+  if (card >= 0 && (uint32_t)card + 4 <= dwords * 4)
+    memcpy(j->data + serial, (uint8_t *)buf + card, 4);
+  free(buf);
+}
+
+static int job_write(struct eep_job *j, struct device *d)
+{
+  uint32_t dwords = j->size / 4, value, read, nfailed = 0;
+  uint32_t *failed = xmalloc((dwords + 1) * sizeof(*failed));
+  uint32_t status = eep_reg_read(d, EEP_STAT_N_CTRL_ADDR);
+  int rc = EXIT_SUCCESS;
+
+  if (status == PCI_MEM_ERROR) {
+    rc = EEP_FAIL;
+    goto out;
+  }
+  switch (eep_prsnt_get(status)) {
+  case NOT_PRSNT:
+    rc = EEP_NOT_EXIST;
+    goto out;
+  case PRSNT_INVALID:
+    /* Same as the command line: initialize, the card takes it after a reset */
+    eep_init(d);
+    rc = EEP_BLANK_INVALID;
+    goto out;
+  }
+  if (j->keep_serial)
+    job_keep_serial(j, d);
+
+  job_set_total(j, (j->size + 3) / 4);
+
+  for (uint32_t dw = 0; dw < dwords; dw++) {
+    if (job_cancelled(j)) {
+      rc = EEP_FAIL;
+      goto out;
+    }
+    memcpy(&value, j->data + dw * 4, 4);
+    eep_read(d, dw, &read);
+    if (read == value) {
+      job_count(j, &j->stats.unchanged);
+    } else {
+      eep_write(d, dw, value);
+      job_count(j, &j->stats.written);
+      if (eep_read_uncached(d, dw) != value) {
+        job_count(j, &j->stats.retried);
+        if (!eep_write_retry(d, dw, value, false, &read))
+          failed[nfailed++] = dw;
+      }
+    }
+    job_progress(j, dw + 1);
+  }
+
+  /* Trailing 16 bits, written with the upper half set like the command line does */
+  if (j->size & 2) {
+    uint16_t half;
+
+    memcpy(&half, j->data + dwords * 4, 2);
+    eep_read(d, dwords, &read);
+    if ((uint16_t)read == half) {
+      job_count(j, &j->stats.unchanged);
+    } else {
+      eep_write_16(d, dwords, half);
+      job_count(j, &j->stats.written);
+      read = eep_read_uncached(d, dwords);
+      if ((uint16_t)read != half &&
+          !eep_write_retry(d, dwords, 0xffff0000 | half, true, &read))
+        failed[nfailed++] = dwords;
+    }
+    job_progress(j, dwords + 1);
+  }
+
+  /* One more pass over the dwords that kept failing */
+  for (uint32_t i = 0; i < nfailed; i++) {
+    uint32_t dw = failed[i];
+
+    if (dw == dwords)
+      continue;
+    memcpy(&value, j->data + dw * 4, 4);
+    eep_write(d, dw, value);
+    if (eep_read_uncached(d, dw) != value &&
+        !eep_write_retry(d, dw, value, false, &read)) {
+      job_count(j, &j->stats.failed);
+      rc = EEP_FAIL;
+    }
+  }
+  if (nfailed && failed[nfailed - 1] == dwords) {
+    job_count(j, &j->stats.failed);
+    rc = EEP_FAIL;
+  }
+out:
+  free(failed);
+  return rc;
+}
+
+static int job_read(struct eep_job *j, struct device *d)
+{
+  uint32_t status = eep_reg_read(d, EEP_STAT_N_CTRL_ADDR), header, dwords;
+
+  if (status == PCI_MEM_ERROR)
+    return EEP_FAIL;
+  if (eep_prsnt_get(status) == NOT_PRSNT)
+    return EEP_NOT_EXIST;
+
+  eep_read_range(d, 0, 1, &header);
+  j->size = eep_dump_size(header, j->extra);
+  dwords = j->size / 4;
+  j->data = xmalloc(dwords * 4 + 4);
+  memcpy(j->data, &header, 4);
+
+  job_set_total(j, (j->size + 3) / 4);
+
+  for (uint32_t dw = 1; dw < dwords; dw += JOB_CHUNK_DWORDS) {
+    uint32_t n = (dwords - dw < JOB_CHUNK_DWORDS) ? dwords - dw : JOB_CHUNK_DWORDS;
+
+    if (job_cancelled(j))
+      return EEP_FAIL;
+    eep_read_range(d, dw, n, (uint32_t *)j->data + dw);
+    job_progress(j, dw + n);
+  }
+  if (j->size & 2)
+    eep_read_16(d, dwords, (uint16_t *)(j->data + dwords * 4));
+  job_progress(j, (j->size + 3) / 4);
+  return EXIT_SUCCESS;
+}
+
+/*** Reset and power ***/
+
+static int job_set_power(struct pci_dev *p, int state)
+{
+  struct pci_cap *cap;
+  u16 pmcsr;
+
+  pci_fill_info(p, PCI_FILL_CAPS);
+  if (!(cap = pci_find_cap(p, PCI_CAP_ID_PM, PCI_CAP_NORMAL)))
+    return EXIT_FAILURE;
+  pmcsr = pci_read_word(p, cap->addr + PCI_PM_CTRL);
+  pci_write_word(p, cap->addr + PCI_PM_CTRL, (pmcsr & ~PCI_PM_CTRL_STATE_MASK) | state);
+  job_sleep_ms(10);			/* D3hot to D0 recovery time */
+  pmcsr = pci_read_word(p, cap->addr + PCI_PM_CTRL);
+  return ((pmcsr & PCI_PM_CTRL_STATE_MASK) == state) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int job_power(struct eep_job *j, struct device *d)
+{
+  return (job_set_power(d->dev, j->power_state) == EXIT_SUCCESS) ? EXIT_SUCCESS : EEP_FAIL;
+}
+
+/* The steps of adna_hotreset_dev(), done on this thread's own access */
+static int job_reset(struct eep_job *j, struct device *d, struct pci_access *a)
+{
+  struct pci_dev *parent = pci_get_dev(a, j->parent.domain, j->parent.bus,
+                                       j->parent.slot, j->parent.func);
+  struct slot_timing t;
+  int status;
+  u16 ctl;
+
+  job_set_total(j, 4);
+  if (job_set_power(d->dev, PCI_CAP_PM_STATE_D3_HOT) != EXIT_SUCCESS) {
+    pci_free_dev(parent);
+    return EEP_FAIL;
+  }
+  if (adna_remove_downstream(&j->dev) != EXIT_SUCCESS) {
+    job_set_power(d->dev, PCI_CAP_PM_STATE_D0);
+    pci_free_dev(parent);
+    return EEP_FAIL;
+  }
+  job_progress(j, 1);
+
+  if (j->slot_reset && slot_power_cycle(parent, &t) == EXIT_SUCCESS) {
+    pci_free_dev(parent);
+    job_progress(j, 3);
+    status = adna_rescan_pci();
+    job_progress(j, 4);
+    return (status == EXIT_SUCCESS) ? EXIT_SUCCESS : EEP_FAIL;
+  }
+
+  ctl = pci_read_word(parent, PCI_BRIDGE_CONTROL);
+  pci_write_word(parent, PCI_BRIDGE_CONTROL, ctl | PCI_BRIDGE_CTL_BUS_RESET);
+  job_sleep_ms(1000);
+  pci_write_word(parent, PCI_BRIDGE_CONTROL, ctl & ~PCI_BRIDGE_CTL_BUS_RESET);
+  job_sleep_ms(1000);
+  job_progress(j, 2);
+  pci_free_dev(parent);
+
+  status = adna_remove_downstream(&j->parent);
+  job_sleep_ms(1000);
+  job_progress(j, 3);
+  /* Rescan even after a failure, whatever was removed should come back */
+  if (adna_rescan_pci() != EXIT_SUCCESS)
+    status = EXIT_FAILURE;
+  job_progress(j, 4);
+  return (status == EXIT_SUCCESS) ? EXIT_SUCCESS : EEP_FAIL;
+}
+
+/*** Job threads ***/
+
+/*
+ * The access structures come with die() for libpci errors, which would take
+ * the embedding process down from a job thread. Jobs unwind to job_thread()
+ * instead and fail.
+ */
+static __thread jmp_buf *job_unwind;
+
+static void NONRET PCI_PRINTF(1,2) job_error(char *msg, ...)
+{
+  va_list args;
+
+  va_start(args, msg);
+  printf("ERROR: ");
+  vprintf(msg, args);
+  putchar('\n');
+  va_end(args);
+  longjmp(*job_unwind, 1);
+}
+
+static void *job_thread(void *arg)
+{
+  struct eep_job *j = arg;
+  struct pci_access *a = job_new_access();
+  struct device dev;
+  jmp_buf unwind;
+  volatile int status = EEP_FAIL;
+  volatile bool mapped = false;
+  int state;
+
+  memset(&dev, 0, sizeof(dev));
+  a->error = job_error;
+  job_unwind = &unwind;
+  if (setjmp(unwind))
+    goto out;
+  pci_init(a);
+  dev.dev = pci_get_dev(a, j->dev.domain, j->dev.bus, j->dev.slot, j->dev.func);
+
+  pthread_mutex_lock(&j->lock);
+  j->stats.state = EEP_JOB_RUNNING;
+  j->stats.start_ns = monotonic_ns();
+  pthread_mutex_unlock(&j->lock);
+  job_signal();
+
+  /* Without the mapping every access would go through pcimem(), which exits */
+  if ((j->kind == EEP_JOB_WRITE || j->kind == EEP_JOB_READ) && eep_backend == &eep_hw_methods &&
+      !(mapped = eep_hw_map(&dev))) {
+    printf("ERROR: Unable to map BAR0 of %04x:%02x:%02x.%d\n",
+           j->dev.domain, j->dev.bus, j->dev.slot, j->dev.func);
+    goto out;
+  }
+
+  switch (j->kind) {
+  case EEP_JOB_WRITE:
+    status = job_write(j, &dev);
+    break;
+  case EEP_JOB_READ:
+    status = job_read(j, &dev);
+    break;
+  case EEP_JOB_RESET:
+    status = job_reset(j, &dev, a);
+    break;
+  case EEP_JOB_POWER:
+    status = job_power(j, &dev);
+    break;
+  }
+out:
+  if (mapped)
+    eep_hw_unmap(&dev);
+  if (dev.dev)
+    pci_free_dev(dev.dev);
+  pci_cleanup(a);
+
+  if (job_cancelled(j))
+    state = EEP_JOB_CANCELLED;
+  else
+    state = (status == EXIT_SUCCESS) ? EEP_JOB_DONE : EEP_JOB_FAILED;
+  pthread_mutex_lock(&j->lock);
+  j->stats.state = state;
+  j->stats.status = status;
+  j->stats.reads = dev.poll.reads;
+  j->stats.end_ns = monotonic_ns();
+  pthread_mutex_unlock(&j->lock);
+  job_signal();
+  return NULL;
+}
+
+static struct eep_job *job_submit(int kind, struct pci_filter *dev)
+{
+  struct eep_job *j;
+
+  if (job_fd < 0 || !job_new_access)
+    return NULL;
+  j = xmalloc(sizeof(*j));
+  memset(j, 0, sizeof(*j));
+  j->kind = kind;
+  j->dev = *dev;
+  pthread_mutex_init(&j->lock, NULL);
+  j->stats.state = EEP_JOB_QUEUED;
+  j->stats.submit_ns = monotonic_ns();
+  return j;
+}
+
+static struct eep_job *job_start(struct eep_job *j)
+{
+  if (pthread_create(&j->thread, NULL, job_thread, j)) {
+    eep_job_free(j);
+    return NULL;
+  }
+  j->started = true;
+  return j;
+}
+
+struct eep_job *eep_job_write(struct pci_filter *dev, const uint8_t *image, uint32_t size,
+                              bool keep_serial)
+{
+  struct eep_job *j = job_submit(EEP_JOB_WRITE, dev);
+
+  if (!j)
+    return NULL;
+  /* Own copy, the serial number gets patched into it */
+  j->data = xmalloc(size + 4);
+  memcpy(j->data, image, size);
+  j->size = size;
+  j->keep_serial = keep_serial;
+  return job_start(j);
+}
+
+struct eep_job *eep_job_read(struct pci_filter *dev, uint16_t extra)
+{
+  struct eep_job *j = job_submit(EEP_JOB_READ, dev);
+
+  if (!j)
+    return NULL;
+  j->extra = extra;
+  return job_start(j);
+}
+
+struct eep_job *eep_job_reset(struct pci_filter *h1a, struct pci_filter *parent, bool slot_reset)
+{
+  struct eep_job *j = job_submit(EEP_JOB_RESET, h1a);
+
+  if (!j)
+    return NULL;
+  j->parent = *parent;
+  j->slot_reset = slot_reset;
+  return job_start(j);
+}
+
+struct eep_job *eep_job_power(struct pci_filter *dev, int state)
+{
+  struct eep_job *j = job_submit(EEP_JOB_POWER, dev);
+
+  if (!j)
+    return NULL;
+  j->power_state = state;
+  return job_start(j);
+}
+
+void eep_job_stats(struct eep_job *j, struct eep_job_stats *st)
+{
+  pthread_mutex_lock(&j->lock);
+  *st = j->stats;
+  pthread_mutex_unlock(&j->lock);
+}
+
+/* What a finished read job got, NULL before that */
+const uint8_t *eep_job_data(struct eep_job *j, uint32_t *size)
+{
+  struct eep_job_stats st;
+
+  eep_job_stats(j, &st);
+  if (j->kind != EEP_JOB_READ || st.state != EEP_JOB_DONE)
+    return NULL;
+  *size = j->size;
+  return j->data;
+}
+
+/* Stops programming and reads between dwords; resets and power changes run to the end */
+void eep_job_cancel(struct eep_job *j)
+{
+  __atomic_store_n(&j->cancel, 1, __ATOMIC_RELAXED);
+}
+
+/* Waits for the thread only if the job has not finished */
+void eep_job_free(struct eep_job *j)
+{
+  if (!j)
+    return;
+  if (j->started)
+    pthread_join(j->thread, NULL);
+  pthread_mutex_destroy(&j->lock);
+  free(j->data);
+  free(j);
+}
@@ -0,0 +1,137 @@
+/*
+ *	H1A EEPROM Tool -- Software Model of the EEPROM Controller
+ *
+ *	Copyright (c) 2023 Adnacom, Inc.
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "adna.h"
+#include "eep.h"
+#include "regs.h"
+
+/*
+ * Behavioural model of the PEX8608 serial EEPROM controller (registers
+ * 260h/264h), good enough to run the programming protocol without a card.
+ * Every command keeps the controller busy for a configurable number of
+ * status polls, and dwords written more often than the wear limit stop
+ * accepting new data, which mimics a part at the end of its endurance.
+ */
+
+static struct {
+  uint32_t mem[EEP_MODEL_DWORDS];
+  unsigned int wear[EEP_MODEL_DWORDS];	/* Program cycles seen by each dword */
+  uint32_t buffer;
+  bool wr_enable;
+  int present;
+  unsigned int wear_limit;		/* 0 = unlimited endurance */
+  unsigned int busy_polls, busy;
+  unsigned long writes, worn;
+} model;
+
+void eep_model_setup(int present, unsigned int wear_limit, unsigned int busy_polls)
+{
+  memset(&model, 0, sizeof(model));
+  memset(model.mem, 0xff, sizeof(model.mem));
+  model.present = present;
+  model.wear_limit = wear_limit;
+  model.busy_polls = busy_polls;
+}
+
+void eep_model_stats(unsigned long *writes, unsigned long *worn)
+{
+  *writes = model.writes;
+  *worn = model.worn;
+}
+
+static uint32_t model_status(void)
+{
+  uint32_t status = REG_VAL(eep_addr_width, TWO_BYTES);
+  int prsnt;
+
+  if (!model.present)
+    prsnt = NOT_PRSNT;
+  else if ((model.mem[0] & 0xff) == EEP_INIT_VAL)
+    prsnt = PRSNT_VALID;
+  else
+    prsnt = PRSNT_INVALID;
+  status |= eep_prsnt_val(prsnt);
+
+  if (model.busy) {
+    model.busy--;
+    status |= REG_VAL(eep_cmd_status, CMD_NOT_COMPLETE);
+    status |= REG_VAL(eep_ready, EEP_WR_ONGOING);
+  }
+  if (model.wr_enable)
+    status |= REG_VAL(eep_wr_enable, EEP_WR_ENABLED);
+  return status;
+}
+
+static void model_command(uint32_t cmd)
+{
+  uint32_t addr = eep_cmd_addr(cmd);
+
+  if (!model.present)
+    return;
+
+  switch (eep_cmd_get(cmd)) {
+    case SET_WR_EN_LATCH:
+      model.wr_enable = true;
+    break;
+    case RST_WR_EN_LATCH:
+      model.wr_enable = false;
+    break;
+    case WR_4B_FR_BUFF_TO_BLKADDR:
+      if (!model.wr_enable)
+        break;
+      model.writes++;
+      if (model.wear_limit && ++model.wear[addr] > model.wear_limit)
+        model.worn++;
+      else
+        model.mem[addr] = model.buffer;
+      model.wr_enable = false;
+    break;
+    case RD_4B_FR_BLKADDR_TO_BUFF:
+      model.buffer = model.mem[addr];
+    break;
+    default:
+    break;
+  }
+  model.busy = model.busy_polls;
+}
+
+static uint32_t eep_model_read(struct device *d, uint32_t reg)
+{
+  d->poll.reads++;			/* Counted as if it went to a card */
+  switch (reg) {
+    case EEP_STAT_N_CTRL_ADDR:
+      return model_status();
+    case EEP_BUFFER_ADDR:
+      return model.buffer;
+    default:
+      return 0;
+  }
+}
+
+static void eep_model_write(struct device *d UNUSED, uint32_t reg, uint32_t data)
+{
+  switch (reg) {
+    case EEP_STAT_N_CTRL_ADDR:
+      model_command(data);
+    break;
+    case EEP_BUFFER_ADDR:
+      model.buffer = data;
+    break;
+    default:
+    break;
+  }
+}
+
+struct eep_methods eep_model_methods = {
+  "model",
+  eep_model_read,
+  eep_model_write
+};
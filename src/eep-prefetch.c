@@ -0,0 +1,154 @@
+/*
+ *	H1A EEPROM Tool -- Background EEPROM Prefetch
+ *
+ *	Copyright (c) 2023 Adnacom, Inc.
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "adna.h"
+#include "eep.h"
+#include "regs.h"
+
+/*
+ * While the operator is at the selection prompt, a reader thread walks the
+ * listed devices and copies what the selected operation is going to need
+ * into a session cache: the full dump for -s, the data up to the serial
+ * number entry for -w. Nothing is written to the devices. The thread only
+ * ever touches BAR0 of devices the main thread is not using, and it is
+ * stopped and joined before the main thread starts on the selected one.
+ */
+
+#define PREFETCH_CHUNK_DWORDS  16
+
+static struct {
+  pthread_t thread;
+  bool running;
+  int stop;
+  bool full;
+  uint16_t extra;
+  struct pci_access *(*new_access)(void);
+  int count;
+  struct eep_cache_entry *entries;
+} prefetch;
+
+static bool prefetch_stopping(void)
+{
+  return __atomic_load_n(&prefetch.stop, __ATOMIC_ACQUIRE);
+}
+
+static void prefetch_device(struct device *d, struct eep_cache_entry *c)
+{
+  uint32_t status, dwords, dw, n;
+  bool mapped;
+
+  status = eep_reg_read(d, EEP_STAT_N_CTRL_ADDR);
+  if (status == PCI_MEM_ERROR || eep_prsnt_get(status) != PRSNT_VALID)
+    return;
+
+  mapped = eep_hw_map(d);
+  eep_read_range(d, 0, 1, &c->header);
+  c->size = eep_dump_size(c->header, prefetch.extra);
+  dwords = (c->size + 3) / 4;
+  c->data = xmalloc(dwords * 4);
+  memcpy(c->data, &c->header, 4);
+  c->len = 4;
+
+  for (dw = 1; dw < dwords && !prefetch_stopping(); dw += n) {
+    n = dwords - dw;
+    if (n > PREFETCH_CHUNK_DWORDS)
+      n = PREFETCH_CHUNK_DWORDS;
+    eep_read_range(d, dw, n, (uint32_t *)c->data + dw);
+    c->len = (dw + n) * 4;
+    /* Programming needs only the serial number, stop once it is in */
+    if (!prefetch.full) {
+      int serial = eep_serial_offset(c->data, c->len);
+      if (serial >= 0 && (uint32_t)serial + 4 <= c->len)
+        break;
+    }
+  }
+  if (c->len > c->size)
+    c->len = c->size;
+  if (mapped)
+    eep_hw_unmap(d);
+
+  if (!prefetch_stopping())
+    __atomic_store_n(&c->complete, true, __ATOMIC_RELEASE);
+}
+
+static void *prefetch_thread(void *arg UNUSED)
+{
+  struct pci_access *a = prefetch.new_access();
+  struct device dev;
+  int i;
+
+  pci_init(a);
+  for (i = 0; i < prefetch.count && !prefetch_stopping(); i++) {
+    struct eep_cache_entry *c = &prefetch.entries[i];
+
+    memset(&dev, 0, sizeof(dev));
+    dev.dev = pci_get_dev(a, c->domain, c->bus, c->slot, c->func);
+    prefetch_device(&dev, c);
+    pci_free_dev(dev.dev);
+  }
+  pci_cleanup(a);
+  return NULL;
+}
+
+void eep_prefetch_start(struct pci_access *(*new_access)(void), struct pci_filter **devs,
+                        int count, bool full, uint16_t extra)
+{
+  int i;
+
+  eep_prefetch_free();
+  prefetch.entries = xmalloc(count * sizeof(*prefetch.entries));
+  memset(prefetch.entries, 0, count * sizeof(*prefetch.entries));
+  for (i = 0; i < count; i++) {
+    prefetch.entries[i].domain = devs[i]->domain;
+    prefetch.entries[i].bus = devs[i]->bus;
+    prefetch.entries[i].slot = devs[i]->slot;
+    prefetch.entries[i].func = devs[i]->func;
+  }
+  prefetch.count = count;
+  prefetch.full = full;
+  prefetch.extra = extra;
+  prefetch.new_access = new_access;
+  prefetch.stop = 0;
+  prefetch.running = !pthread_create(&prefetch.thread, NULL, prefetch_thread, NULL);
+}
+
+void eep_prefetch_stop(void)
+{
+  if (!prefetch.running)
+    return;
+  __atomic_store_n(&prefetch.stop, 1, __ATOMIC_RELEASE);
+  pthread_join(prefetch.thread, NULL);
+  prefetch.running = false;
+}
+
+/* Finished entry for the device, NULL if it has to be read from the card */
+const struct eep_cache_entry *eep_prefetch_get(struct pci_dev *p)
+{
+  for (int i = 0; i < prefetch.count; i++) {
+    struct eep_cache_entry *c = &prefetch.entries[i];
+    if (c->domain == p->domain && c->bus == p->bus &&
+        c->slot == p->dev && c->func == p->func)
+      return __atomic_load_n(&c->complete, __ATOMIC_ACQUIRE) ? c : NULL;
+  }
+  return NULL;
+}
+
+void eep_prefetch_free(void)
+{
+  eep_prefetch_stop();
+  for (int i = 0; i < prefetch.count; i++)
+    free(prefetch.entries[i].data);
+  free(prefetch.entries);
+  prefetch.entries = NULL;
+  prefetch.count = 0;
+}
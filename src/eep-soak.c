@@ -0,0 +1,122 @@
+/*
+ *	H1A EEPROM Tool -- EEPROM Endurance and Throughput Soak
+ *
+ *	Copyright (c) 2023 Adnacom, Inc.
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "adna.h"
+#include "eep.h"
+
+#define SOAK_MAX_FAILS    64
+#define SOAK_LAT_BUCKETS  24	/* log2(us) buckets, the last one is open-ended */
+
+/* Patterns rotate per cycle so every cell sees both polarities */
+static uint32_t soak_pattern(unsigned int cycle, uint32_t addr)
+{
+  switch (cycle % 4) {
+    case 0:
+      return 0x55555555;
+    case 1:
+      return 0xaaaaaaaa;
+    case 2:
+      return (addr << 16) | (~addr & 0xffff);
+    default:
+      return 0xa5000000 | ((cycle & 0xfff) << 12) | (addr & 0xfff);
+  }
+}
+
+static int lat_bucket(u64 ns)
+{
+  u64 us = ns / 1000;
+  int b = 0;
+
+  while (us > 1 && b < SOAK_LAT_BUCKETS - 1) {
+    us >>= 1;
+    b++;
+  }
+  return b;
+}
+
+int eep_soak(struct device *d, unsigned int cycles, uint32_t start, uint32_t count)
+{
+  unsigned long hist[SOAK_LAT_BUCKETS];
+  uint32_t fail_addr[SOAK_MAX_FAILS];
+  unsigned int nfail = 0, first_fail = 0;
+  unsigned long total_fail = 0, nwrites = 0;
+  u64 lat_min = ~(u64)0, lat_max = 0, lat_sum = 0;
+  u64 t_start;
+  unsigned int c;
+  uint32_t addr;
+  int i;
+
+  memset(hist, 0, sizeof(hist));
+  printf("EEPROM soak: %u cycle(s), dwords 0x%04x-0x%04x, %s backend\n",
+         cycles, start, start + count - 1, eep_backend->name);
+  fflush(stdout);
+
+  t_start = monotonic_ns();
+  for (c = 1; c <= cycles; c++) {
+    unsigned int cycle_fail = 0;
+    u64 t0 = monotonic_ns(), dt;
+
+    for (addr = start; addr < start + count; addr++) {
+      uint32_t value = soak_pattern(c, addr);
+      uint32_t readback;
+      u64 w0 = monotonic_ns(), lat;
+
+      eep_write(d, addr, value);
+      lat = monotonic_ns() - w0;
+      nwrites++;
+      lat_sum += lat;
+      if (lat < lat_min)
+        lat_min = lat;
+      if (lat > lat_max)
+        lat_max = lat;
+      hist[lat_bucket(lat)]++;
+
+      readback = eep_read_uncached(d, addr);
+      if (readback != value) {
+        if (!first_fail)
+          first_fail = c;
+        for (i = 0; i < (int)nfail && fail_addr[i] != addr; i++)
+          ;
+        if (i == (int)nfail && nfail < SOAK_MAX_FAILS)
+          fail_addr[nfail++] = addr;
+        cycle_fail++;
+        total_fail++;
+      }
+    }
+
+    dt = monotonic_ns() - t0;
+    printf("  cycle %u: %.3f s, %.1f B/s, %u failure(s)\n",
+           c, dt / 1e9, dt ? (count * 4.0) / (dt / 1e9) : 0.0, cycle_fail);
+    fflush(stdout);
+  }
+
+  printf("Summary:\n");
+  printf("  Elapsed:     %.3f s for %lu write(s)\n",
+         (monotonic_ns() - t_start) / 1e9, nwrites);
+  if (nwrites)
+    printf("  Write latency: min %.1f us, avg %.1f us, max %.1f us\n",
+           lat_min / 1e3, lat_sum / 1e3 / nwrites, lat_max / 1e3);
+  for (i = 0; i < SOAK_LAT_BUCKETS; i++)
+    if (hist[i])
+      printf("    %s%8lu us: %lu\n", (i == SOAK_LAT_BUCKETS - 1) ? ">=" : "< ",
+             (i == SOAK_LAT_BUCKETS - 1) ? 1UL << i : 2UL << i, hist[i]);
+  if (!total_fail) {
+    printf("  No failures\n");
+    return EXIT_SUCCESS;
+  }
+  printf("  First failing cycle: %u, %lu failure(s) in total\n", first_fail, total_fail);
+  printf("  Failing dwords (%u):", nfail);
+  for (i = 0; i < (int)nfail; i++)
+    printf("%s 0x%04x", (i % 8) ? "" : "\n   ", fail_addr[i]);
+  printf("%s\n", (nfail == SOAK_MAX_FAILS) ? " ..." : "");
+  return EEP_FAIL;
+}
@@ -0,0 +1,241 @@
+/*
+ *	H1A EEPROM Tool -- Read-only Image Verification
+ *
+ *	Copyright (c) 2023 Adnacom, Inc.
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "adna.h"
+#include "eep.h"
+#include "regs.h"
+
+#define VERIFY_CHUNK_DWORDS  64
+
+struct verify_mismatch {
+  uint32_t offset;
+  uint32_t expected, read, mask;
+};
+
+struct verify_job {
+  struct device *d;
+  const struct eep_mapped_image *img;
+  int flags;
+  pthread_t thread;
+  bool joinable;
+  int status;
+  uint32_t nmis, mis_alloc;
+  struct verify_mismatch *mis;
+  u64 ns;
+};
+
+int eep_image_map(const char *name, struct eep_mapped_image *img)
+{
+  struct stat st;
+  void *map;
+  int fd;
+
+  memset(img, 0, sizeof(*img));
+  fd = open(name, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    printf("ERROR: Unable to load \"%s\" (%s)\n", name, strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return EEP_FAIL;
+  }
+  if (!st.st_size || st.st_size > EEP_MODEL_DWORDS * 4) {
+    printf("ERROR: \"%s\" is not a valid EEPROM image (%lld bytes)\n",
+           name, (long long)st.st_size);
+    close(fd);
+    return EEP_FAIL;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    printf("ERROR: Unable to map \"%s\" (%s)\n", name, strerror(errno));
+    return EEP_FAIL;
+  }
+  img->data = map;
+  img->size = st.st_size;
+  img->serial = eep_serial_offset(img->data, img->size);
+  return EXIT_SUCCESS;
+}
+
+void eep_image_unmap(struct eep_mapped_image *img)
+{
+  if (img->data)
+    munmap((void *)img->data, img->size);
+  img->data = NULL;
+}
+
+/* Bytes of the dword at offset that take part in the comparison */
+static uint32_t verify_mask(const struct eep_mapped_image *img, uint32_t offset, int flags)
+{
+  uint32_t mask = 0;
+
+  for (int b = 0; b < 4; b++) {
+    uint32_t pos = offset + b;
+    if (pos >= img->size)
+      break;
+    if ((flags & EEP_VERIFY_IGNORE_SERIAL) && img->serial >= 0 &&
+        pos >= (uint32_t)img->serial && pos < (uint32_t)img->serial + 4)
+      continue;
+    mask |= 0xffU << (8 * b);
+  }
+  return mask;
+}
+
+static void verify_record(struct verify_job *job, uint32_t offset,
+                          uint32_t expected, uint32_t read, uint32_t mask)
+{
+  if (job->nmis == job->mis_alloc) {
+    job->mis_alloc = job->mis_alloc ? 2 * job->mis_alloc : 16;
+    job->mis = xrealloc(job->mis, job->mis_alloc * sizeof(*job->mis));
+  }
+  job->mis[job->nmis].offset = offset;
+  job->mis[job->nmis].expected = expected;
+  job->mis[job->nmis].read = read;
+  job->mis[job->nmis].mask = mask;
+  job->nmis++;
+}
+
+static int verify_device(struct verify_job *job)
+{
+  const struct eep_mapped_image *img = job->img;
+  struct device *d = job->d;
+  uint32_t chunk[VERIFY_CHUNK_DWORDS];
+  uint32_t dwords = (img->size + 3) / 4;
+  uint32_t status, dw, n, i;
+  bool mapped;
+
+  status = eep_reg_read(d, EEP_STAT_N_CTRL_ADDR);
+  if (status == PCI_MEM_ERROR)
+    return EEP_FAIL;
+  switch (eep_prsnt_get(status)) {
+    case PRSNT_VALID:
+    break;
+    case NOT_PRSNT:
+      return EEP_NOT_EXIST;
+    default:
+      return EEP_BLANK_INVALID;
+  }
+
+  mapped = eep_hw_map(d);
+  for (dw = 0; dw < dwords; dw += n) {
+    n = dwords - dw;
+    if (n > VERIFY_CHUNK_DWORDS)
+      n = VERIFY_CHUNK_DWORDS;
+    eep_read_range(d, dw, n, chunk);
+
+    for (i = 0; i < n; i++) {
+      uint32_t offset = (dw + i) * 4;
+      uint32_t expected = 0, mask = verify_mask(img, offset, job->flags);
+
+      memcpy(&expected, img->data + offset,
+             (img->size - offset < 4) ? img->size - offset : 4);
+      if ((chunk[i] ^ expected) & mask) {
+        verify_record(job, offset, expected & mask, chunk[i] & mask, mask);
+        if (!(job->flags & EEP_VERIFY_REPORT))
+          goto done;
+      }
+    }
+  }
+
+done:
+  if (mapped)
+    eep_hw_unmap(d);
+  return job->nmis ? EEP_FAIL : EXIT_SUCCESS;
+}
+
+static void *verify_thread(void *arg)
+{
+  struct verify_job *job = arg;
+  u64 t0 = monotonic_ns();
+
+  job->status = verify_device(job);
+  job->ns = monotonic_ns() - t0;
+  return NULL;
+}
+
+static void verify_show(struct verify_job *job)
+{
+  struct pci_dev *p = job->d->dev;
+  const char *what;
+
+  switch (job->status) {
+    case EXIT_SUCCESS:
+      what = "PASS";
+    break;
+    case EEP_NOT_EXIST:
+      what = "FAIL, no EEPROM present";
+    break;
+    case EEP_BLANK_INVALID:
+      what = "FAIL, EEPROM is blank/corrupted";
+    break;
+    default:
+      what = job->nmis ? "FAIL" : "FAIL, device not accessible";
+    break;
+  }
+  printf("%04x:%02x:%02x.%d: %s", p->domain, p->bus, p->dev, p->func, what);
+  if (job->nmis)
+    printf(", %u mismatch%s%s", job->nmis, (job->nmis == 1) ? "" : "es",
+           (job->flags & EEP_VERIFY_REPORT) ? "" : " (stopped at first)");
+  printf(" (%.2f s)\n", job->ns / 1e9);
+
+  for (uint32_t i = 0; i < job->nmis; i++)
+    printf("    offset:0x%04X  expected:0x%08X  read:0x%08X  mask:0x%08X\n",
+           job->mis[i].offset, job->mis[i].expected, job->mis[i].read, job->mis[i].mask);
+}
+
+/*
+ * Compare every device against the image without writing to it. Each device
+ * is read by its own thread; results are printed once all of them are done
+ * so the reports do not interleave.
+ */
+int eep_verify_devices(struct device **devs, int count,
+                       const struct eep_mapped_image *img, int flags)
+{
+  struct verify_job *jobs;
+  int failed = 0, i;
+
+  printf("Verify %d device(s) against %u byte image%s...\n", count, img->size,
+         (flags & EEP_VERIFY_IGNORE_SERIAL) ? ", ignoring serial number" : "");
+  if ((flags & EEP_VERIFY_IGNORE_SERIAL) && img->serial < 0)
+    printf("WARNING: Image has no serial number field\n");
+  fflush(stdout);
+
+  jobs = xmalloc(count * sizeof(*jobs));
+  memset(jobs, 0, count * sizeof(*jobs));
+  for (i = 0; i < count; i++) {
+    jobs[i].d = devs[i];
+    jobs[i].img = img;
+    jobs[i].flags = flags;
+    if (pthread_create(&jobs[i].thread, NULL, verify_thread, &jobs[i]))
+      verify_thread(&jobs[i]);    /* Out of threads, do this one inline */
+    else
+      jobs[i].joinable = true;
+  }
+
+  for (i = 0; i < count; i++) {
+    if (jobs[i].joinable)
+      pthread_join(jobs[i].thread, NULL);
+    verify_show(&jobs[i]);
+    if (jobs[i].status != EXIT_SUCCESS)
+      failed++;
+    free(jobs[i].mis);
+  }
+  free(jobs);
+
+  printf("Verify summary: %d passed, %d failed\n", count - failed, failed);
+  return failed ? EEP_FAIL : EXIT_SUCCESS;
+}
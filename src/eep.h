@@ -9,22 +9,9 @@
 #define EEP_CLK_FREQ_ADDR       (0x268)
 #define EEP_3RD_ADDR_BYTE_ADDR  (0x26C)
 
-/* Serial EEPROM Status and Control (260h) */
-/* Serial EEPROM Control */
-#define EEP_BLKADDR_OFFSET      (0)             /* [12:0] */
-#define EEP_CMD_OFFSET          (13)            /* [15:13] */
-/* Serial EEPROM Status */
-#define EEP_PRSNT_OFFSET        (16)            /* [17:16] */
-#define EEP_CMD_STATUS_OFFSET   (18)
-#define EEP_BLK_ADDR_UPPER_OFFSET       (20)
-#define EEP_ADDR_WIDTH_OVERRIDE_OFFSET  (21)
-#define EEP_ADDR_WIDTH_OFFSET   (22)            /* [23:22] */
-/* Serial EEPROM Status Data */
-#define EEP_RDY_OFFSET          (24)
-#define EEP_WR_ENABLE_OFFSET    (25)
-#define EEP_BLK_WR_PROTECT_OFFSET       (26)    /* [27:26] */
-#define EEP_WR_STATUS_OFFSET    (28)            /* [30:28] */
-#define EEP_WR_PROTECT_EN_OFFSET        (31)
+/* Field layout of the Serial EEPROM Status and Control register is in regs.h */
+
+#define EEP_MAX_DWORDS          (0x4000)        /* 14-bit block address */
 
 #define EEP_INIT_VAL            (0x0000005A)
 #define PCI_MEM_ERROR           (0xFFFFFFFF)
@@ -86,28 +73,154 @@ enum EEP_WR_EN {
     EEP_WR_EN_MAX
 };
 
-union eep_status_and_control_reg {
-    struct _cmd_n_status_struct {
-        uint32_t blk_addr             : 13;/* [12:0] */
-        uint32_t cmd                  : 3; /* [15:13] */
-        uint32_t prsnt                : 2; /* [17:16] */
-        uint32_t cmd_status           : 1; /* [18] */
-        uint32_t rsvd_bit19           : 1; /* [19] */
-        uint32_t blk_upper_bit        : 1; /* [20] */
-        uint32_t addr_width_override  : 1; /* [21] */
-        uint32_t addr_width           : 2; /* [23:22] */
-        uint32_t ready                : 1; /* [24] */
-        uint32_t write_enable         : 1; /* [25] */
-        uint32_t block_protection     : 2; /* [27:26] */
-        uint32_t write_status         : 3; /* [30:28] */
-        uint32_t write_protect_enable : 1; /* [31] */
-    } cmd_n_status_struct;
-    uint32_t cmd_u32;
-};
-
 enum access {
     REG_WRITE,
     REG_READ
 };
 
+struct device;
+struct pci_dev;
+struct pci_filter;
+struct pci_access;
+
+/*
+ * EEPROM controller register backends. The protocol functions below talk to
+ * the controller only through eep_reg_read()/eep_reg_write(), so they can be
+ * pointed at the real PEX8608 BAR0 or at the software model in eep-model.c.
+ */
+struct eep_methods {
+    char *name;
+    uint32_t (*read)(struct device *d, uint32_t reg);
+    void (*write)(struct device *d, uint32_t reg, uint32_t data);
+};
+
+extern struct eep_methods eep_hw_methods, eep_model_methods;
+extern struct eep_methods *eep_backend;
+
+static inline uint32_t eep_reg_read(struct device *d, uint32_t reg)
+{
+    return eep_backend->read(d, reg);
+}
+
+static inline void eep_reg_write(struct device *d, uint32_t reg, uint32_t data)
+{
+    eep_backend->write(d, reg, data);
+}
+
+/* Bytes saved by -s for an EEPROM whose first dword is header */
+static inline uint32_t eep_dump_size(uint32_t header, uint16_t extra)
+{
+    uint32_t size = sizeof(uint32_t) + (header >> 16);
+
+    if (extra)
+        size = (size + extra + 1) & ~(uint32_t)0x1;
+    return size;
+}
+
+/*
+ * Session copy of the EEPROM contents of one device. Reads fill it, writes
+ * go through it, and a reset of the card throws it away.
+ */
+struct eep_shadow {
+    uint32_t data[EEP_MAX_DWORDS];
+    uint32_t valid[EEP_MAX_DWORDS / 32];
+};
+
+/* adna.c */
+struct eep_shadow *eep_shadow_new(void);
+void eep_shadow_invalidate(struct eep_shadow *s);
+void eep_read(struct device *d, uint32_t offset, volatile uint32_t *read_buffer);
+uint32_t eep_read_uncached(struct device *d, uint32_t offset);
+void eep_read_16(struct device *d, uint32_t offset, uint16_t *read_buffer);
+void eep_read_range(struct device *d, uint32_t offset, uint32_t count, uint32_t *buffer);
+void eep_write(struct device *d, uint32_t offset, uint32_t write_buffer);
+void eep_write_16(struct device *d, uint32_t offset, uint16_t write_buffer);
+void eep_init(struct device *d);
+void eep_erase(struct device *d);
+bool eep_hw_map(struct device *d);
+void eep_hw_unmap(struct device *d);
+int eep_serial_offset(const uint8_t *buf, uint32_t size);
+bool eep_write_retry(struct device *d, uint32_t dword, uint32_t value, bool half, uint32_t *read);
+
+/* eep-model.c */
+#define EEP_MODEL_DWORDS        EEP_MAX_DWORDS
+
+void eep_model_setup(int present, unsigned int wear_limit, unsigned int busy_polls);
+void eep_model_stats(unsigned long *writes, unsigned long *worn);
+
+/* eep-soak.c */
+int eep_soak(struct device *d, unsigned int cycles, uint32_t start, uint32_t count);
+
+/* eep-verify.c */
+#define EEP_VERIFY_REPORT         1     /* Collect all mismatches, not just the first */
+#define EEP_VERIFY_IGNORE_SERIAL  2     /* Skip the serial number bytes */
+
+struct eep_mapped_image {
+    const uint8_t *data;
+    uint32_t size;
+    int serial;                         /* Offset of the serial number, -1 if none */
+};
+
+int eep_image_map(const char *name, struct eep_mapped_image *img);
+void eep_image_unmap(struct eep_mapped_image *img);
+int eep_verify_devices(struct device **devs, int count,
+                       const struct eep_mapped_image *img, int flags);
+
+/* eep-generate.c */
+int eep_generate(const char *base, uint32_t first, uint32_t last, const char *dir);
+
+/* eep-prefetch.c */
+struct eep_cache_entry {
+    int domain, bus, slot, func;
+    bool complete;
+    uint32_t header;                    /* First EEPROM dword */
+    uint32_t size;                      /* Bytes -s would save */
+    uint32_t len;                       /* Bytes fetched, from offset 0 */
+    uint8_t *data;
+};
+
+void eep_prefetch_start(struct pci_access *(*new_access)(void), struct pci_filter **devs,
+                        int count, bool full, uint16_t extra);
+void eep_prefetch_stop(void);
+const struct eep_cache_entry *eep_prefetch_get(struct pci_dev *p);
+void eep_prefetch_free(void);
+
+/* eep-job.c */
+enum EEP_JOB_KIND {
+    EEP_JOB_WRITE,
+    EEP_JOB_READ,
+    EEP_JOB_RESET,
+    EEP_JOB_POWER
+};
+
+enum EEP_JOB_STATE {
+    EEP_JOB_QUEUED,
+    EEP_JOB_RUNNING,
+    EEP_JOB_DONE,
+    EEP_JOB_FAILED,
+    EEP_JOB_CANCELLED
+};
+
+struct eep_job_stats {
+    int state;
+    int status;                         /* EXIT_SUCCESS or EEP_* once finished */
+    uint32_t done, total;               /* Dwords, or steps of a reset */
+    uint32_t written, unchanged, retried, failed;
+    uint64_t reads;                     /* Controller register reads sent to the card */
+    uint64_t submit_ns, start_ns, end_ns;
+};
+
+struct eep_job;
+
+int eep_job_init(struct pci_access *(*new_access)(void));
+struct eep_job *eep_job_write(struct pci_filter *dev, const uint8_t *image, uint32_t size,
+                              bool keep_serial);
+struct eep_job *eep_job_read(struct pci_filter *dev, uint16_t extra);
+struct eep_job *eep_job_reset(struct pci_filter *h1a, struct pci_filter *parent, bool slot_reset);
+struct eep_job *eep_job_power(struct pci_filter *dev, int state);
+void eep_job_stats(struct eep_job *j, struct eep_job_stats *st);
+const uint8_t *eep_job_data(struct eep_job *j, uint32_t *size);
+void eep_job_cancel(struct eep_job *j);
+void eep_job_free(struct eep_job *j);
+
 #endif // __EEP_H__
\ No newline at end of file
@@ -0,0 +1,390 @@
+/*
+ *	H1A EEPROM Tool -- Fake sysfs Tree for Testing without Hardware
+ *
+ *	Copyright (c) 2023 Adnacom, Inc.
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "adna.h"
+
+/*
+ * Builds a directory that looks like /sys/bus/pci to libpci and to us: one
+ * root port per H1A, each with the H1A upstream port behind it and two
+ * downstream ports below that. Devices are listed under devices/ as links
+ * into a hierarchy/ tree, so the parent of a device is found the same way
+ * as on a real system. Config space and BAR0 are plain files.
+ *
+ * Plain files do not react to being written, so a second process started
+ * with --fake-serve plays the kernel: it watches the remove and rescan
+ * files with inotify and moves device links to and from .removed/, and
+ * devices come back from a rescan in D0 as they would after the reset.
+ * The EEPROM controller is not emulated. BAR0 is a plain mapped file the
+ * tool writes a command to and reads the status back from at once, with
+ * nothing in between another process could hook, so the tree shows every
+ * H1A without an EEPROM.
+ */
+
+#define FAKE_PORTS_PER_DOMAIN  63		/* Four buses each, 1-252 */
+#define FAKE_BUSES_PER_PORT    4		/* Upstream, internal, two downstream */
+#define FAKE_DOWNSTREAM_PORTS  2
+#define FAKE_BAR0_SIZE         4096
+#define FAKE_CFG_SIZE          4096
+
+#define FAKE_ROOT_PORT_VENDOR  0x8086
+#define FAKE_ROOT_PORT_DEVICE  0x1901
+#define FAKE_H1A_VENDOR        0x10b5
+#define FAKE_H1A_DEVICE        0x8608
+
+#define FAKE_CAP_PM            0x40
+#define FAKE_CAP_EXP           0x68
+#define FAKE_ECAP_ACS          0x100
+
+static int fake_mkdir(const char *path)
+{
+  if (mkdir(path, 0755) && errno != EEXIST) {
+    printf("ERROR: Unable to create \"%s\" (%s)\n", path, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static int fake_file(const char *dir, const char *name, const void *data, size_t len)
+{
+  char path[PATH_MAX];
+  FILE *f;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  if (!(f = fopen(path, "w")) || fwrite(data, 1, len, f) != len || fclose(f)) {
+    printf("ERROR: Unable to write \"%s\" (%s)\n", path, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static int fake_printf(const char *dir, const char *name, const char *fmt, unsigned int val)
+{
+  char buf[64];
+
+  snprintf(buf, sizeof(buf), fmt, val);
+  return fake_file(dir, name, buf, strlen(buf));
+}
+
+/* Type 1 header with PM and PCI Express capabilities, ACS on downstream ports */
+static void fake_config(uint8_t *cfg, unsigned int vendor, unsigned int device,
+                        int pcie_type, int primary, int secondary, int subordinate)
+{
+  memset(cfg, 0, FAKE_CFG_SIZE);
+  cfg[PCI_VENDOR_ID] = vendor & 0xff;
+  cfg[PCI_VENDOR_ID + 1] = vendor >> 8;
+  cfg[PCI_DEVICE_ID] = device & 0xff;
+  cfg[PCI_DEVICE_ID + 1] = device >> 8;
+  cfg[PCI_COMMAND] = PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER;
+  cfg[PCI_STATUS] = PCI_STATUS_CAP_LIST;
+  cfg[PCI_CLASS_DEVICE] = PCI_CLASS_BRIDGE_PCI & 0xff;
+  cfg[PCI_CLASS_DEVICE + 1] = PCI_CLASS_BRIDGE_PCI >> 8;
+  cfg[PCI_HEADER_TYPE] = PCI_HEADER_TYPE_BRIDGE;
+  cfg[PCI_PRIMARY_BUS] = primary;
+  cfg[PCI_SECONDARY_BUS] = secondary;
+  cfg[PCI_SUBORDINATE_BUS] = subordinate;
+  cfg[PCI_CAPABILITY_LIST] = FAKE_CAP_PM;
+
+  cfg[FAKE_CAP_PM + PCI_CAP_LIST_ID] = PCI_CAP_ID_PM;
+  cfg[FAKE_CAP_PM + PCI_CAP_LIST_NEXT] = FAKE_CAP_EXP;
+  cfg[FAKE_CAP_PM + 2] = 0x03;			/* PMC: version 3 */
+
+  cfg[FAKE_CAP_EXP + PCI_CAP_LIST_ID] = PCI_CAP_ID_EXP;
+  cfg[FAKE_CAP_EXP + PCI_EXP_FLAGS] = 2 | (pcie_type << 4);
+  cfg[FAKE_CAP_EXP + PCI_EXP_LNKCAP] = 0x42;	/* 5 GT/s x4 */
+  cfg[FAKE_CAP_EXP + PCI_EXP_LNKCAP + 2] = 0x10;	/* DLL Link Active reporting */
+  cfg[FAKE_CAP_EXP + PCI_EXP_LNKSTA] = 0x42;	/* 5 GT/s x4 */
+  cfg[FAKE_CAP_EXP + PCI_EXP_LNKSTA + 1] = PCI_EXP_LNKSTA_DL_ACT >> 8;
+
+  if (pcie_type == PCI_EXP_TYPE_DOWNSTREAM) {
+    cfg[FAKE_ECAP_ACS] = PCI_EXT_CAP_ID_ACS;
+    cfg[FAKE_ECAP_ACS + 2] = 0x01;		/* Version 1, last capability */
+    cfg[FAKE_ECAP_ACS + PCI_ACS_CAP] = 0x1f;	/* SV TB RR CR UF */
+    cfg[FAKE_ECAP_ACS + PCI_ACS_CTRL] = 0x1d;	/* SV RR CR UF, as Linux sets it */
+  }
+}
+
+/* resource: BAR0 plus five empty BARs and the ROM */
+static int fake_resource(const char *dir, unsigned long long bar0)
+{
+  char path[PATH_MAX];
+  FILE *f;
+
+  snprintf(path, sizeof(path), "%s/resource", dir);
+  if (!(f = fopen(path, "w")))
+    goto err;
+  for (int i = 0; i < 7; i++)
+    if (!i && bar0)
+      fprintf(f, "0x%016llx 0x%016llx 0x%016llx\n", bar0, bar0 + FAKE_BAR0_SIZE - 1, 0x40200ULL);
+    else
+      fprintf(f, "0x%016llx 0x%016llx 0x%016llx\n", 0ULL, 0ULL, 0ULL);
+  if (ferror(f) | fclose(f))
+    goto err;
+  return 0;
+err:
+  printf("ERROR: Unable to write \"%s\" (%s)\n", path, strerror(errno));
+  return -1;
+}
+
+static int fake_device(const char *root, const char *dir, const char *bdf,
+                       const char *link, const uint8_t *cfg, unsigned long long bar0)
+{
+  char path[PATH_MAX];
+
+  if (fake_mkdir(dir) ||
+      fake_file(dir, "config", cfg, FAKE_CFG_SIZE) ||
+      fake_printf(dir, "vendor", "0x%04x\n", cfg[0] | cfg[1] << 8) ||
+      fake_printf(dir, "device", "0x%04x\n", cfg[2] | cfg[3] << 8) ||
+      fake_printf(dir, "class", "0x%06x\n", PCI_CLASS_BRIDGE_PCI << 8) ||
+      fake_printf(dir, "irq", "%u\n", 0) ||
+      fake_file(dir, "remove", "", 0) ||
+      fake_resource(dir, bar0))
+    return -1;
+
+  if (bar0) {
+    uint8_t *bar = calloc(1, FAKE_BAR0_SIZE);
+    int err = fake_file(dir, "resource0", bar, FAKE_BAR0_SIZE);
+    free(bar);
+    if (err)
+      return -1;
+  }
+
+  snprintf(path, sizeof(path), "%s/devices/%s", root, bdf);
+  unlink(path);
+  if (symlink(link, path)) {
+    printf("ERROR: Unable to create \"%s\" (%s)\n", path, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+int fake_sysfs_create(const char *root, int count)
+{
+  char path[PATH_MAX], dir[PATH_MAX], link[PATH_MAX];
+  char rp[32], h1a[32];
+  uint8_t *cfg = xmalloc(FAKE_CFG_SIZE);
+  int status = EXIT_FAILURE;
+
+  snprintf(path, sizeof(path), "%s/devices", root);
+  if (fake_mkdir(root) || fake_mkdir(path))
+    goto out;
+  snprintf(path, sizeof(path), "%s/.removed", root);
+  if (fake_mkdir(path))
+    goto out;
+  snprintf(path, sizeof(path), "%s/hierarchy", root);
+  if (fake_mkdir(path) || fake_file(root, "rescan", "", 0))
+    goto out;
+
+  for (int i = 0; i < count; i++) {
+    int domain = i / FAKE_PORTS_PER_DOMAIN, local = i % FAKE_PORTS_PER_DOMAIN;
+    int bus = 1 + local * FAKE_BUSES_PER_PORT, last = bus + FAKE_BUSES_PER_PORT - 1;
+    char host[32], dp[32];
+
+    snprintf(host, sizeof(host), "pci%04x:00", domain);
+    snprintf(rp, sizeof(rp), "%04x:00:%02x.%d", domain, 1 + local / 8, local % 8);
+    snprintf(h1a, sizeof(h1a), "%04x:%02x:00.0", domain, bus);
+
+    snprintf(dir, sizeof(dir), "%s/hierarchy/%s", root, host);
+    if (fake_mkdir(dir))
+      goto out;
+
+    snprintf(dir, sizeof(dir), "%s/hierarchy/%s/%s", root, host, rp);
+    snprintf(link, sizeof(link), "../hierarchy/%s/%s", host, rp);
+    fake_config(cfg, FAKE_ROOT_PORT_VENDOR, FAKE_ROOT_PORT_DEVICE, PCI_EXP_TYPE_ROOT_PORT,
+                0, bus, last);
+    if (fake_device(root, dir, rp, link, cfg, 0))
+      goto out;
+
+    snprintf(dir, sizeof(dir), "%s/hierarchy/%s/%s/%s", root, host, rp, h1a);
+    snprintf(link, sizeof(link), "../hierarchy/%s/%s/%s", host, rp, h1a);
+    fake_config(cfg, FAKE_H1A_VENDOR, FAKE_H1A_DEVICE, PCI_EXP_TYPE_UPSTREAM, bus, bus + 1, last);
+    if (fake_device(root, dir, h1a, link, cfg, 0xf0000000ULL + (unsigned long long)i * 0x100000))
+      goto out;
+
+    for (int p = 0; p < FAKE_DOWNSTREAM_PORTS; p++) {
+      snprintf(dp, sizeof(dp), "%04x:%02x:%02x.0", domain, bus + 1, p + 1);
+      snprintf(dir, sizeof(dir), "%s/hierarchy/%s/%s/%s/%s", root, host, rp, h1a, dp);
+      snprintf(link, sizeof(link), "../hierarchy/%s/%s/%s/%s", host, rp, h1a, dp);
+      fake_config(cfg, FAKE_H1A_VENDOR, FAKE_H1A_DEVICE, PCI_EXP_TYPE_DOWNSTREAM,
+                  bus + 1, bus + 2 + p, bus + 2 + p);
+      if (fake_device(root, dir, dp, link, cfg, 0))
+        goto out;
+    }
+  }
+
+  printf("Created %d H1A device(s) under %s\n", count, root);
+  status = EXIT_SUCCESS;
+out:
+  free(cfg);
+  return status;
+}
+
+/* Remove a device and everything below it, as writing 1 to its remove file does */
+static void fake_sysfs_remove(const char *root, const char *slot)
+{
+  char path[PATH_MAX], target[PATH_MAX], gone[PATH_MAX], pattern[NAME_MAX + 2];
+  struct dirent *e;
+  DIR *dir;
+  ssize_t len;
+
+  snprintf(path, sizeof(path), "%s/devices", root);
+  if (!(dir = opendir(path)))
+    return;
+  snprintf(pattern, sizeof(pattern), "/%s", slot);
+  while ((e = readdir(dir))) {
+    char *m;
+
+    if (e->d_name[0] == '.')
+      continue;
+    snprintf(path, sizeof(path), "%s/devices/%s", root, e->d_name);
+    if ((len = readlink(path, target, sizeof(target) - 1)) < 0)
+      continue;
+    target[len] = 0;
+    m = strstr(target, pattern);
+    if (!m || (m[strlen(pattern)] && m[strlen(pattern)] != '/'))
+      continue;
+    snprintf(gone, sizeof(gone), "%s/.removed/%s", root, e->d_name);
+    rename(path, gone);
+  }
+  closedir(dir);
+}
+
+/* Bring back every removed device, out of the reset that removed it and in D0 */
+static void fake_sysfs_rescan(const char *root)
+{
+  char path[PATH_MAX], back[PATH_MAX];
+  struct dirent *e;
+  DIR *dir;
+  uint8_t pmcsr;
+  int fd;
+
+  snprintf(path, sizeof(path), "%s/.removed", root);
+  if (!(dir = opendir(path)))
+    return;
+  while ((e = readdir(dir))) {
+    if (e->d_name[0] == '.')
+      continue;
+    snprintf(path, sizeof(path), "%s/.removed/%s", root, e->d_name);
+    snprintf(back, sizeof(back), "%s/devices/%s", root, e->d_name);
+    if (rename(path, back))
+      continue;
+    snprintf(path, sizeof(path), "%s/devices/%s/config", root, e->d_name);
+    if ((fd = open(path, O_RDWR)) < 0)
+      continue;
+    if (pread(fd, &pmcsr, 1, FAKE_CAP_PM + PCI_PM_CTRL) == 1) {
+      pmcsr &= ~PCI_PM_CTRL_STATE_MASK;
+      if (pwrite(fd, &pmcsr, 1, FAKE_CAP_PM + PCI_PM_CTRL) != 1)
+        printf("WARNING: Unable to reset the power state of %s\n", e->d_name);
+    }
+    close(fd);
+  }
+  closedir(dir);
+}
+
+struct fake_dev {
+  char name[NAME_MAX + 1];		/* PCI_SLOT_NAME */
+  int wd;				/* inotify watch of remove */
+};
+
+static volatile sig_atomic_t fake_stop;
+
+static void fake_signal(int sig UNUSED)
+{
+  fake_stop = 1;
+}
+
+/* Watch the remove files of the devices listed in devices/ or .removed/ */
+static void fake_serve_scan(const char *root, const char *sub, int ifd,
+                            struct fake_dev **devs, int *count)
+{
+  char path[PATH_MAX];
+  struct dirent *e;
+  DIR *dir;
+
+  snprintf(path, sizeof(path), "%s/%s", root, sub);
+  if (!(dir = opendir(path)))
+    return;
+  while ((e = readdir(dir))) {
+    struct fake_dev *f;
+
+    if (e->d_name[0] == '.')
+      continue;
+    snprintf(path, sizeof(path), "%s/%s/%s/remove", root, sub, e->d_name);
+    *devs = xrealloc(*devs, (*count + 1) * sizeof(**devs));
+    f = &(*devs)[(*count)++];
+    snprintf(f->name, sizeof(f->name), "%s", e->d_name);
+    if ((f->wd = inotify_add_watch(ifd, path, IN_CLOSE_WRITE)) < 0)
+      printf("WARNING: Cannot watch \"%s\" (%s), removal not emulated\n", path, strerror(errno));
+  }
+  closedir(dir);
+}
+
+int fake_sysfs_serve(const char *root)
+{
+  char path[PATH_MAX];
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct fake_dev *devs = NULL;
+  struct sigaction sa;
+  unsigned long removed = 0, rescans = 0;
+  int ifd, rescan_wd, count = 0;
+  ssize_t len;
+
+  if ((ifd = inotify_init1(IN_CLOEXEC)) < 0) {
+    printf("ERROR: inotify is not available (%s)\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
+  snprintf(path, sizeof(path), "%s/rescan", root);
+  if ((rescan_wd = inotify_add_watch(ifd, path, IN_CLOSE_WRITE)) < 0) {
+    printf("ERROR: \"%s\" is not a fake sysfs tree (%s)\n", root, strerror(errno));
+    close(ifd);
+    return EXIT_FAILURE;
+  }
+  fake_serve_scan(root, "devices", ifd, &devs, &count);
+  fake_serve_scan(root, ".removed", ifd, &devs, &count);
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = fake_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  printf("Serving %d device(s) under %s (Ctrl-C to stop)\n", count, root);
+  fflush(stdout);
+  while (!fake_stop && (len = read(ifd, buf, sizeof(buf))) > 0)
+    for (char *p = buf; p < buf + len;
+         p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+      struct inotify_event *ev = (struct inotify_event *)p;
+
+      if (ev->wd == rescan_wd) {
+        fake_sysfs_rescan(root);
+        rescans++;
+        continue;
+      }
+      for (int i = 0; i < count; i++)
+        if (devs[i].wd == ev->wd) {
+          fake_sysfs_remove(root, devs[i].name);
+          removed++;
+          break;
+        }
+    }
+
+  free(devs);
+  close(ifd);
+  printf("\nStopped after %lu removal(s) and %lu rescan(s)\n", removed, rescans);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,252 @@
+/*
+ *	H1A EEPROM Tool -- Link Speed and Width Audit
+ *
+ *	Copyright (c) 2023 Adnacom, Inc.
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "adna.h"
+
+/*
+ * Checks the link above every H1A and the links below its downstream
+ * ports against what both ends advertise in Link Capabilities. A link that
+ * came up slower or narrower than that is retrained from its downstream
+ * port (the end that owns Retrain Link), after pointing Target Link Speed
+ * at the best common speed. Every retrain runs in its own thread with its
+ * own access structure, so a slow link does not hold up the others.
+ */
+
+#define AUDIT_POLL_NS   (1000000ULL)		/* 1 ms */
+
+struct audit_link {
+  struct pci_filter port;		/* Downstream end, does the retrain */
+  struct pci_filter peer;		/* Upstream end */
+  int cap_speed, cap_width;		/* Best both ends support */
+  u16 before, after;			/* Link Status */
+  u64 retrain_ns;
+  bool retrained;
+  const char *result;
+};
+
+struct audit_job {
+  struct audit_link *link;
+  unsigned int timeout_ms;
+  struct pci_access *(*new_access)(void);
+};
+
+static void audit_filter(struct pci_filter *f, struct pci_dev *d)
+{
+  pci_filter_init(NULL, f);
+  f->domain = d->domain;
+  f->bus = d->bus;
+  f->slot = d->dev;
+  f->func = d->func;
+}
+
+static inline int audit_min(int a, int b)
+{
+  return (a < b) ? a : b;
+}
+
+static bool audit_degraded(const struct audit_link *l, u16 lnksta)
+{
+  return (lnksta & PCI_EXP_LNKSTA_SPEED) < l->cap_speed ||
+         ((lnksta & PCI_EXP_LNKSTA_WIDTH) >> 4) < l->cap_width;
+}
+
+/* Function 0 of device 0 on a bus, NULL if nothing is plugged in */
+static struct pci_dev *audit_find(struct pci_access *a, int domain, int bus)
+{
+  for (struct pci_dev *p = a->devices; p; p = p->next)
+    if (p->domain == domain && p->bus == bus && !p->dev && !p->func)
+      return p;
+  return NULL;
+}
+
+/* Fill in the link between port and the device below it, false if there is none */
+static bool audit_add(struct audit_link *l, struct pci_dev *port, struct pci_dev *peer)
+{
+  int pexp = pcie_cap(port), qexp;
+  u32 pcap, qcap;
+
+  if (!peer || pci_read_word(peer, PCI_VENDOR_ID) == 0xffff)
+    return false;
+  qexp = pcie_cap(peer);
+  if (!pexp || !qexp)
+    return false;
+
+  memset(l, 0, sizeof(*l));
+  audit_filter(&l->port, port);
+  audit_filter(&l->peer, peer);
+  pcap = pci_read_long(port, pexp + PCI_EXP_LNKCAP);
+  qcap = pci_read_long(peer, qexp + PCI_EXP_LNKCAP);
+  l->cap_speed = audit_min(pcap & PCI_EXP_LNKCAP_SPEED, qcap & PCI_EXP_LNKCAP_SPEED);
+  l->cap_width = audit_min((pcap & PCI_EXP_LNKCAP_WIDTH) >> 4, (qcap & PCI_EXP_LNKCAP_WIDTH) >> 4);
+  l->before = l->after = pci_read_word(port, pexp + PCI_EXP_LNKSTA);
+  l->result = "ok";
+  return true;
+}
+
+static void audit_sleep(void)
+{
+  struct timespec ts = { 0, AUDIT_POLL_NS };
+
+  nanosleep(&ts, NULL);
+}
+
+/* Wait for Link Training to clear and, if reported, the Data Link Layer to come up */
+static bool audit_wait(struct pci_dev *d, int exp, bool dllla, u64 deadline, u16 *lnksta)
+{
+  for (;;) {
+    *lnksta = pci_read_word(d, exp + PCI_EXP_LNKSTA);
+    if (!(*lnksta & PCI_EXP_LNKSTA_TRAIN) && (!dllla || (*lnksta & PCI_EXP_LNKSTA_DL_ACT)))
+      return true;
+    if (monotonic_ns() >= deadline)
+      return false;
+    audit_sleep();
+  }
+}
+
+static void *audit_thread(void *arg)
+{
+  struct audit_job *job = arg;
+  struct audit_link *l = job->link;
+  struct pci_access *a = job->new_access();
+  struct pci_dev *d;
+  u64 t0, deadline;
+  bool dllla;
+  u16 ctl, sta;
+  int exp;
+
+  pci_init(a);
+  d = pci_get_dev(a, l->port.domain, l->port.bus, l->port.slot, l->port.func);
+  exp = pcie_cap(d);
+  dllla = pci_read_long(d, exp + PCI_EXP_LNKCAP) & PCI_EXP_LNKCAP_DLLA;
+
+  /* Target Link Speed lives in Link Control 2, capability version 2 and up */
+  if ((pci_read_word(d, exp + PCI_EXP_FLAGS) & PCI_EXP_FLAGS_VERS) >= 2) {
+    ctl = pci_read_word(d, exp + PCI_EXP_LNKCTL2);
+    pci_write_word(d, exp + PCI_EXP_LNKCTL2, (ctl & ~0xf) | l->cap_speed);
+  }
+
+  t0 = monotonic_ns();
+  deadline = t0 + job->timeout_ms * 1000000ULL;
+  if (!audit_wait(d, exp, false, deadline, &sta)) {
+    l->result = "busy training, not retrained";
+    goto out;
+  }
+  ctl = pci_read_word(d, exp + PCI_EXP_LNKCTL);
+  pci_write_word(d, exp + PCI_EXP_LNKCTL, ctl | PCI_EXP_LNKCTL_RETRAIN);
+  l->retrained = true;
+  if (!audit_wait(d, exp, dllla, deadline, &sta))
+    l->result = "timeout";
+  else if (audit_degraded(l, sta))
+    l->result = "still degraded";
+  else
+    l->result = "fixed";
+  l->retrain_ns = monotonic_ns() - t0;
+  l->after = sta;
+out:
+  pci_free_dev(d);
+  pci_cleanup(a);
+  return NULL;
+}
+
+static void audit_state(char *buf, size_t len, u16 lnksta)
+{
+  snprintf(buf, len, "%s x%d", pcie_speed_name(lnksta & PCI_EXP_LNKSTA_SPEED),
+           (lnksta & PCI_EXP_LNKSTA_WIDTH) >> 4);
+}
+
+int link_audit(struct pci_access *a, struct pci_filter **h1a, struct pci_filter **parent,
+               int count, unsigned int timeout_ms, struct pci_access *(*new_access)(void))
+{
+  struct audit_link *links;
+  struct audit_job *jobs;
+  pthread_t *threads;
+  bool *started;
+  struct pci_dev *p;
+  int n = 0, max = 0, bad = 0, retrains = 0;
+
+  pci_scan_bus(a);
+  for (p = a->devices; p; p = p->next)
+    max++;
+  links = xmalloc((max + count + 1) * sizeof(*links));
+
+  for (int i = 0; i < count; i++) {
+    struct pci_dev *up = pci_get_dev(a, h1a[i]->domain, h1a[i]->bus, h1a[i]->slot, h1a[i]->func);
+    struct pci_dev *pp = pci_get_dev(a, parent[i]->domain, parent[i]->bus, parent[i]->slot, parent[i]->func);
+    int sec = pci_read_byte(up, PCI_SECONDARY_BUS);
+
+    if (audit_add(&links[n], pp, up))
+      n++;
+    /* H1A downstream ports and whatever is plugged into them */
+    for (p = a->devices; p; p = p->next) {
+      int exp;
+
+      if (p->domain != up->domain || p->bus != sec || !(exp = pcie_cap(p)) ||
+          ((pci_read_word(p, exp + PCI_EXP_FLAGS) & PCI_EXP_FLAGS_TYPE) >> 4) != PCI_EXP_TYPE_DOWNSTREAM)
+        continue;
+      if (audit_add(&links[n], p, audit_find(a, p->domain, pci_read_byte(p, PCI_SECONDARY_BUS))))
+        n++;
+    }
+    pci_free_dev(up);
+    pci_free_dev(pp);
+  }
+
+  /* Retrain the degraded ones, all at the same time */
+  jobs = xmalloc((n + 1) * sizeof(*jobs));
+  threads = xmalloc((n + 1) * sizeof(*threads));
+  started = xmalloc((n + 1) * sizeof(*started));
+  for (int i = 0; i < n; i++) {
+    started[i] = false;
+    if (!audit_degraded(&links[i], links[i].before))
+      continue;
+    jobs[i].link = &links[i];
+    jobs[i].timeout_ms = timeout_ms;
+    jobs[i].new_access = new_access;
+    if (!pthread_create(&threads[i], NULL, audit_thread, &jobs[i]))
+      started[i] = true;
+    else
+      audit_thread(&jobs[i]);		/* Out of threads, do it here */
+    retrains++;
+  }
+  for (int i = 0; i < n; i++)
+    if (started[i])
+      pthread_join(threads[i], NULL);
+
+  printf("%-13s %-13s %-12s %-12s %-12s %8s  %s\n",
+         "Port", "Device", "Capable", "Before", "After", "Retrain", "Result");
+  for (int i = 0; i < n; i++) {
+    struct audit_link *l = &links[i];
+    char cap[16], before[16], after[16], ms[16];
+
+    snprintf(cap, sizeof(cap), "%s x%d", pcie_speed_name(l->cap_speed), l->cap_width);
+    audit_state(before, sizeof(before), l->before);
+    audit_state(after, sizeof(after), l->after);
+    if (l->retrained)
+      snprintf(ms, sizeof(ms), "%.1f ms", l->retrain_ns / 1e6);
+    else
+      strcpy(ms, "-");
+    printf("%04x:%02x:%02x.%d  %04x:%02x:%02x.%d  %-12s %-12s %-12s %8s  %s\n",
+           l->port.domain, l->port.bus, l->port.slot, l->port.func,
+           l->peer.domain, l->peer.bus, l->peer.slot, l->peer.func,
+           cap, before, after, ms, l->result);
+    if (audit_degraded(l, l->after))
+      bad++;
+  }
+  printf("%d link(s) checked, %d retrained, %d below capability\n", n, retrains, bad);
+
+  free(links);
+  free(jobs);
+  free(threads);
+  free(started);
+  return bad ? EXIT_FAILURE : EXIT_SUCCESS;
+}
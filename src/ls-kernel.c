@@ -7,6 +7,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -16,16 +17,48 @@
 
 #include <sys/utsname.h>
 
+/*
+ *  Kernel modules which can drive a device depend only on its IDs and class,
+ *  so they are resolved once per distinct key and kept for the rest of the
+ *  run. The module database itself is opened only when the first device
+ *  with kernel info is shown.
+ */
+
+#define MODULE_CACHE_SIZE 64
+
+struct module_cache {
+  struct module_cache *next;
+  unsigned int vendor, device;
+  unsigned int subvendor, subdevice;
+  unsigned int class;
+  int count;
+  char **modules;
+};
+
+static struct module_cache *module_cache[MODULE_CACHE_SIZE];
+
+static void
+module_add(struct module_cache *m, const char *name)
+{
+  int i;
+
+  for (i = 0; i < m->count; i++)
+    if (!strcmp(m->modules[i], name))
+      return;
+  m->modules = xrealloc(m->modules, (m->count + 1) * sizeof(char *));
+  m->modules[m->count++] = xstrdup(name);
+}
+
 #ifdef PCI_USE_LIBKMOD
 
 #include <libkmod.h>
 
 static struct kmod_ctx *kmod_ctx;
+static int show_kernel_inited = -1;
 
 static int
 show_kernel_init(void)
 {
-  static int show_kernel_inited = -1;
   if (show_kernel_inited >= 0)
     return show_kernel_inited;
 
@@ -54,46 +87,35 @@ failed:
 void
 show_kernel_cleanup(void)
 {
+  /* Resolved modules stay cached, only the index mapping is released */
   if (kmod_ctx)
     kmod_unref(kmod_ctx);
+  kmod_ctx = NULL;
+  show_kernel_inited = -1;
 }
 
-static const char *next_module(struct device *d)
+static void
+find_modules(struct device *d, struct module_cache *m)
 {
-  static struct kmod_list *klist, *kcurrent;
-  static struct kmod_module *kmodule;
-
-  if (kmodule)
-    {
-      kmod_module_unref(kmodule);
-      kmodule = NULL;
-    }
+  struct kmod_list *klist = NULL, *l;
 
-  if (!klist)
+  pci_fill_info(d->dev, PCI_FILL_MODULE_ALIAS);
+  if (!d->dev->module_alias)
+    return;
+  int err = kmod_module_new_from_lookup(kmod_ctx, d->dev->module_alias, &klist);
+  if (err < 0)
     {
-      pci_fill_info(d->dev, PCI_FILL_MODULE_ALIAS);
-      if (!d->dev->module_alias)
-	return NULL;
-      int err = kmod_module_new_from_lookup(kmod_ctx, d->dev->module_alias, &klist);
-      if (err < 0)
-	{
-	  fprintf(stderr, "adna: libkmod lookup failed: error %d\n", err);
-	  return NULL;
-	}
-      kcurrent = klist;
+      fprintf(stderr, "adna: libkmod lookup failed: error %d\n", err);
+      return;
     }
-  else
-    kcurrent = kmod_list_next(klist, kcurrent);
 
-  if (kcurrent)
+  kmod_list_foreach(l, klist)
     {
-      kmodule = kmod_module_get_module(kcurrent);
-      return kmod_module_get_name(kmodule);
+      struct kmod_module *kmodule = kmod_module_get_module(l);
+      module_add(m, kmod_module_get_name(kmodule));
+      kmod_module_unref(kmodule);
     }
-
   kmod_module_unref_list(klist);
-  klist = NULL;
-  return NULL;
 }
 
 #else
@@ -106,7 +128,23 @@ struct pcimap_entry {
   char module[1];
 };
 
-static struct pcimap_entry *pcimap_head;
+/*
+ *  Entries are hashed by vendor and device ID. Those which match any vendor
+ *  or any device cannot be hashed and live in the extra last bucket, which
+ *  is searched for every device.
+ */
+#define PCIMAP_HASH_SIZE 1024
+#define PCIMAP_WILDCARD PCIMAP_HASH_SIZE
+
+static struct pcimap_entry *pcimap_hash[PCIMAP_HASH_SIZE + 1];
+
+static unsigned int
+pcimap_bucket(unsigned int vendor, unsigned int device)
+{
+  if (vendor > 0xffff || device > 0xffff)
+    return PCIMAP_WILDCARD;
+  return ((vendor << 3) ^ (device * 0x9e5)) % PCIMAP_HASH_SIZE;
+}
 
 static int
 show_kernel_init(void)
@@ -141,6 +179,7 @@ show_kernel_init(void)
     {
       char *c = strchr(line, '\n');
       struct pcimap_entry *e;
+      unsigned int h;
 
       if (!c)
 	die("Unterminated or too long line in %s", name);
@@ -160,9 +199,13 @@ show_kernel_init(void)
 		 &e->vendor, &e->device,
 		 &e->subvendor, &e->subdevice,
 		 &e->class, &e->class_mask) != 6)
-	continue;
-      e->next = pcimap_head;
-      pcimap_head = e;
+	{
+	  free(e);
+	  continue;
+	}
+      h = pcimap_bucket(e->vendor, e->device);
+      e->next = pcimap_hash[h];
+      pcimap_hash[h] = e;
       strcpy(e->module, line);
     }
   fclose(f);
@@ -171,40 +214,29 @@ show_kernel_init(void)
 }
 
 static int
-match_pcimap(struct device *d, struct pcimap_entry *e)
+match_pcimap(struct module_cache *m, struct pcimap_entry *e)
 {
-  struct pci_dev *dev = d->dev;
-  unsigned int class = get_conf_long(d, PCI_REVISION_ID) >> 8;
-  word subv, subd;
-
 #define MATCH(x, y) ((y) > 0xffff || (x) == (y))
-  get_subid(d, &subv, &subd);
   return
-    MATCH(dev->vendor_id, e->vendor) &&
-    MATCH(dev->device_id, e->device) &&
-    MATCH(subv, e->subvendor) &&
-    MATCH(subd, e->subdevice) &&
-    (class & e->class_mask) == e->class;
+    MATCH(m->vendor, e->vendor) &&
+    MATCH(m->device, e->device) &&
+    MATCH(m->subvendor, e->subvendor) &&
+    MATCH(m->subdevice, e->subdevice) &&
+    (m->class & e->class_mask) == e->class;
 #undef MATCH
 }
 
-static const char *next_module(struct device *d)
+static void
+find_modules(struct device *d UNUSED, struct module_cache *m)
 {
-  static struct pcimap_entry *current;
-
-  if (!current)
-    current = pcimap_head;
-  else
-    current = current->next;
-
-  while (current)
-    {
-      if (match_pcimap(d, current))
-	return current->module;
-      current = current->next;
-    }
-
-  return NULL;
+  struct pcimap_entry *e;
+
+  for (e = pcimap_hash[pcimap_bucket(m->vendor, m->device)]; e; e = e->next)
+    if (match_pcimap(m, e))
+      module_add(m, e->module);
+  for (e = pcimap_hash[PCIMAP_WILDCARD]; e; e = e->next)
+    if (match_pcimap(m, e))
+      module_add(m, e->module);
 }
 
 void
@@ -214,6 +246,38 @@ show_kernel_cleanup(void)
 
 #endif
 
+static struct module_cache *
+lookup_modules(struct device *d)
+{
+  struct pci_dev *dev = d->dev;
+  struct module_cache *m;
+  unsigned int class = get_conf_long(d, PCI_REVISION_ID) >> 8;
+  unsigned int h;
+  word subv, subd;
+
+  get_subid(d, &subv, &subd);
+  h = (dev->vendor_id ^ (dev->device_id << 4) ^ class ^ subd) % MODULE_CACHE_SIZE;
+  for (m = module_cache[h]; m; m = m->next)
+    if (m->vendor == dev->vendor_id && m->device == dev->device_id &&
+	m->subvendor == subv && m->subdevice == subd && m->class == class)
+      return m;
+
+  if (!show_kernel_init())
+    return NULL;
+
+  m = xmalloc(sizeof(*m));
+  memset(m, 0, sizeof(*m));
+  m->vendor = dev->vendor_id;
+  m->device = dev->device_id;
+  m->subvendor = subv;
+  m->subdevice = subd;
+  m->class = class;
+  find_modules(d, m);
+  m->next = module_cache[h];
+  module_cache[h] = m;
+  return m;
+}
+
 #define DRIVER_BUF_SIZE 1024
 
 static char *
@@ -248,41 +312,23 @@ find_driver(struct device *d, char *buf)
     return buf;
 }
 
-static const char *
-next_module_filtered(struct device *d)
-{
-  static char prev_module[256];
-  const char *module;
-
-  while (module = next_module(d))
-    {
-      if (strcmp(module, prev_module))
-	{
-	  strncpy(prev_module, module, sizeof(prev_module));
-	  prev_module[sizeof(prev_module) - 1] = 0;
-	  return module;
-	}
-    }
-  prev_module[0] = 0;
-  return NULL;
-}
-
 void
 show_kernel(struct device *d)
 {
   char buf[DRIVER_BUF_SIZE];
-  const char *driver, *module;
+  struct module_cache *modules;
+  const char *driver;
+  int i;
 
   if (driver = find_driver(d, buf))
     printf("\tKernel driver in use: %s\n", driver);
 
-  if (!show_kernel_init())
+  if (!(modules = lookup_modules(d)))
     return;
 
-  int cnt = 0;
-  while (module = next_module_filtered(d))
-    printf("%s %s", (cnt++ ? "," : "\tKernel modules:"), module);
-  if (cnt)
+  for (i = 0; i < modules->count; i++)
+    printf("%s %s", (i ? "," : "\tKernel modules:"), modules->modules[i]);
+  if (modules->count)
     putchar('\n');
 }
 
@@ -290,16 +336,18 @@ void
 show_kernel_machine(struct device *d)
 {
   char buf[DRIVER_BUF_SIZE];
-  const char *driver, *module;
+  struct module_cache *modules;
+  const char *driver;
+  int i;
 
   if (driver = find_driver(d, buf))
     printf("Driver:\t%s\n", driver);
 
-  if (!show_kernel_init())
+  if (!(modules = lookup_modules(d)))
     return;
 
-  while (module = next_module_filtered(d))
-    printf("Module:\t%s\n", module);
+  for (i = 0; i < modules->count; i++)
+    printf("Module:\t%s\n", modules->modules[i]);
 }
 
 #else
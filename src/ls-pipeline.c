@@ -0,0 +1,127 @@
+/*
+ *	H1A EEPROM Tool -- Parallel Device Listing
+ *
+ *	Copyright (c) 2023 Adnacom, Inc.
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "adna.h"
+
+/*
+ * Listing a device is mostly waiting: a dozen sysfs files for the
+ * properties and a read for every capability walked. A pool of workers,
+ * each with its own access structure, reads the whole config space of the
+ * devices in the list into their caches and fills in the sysfs properties,
+ * so the decoders that follow never leave memory. The calling thread is
+ * the sequencer: it takes the devices in list order, waits for each one to
+ * be fetched and decodes it straight to stdout, while the workers are
+ * already on the devices further down. The decoders print directly and are
+ * not thread safe, so they only ever run here.
+ */
+
+#define LIST_MAX_THREADS  16			/* Bound by I/O, not by CPUs */
+#define LIST_FILL         (PCI_FILL_IRQ | PCI_FILL_BASES | PCI_FILL_ROM_BASE | PCI_FILL_SIZES | \
+                           PCI_FILL_NUMA_NODE | PCI_FILL_DT_NODE | PCI_FILL_IOMMU_GROUP | PCI_FILL_CAPS)
+
+struct list_job {
+  struct device **devs;
+  bool *ready;
+  int count;
+  int next;				/* Next device to claim */
+  struct pci_access *(*new_access)(void);
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+};
+
+/* Read the config space of one device through the worker's own access */
+static void list_fetch(struct pci_access *a, struct device *d)
+{
+  struct pci_dev *p = pci_get_dev(a, d->dev->domain, d->dev->bus, d->dev->dev, d->dev->func);
+  unsigned int len = 0;
+
+  if (d->config_bufsize < 4096) {
+    d->config = xrealloc(d->config, 4096);
+    d->present = xrealloc(d->present, 4096);
+    memset(d->present + d->config_bufsize, 0, 4096 - d->config_bufsize);
+    d->config_bufsize = 4096;
+  }
+  if (pci_read_block(p, 0, d->config, 256)) {
+    len = 256;
+    if (pci_read_block(p, 256, d->config + 256, 4096 - 256))
+      len = 4096;
+    memset(d->present, 1, len);
+  }
+  pci_free_dev(p);
+
+  /* Capabilities and fallbacks of the properties now come from the cache */
+  pci_setup_cache(d->dev, d->config, (len > d->config_cached) ? len : d->config_cached);
+  if (len)
+    pci_fill_info(d->dev, LIST_FILL | ((len == 4096) ? PCI_FILL_EXT_CAPS : 0));
+}
+
+static void *list_thread(void *arg)
+{
+  struct list_job *job = arg;
+  struct pci_access *a = job->new_access();
+  int i;
+
+  pci_init(a);
+  while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count) {
+    list_fetch(a, job->devs[i]);
+    pthread_mutex_lock(&job->lock);
+    job->ready[i] = true;
+    pthread_cond_broadcast(&job->done);
+    pthread_mutex_unlock(&job->lock);
+  }
+  pci_cleanup(a);
+  return NULL;
+}
+
+void list_devices(struct device **devs, int count, void (*show)(struct device *),
+                  struct pci_access *(*new_access)(void))
+{
+  pthread_t threads[LIST_MAX_THREADS];
+  struct list_job job;
+  int nthreads, started = 0;
+
+  if (!count)
+    return;
+  memset(&job, 0, sizeof(job));
+  job.devs = devs;
+  job.count = count;
+  job.ready = xmalloc(count * sizeof(*job.ready));
+  memset(job.ready, 0, count * sizeof(*job.ready));
+  job.new_access = new_access;
+  pthread_mutex_init(&job.lock, NULL);
+  pthread_cond_init(&job.done, NULL);
+
+  /* Slots are found by one walk of the slot directory for all devices at once */
+  pci_fill_info(devs[0]->dev, PCI_FILL_PHYS_SLOT);
+
+  nthreads = (count < LIST_MAX_THREADS) ? count : LIST_MAX_THREADS;
+  for (int i = 0; i < nthreads; i++)
+    if (!pthread_create(&threads[started], NULL, list_thread, &job))
+      started++;
+  if (!started)
+    list_thread(&job);			/* Out of threads, do it here */
+
+  for (int i = 0; i < count; i++) {
+    pthread_mutex_lock(&job.lock);
+    while (!job.ready[i])
+      pthread_cond_wait(&job.done, &job.lock);
+    pthread_mutex_unlock(&job.lock);
+    show(devs[i]);
+  }
+
+  for (int i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  pthread_cond_destroy(&job.done);
+  pthread_mutex_destroy(&job.lock);
+  free(job.ready);
+}
@@ -0,0 +1,476 @@
+/*
+ *	H1A EEPROM Tool -- Compact Store for Monitor Samples
+ *
+ *	Copyright (c) 2023 Adnacom, Inc.
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "adna.h"
+
+/*
+ * File layout, all in host byte order:
+ *
+ *   header     struct mon_header and its column table, padded to a
+ *              multiple of MON_HEADER_ALIGN
+ *   segment    up to MON_SEG_SAMPLES samples: struct mon_segment, the
+ *              length of every column chunk, then the chunks themselves
+ *   ...
+ *   index      every MON_INDEX_SEGMENTS segments: the tick range and
+ *              offset of each, linked to the previous index block
+ *   ...
+ *
+ * A chunk holds one column of a segment as runs of equal values, each run
+ * a zigzag varint delta from the value of the previous run followed by a
+ * varint repeat count. Sample ticks are stored the same way as deltas, so
+ * a register that does not change and a sampler that keeps its pace both
+ * cost a few bytes per segment. The file is grown and written through a
+ * shared mapping; the header records how much of it is valid, so a file
+ * left behind by a killed monitor is readable up to its last segment.
+ */
+
+#define MON_MAGIC           "H1AMON\0\2"
+#define MON_SEG_MAGIC       0x4d534547	/* "MSEG" */
+#define MON_IDX_MAGIC       0x4d494458	/* "MIDX" */
+#define MON_SEG_SAMPLES     4096
+#define MON_INDEX_SEGMENTS  64
+#define MON_GROW            (1 << 20)
+#define MON_VARINT_MAX      10
+#define MON_HEADER_ALIGN    4096
+
+struct mon_segment {
+  u32 magic;
+  u32 nsamples;
+  u64 first_tick, last_tick;
+  u64 len;				/* Whole segment in bytes */
+};
+
+struct mon_index_entry {
+  u64 first_tick, last_tick;
+  u64 offset;
+};
+
+struct mon_index {
+  u32 magic;
+  u32 count;
+  u64 prev;				/* Previous index block, 0 for the first */
+};
+
+struct mon_writer {
+  int fd;
+  byte *map;
+  u64 map_size;
+  struct mon_header *hdr;
+  int nsamples;
+  u64 *ticks;
+  u32 *values;				/* [sample][column] */
+  int nindex;
+  struct mon_index_entry index[MON_INDEX_SEGMENTS];
+};
+
+struct mon_reader {
+  byte *map;
+  u64 size;
+  const struct mon_header *hdr;
+};
+
+/*** Encoding ***/
+
+static byte *put_varint(byte *p, u64 x)
+{
+  while (x >= 0x80) {
+    *p++ = x | 0x80;
+    x >>= 7;
+  }
+  *p++ = x;
+  return p;
+}
+
+static const byte *get_varint(const byte *p, const byte *end, u64 *x)
+{
+  int shift = 0;
+
+  *x = 0;
+  while (p < end && shift < 64) {
+    *x |= (u64)(*p & 0x7f) << shift;
+    if (!(*p++ & 0x80))
+      return p;
+    shift += 7;
+  }
+  return NULL;
+}
+
+static inline u64 zigzag(int64_t x)
+{
+  return ((u64)x << 1) ^ (u64)(x >> 63);
+}
+
+static inline int64_t unzigzag(u64 x)
+{
+  return (int64_t)(x >> 1) ^ -(int64_t)(x & 1);
+}
+
+/* Runs of a sequence given by get(i), returns the end of the output */
+static byte *encode_runs(byte *p, int n, u64 (*get)(struct mon_writer *, int, int),
+                         struct mon_writer *w, int col)
+{
+  u64 prev = 0;
+  int i = 0;
+
+  while (i < n) {
+    u64 v = get(w, col, i);
+    int run = 1;
+
+    while (i + run < n && get(w, col, i + run) == v)
+      run++;
+    p = put_varint(p, zigzag((int64_t)(v - prev)));
+    p = put_varint(p, run);
+    prev = v;
+    i += run;
+  }
+  return p;
+}
+
+/* Where the segments start in a file with ncols columns */
+static u64 mon_data_start(u64 ncols)
+{
+  u64 size = sizeof(struct mon_header) + ncols * sizeof(struct mon_column);
+
+  return (size + MON_HEADER_ALIGN - 1) & ~(u64)(MON_HEADER_ALIGN - 1);
+}
+
+static u64 get_tick_delta(struct mon_writer *w, int col UNUSED, int i)
+{
+  return i ? w->ticks[i] - w->ticks[i - 1] : 0;
+}
+
+static u64 get_value(struct mon_writer *w, int col, int i)
+{
+  return w->values[(size_t)i * w->hdr->ncolumns + col];
+}
+
+/* Decodes n values, returns 0 if the chunk is malformed */
+static int decode_runs(const byte *p, const byte *end, int n, u64 *out)
+{
+  u64 v = 0, delta, run;
+  int i = 0;
+
+  while (i < n) {
+    if (!(p = get_varint(p, end, &delta)) || !(p = get_varint(p, end, &run)) ||
+        !run || run > (u64)(n - i))
+      return 0;
+    v += unzigzag(delta);
+    while (run--)
+      out[i++] = v;
+  }
+  return 1;
+}
+
+/*** Writer ***/
+
+static int mon_reserve(struct mon_writer *w, u64 need)
+{
+  u64 size;
+  void *map;
+
+  if (w->hdr->used + need <= w->map_size)
+    return 0;
+  size = w->map_size + ((need > MON_GROW) ? need : MON_GROW);
+  if (ftruncate(w->fd, size))
+    return -1;
+  map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, w->fd, 0);
+  if (map == MAP_FAILED)
+    return -1;
+  munmap(w->map, w->map_size);
+  w->map = map;
+  w->map_size = size;
+  w->hdr = map;
+  return 0;
+}
+
+struct mon_writer *mon_create(const char *name, const struct mon_column *cols,
+                              int ncols, u64 interval_ns)
+{
+  struct mon_writer *w;
+  struct timespec ts;
+  u64 start, size;
+
+  if (ncols < 1) {
+    printf("ERROR: No registers to monitor\n");
+    return NULL;
+  }
+  start = mon_data_start(ncols);
+  size = start + MON_GROW;
+  w = xmalloc(sizeof(*w));
+  memset(w, 0, sizeof(*w));
+  w->fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (w->fd < 0 || ftruncate(w->fd, size)) {
+    printf("ERROR: Unable to create \"%s\" (%s)\n", name, strerror(errno));
+    goto fail;
+  }
+  w->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, w->fd, 0);
+  if (w->map == MAP_FAILED) {
+    printf("ERROR: Unable to map \"%s\" (%s)\n", name, strerror(errno));
+    goto fail;
+  }
+  w->map_size = size;
+  w->hdr = (struct mon_header *)w->map;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  memcpy(w->hdr->magic, MON_MAGIC, sizeof(w->hdr->magic));
+  w->hdr->ncolumns = ncols;
+  w->hdr->start_ns = (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  w->hdr->interval_ns = interval_ns;
+  w->hdr->used = start;
+  w->hdr->index_end = start;
+  w->hdr->data_start = start;
+  memcpy(w->hdr->columns, cols, ncols * sizeof(*cols));
+
+  w->ticks = xmalloc(MON_SEG_SAMPLES * sizeof(*w->ticks));
+  w->values = xmalloc((size_t)MON_SEG_SAMPLES * ncols * sizeof(*w->values));
+  return w;
+
+fail:
+  if (w->fd >= 0)
+    close(w->fd);
+  free(w);
+  return NULL;
+}
+
+static int mon_write_index(struct mon_writer *w)
+{
+  struct mon_index *idx;
+  u64 len = sizeof(*idx) + w->nindex * sizeof(struct mon_index_entry);
+
+  if (!w->nindex)
+    return 0;
+  if (mon_reserve(w, len))
+    return -1;
+  idx = (struct mon_index *)(w->map + w->hdr->used);
+  idx->magic = MON_IDX_MAGIC;
+  idx->count = w->nindex;
+  idx->prev = w->hdr->last_index;
+  memcpy(idx + 1, w->index, w->nindex * sizeof(struct mon_index_entry));
+  w->hdr->last_index = w->hdr->used;
+  w->hdr->used += len;
+  w->hdr->index_end = w->hdr->used;
+  w->nindex = 0;
+  return 0;
+}
+
+static int mon_flush(struct mon_writer *w)
+{
+  int ncols = w->hdr->ncolumns, n = w->nsamples;
+  struct mon_segment *seg;
+  u64 *lens, start;
+  byte *p;
+
+  if (!n)
+    return 0;
+  /* Worst case: every sample its own run */
+  if (mon_reserve(w, sizeof(*seg) + (ncols + 1) * (8 + (u64)n * 2 * MON_VARINT_MAX)))
+    return -1;
+
+  start = w->hdr->used;
+  seg = (struct mon_segment *)(w->map + start);
+  seg->magic = MON_SEG_MAGIC;
+  seg->nsamples = n;
+  seg->first_tick = w->ticks[0];
+  seg->last_tick = w->ticks[n - 1];
+  lens = (u64 *)(seg + 1);
+  p = (byte *)(lens + ncols + 1);
+
+  for (int c = -1; c < ncols; c++) {
+    byte *q = (c < 0) ? encode_runs(p, n, get_tick_delta, w, 0)
+                      : encode_runs(p, n, get_value, w, c);
+    lens[c + 1] = q - p;
+    p = q;
+  }
+  seg->len = p - (byte *)seg;
+  w->hdr->used = start + seg->len;
+
+  w->index[w->nindex].first_tick = seg->first_tick;
+  w->index[w->nindex].last_tick = seg->last_tick;
+  w->index[w->nindex].offset = start;
+  w->nsamples = 0;
+  if (++w->nindex == MON_INDEX_SEGMENTS)
+    return mon_write_index(w);
+  return 0;
+}
+
+int mon_append(struct mon_writer *w, u64 tick, const u32 *values)
+{
+  w->ticks[w->nsamples] = tick;
+  memcpy(w->values + (size_t)w->nsamples * w->hdr->ncolumns, values,
+         w->hdr->ncolumns * sizeof(*values));
+  if (++w->nsamples == MON_SEG_SAMPLES)
+    return mon_flush(w);
+  return 0;
+}
+
+int mon_close(struct mon_writer *w)
+{
+  int status = (mon_flush(w) || mon_write_index(w)) ? EXIT_FAILURE : EXIT_SUCCESS;
+  u64 used = w->hdr->used;
+
+  munmap(w->map, w->map_size);
+  if (ftruncate(w->fd, used) || close(w->fd))
+    status = EXIT_FAILURE;
+  free(w->ticks);
+  free(w->values);
+  free(w);
+  return status;
+}
+
+/*** Reader ***/
+
+struct mon_reader *mon_open(const char *name)
+{
+  struct mon_reader *r;
+  struct stat st;
+  int fd;
+
+  fd = open(name, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    printf("ERROR: Unable to open \"%s\" (%s)\n", name, strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return NULL;
+  }
+  r = xmalloc(sizeof(*r));
+  r->size = st.st_size;
+  r->map = (r->size >= sizeof(struct mon_header)) ?
+           mmap(NULL, r->size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (r->map == MAP_FAILED) {
+    printf("ERROR: \"%s\" is not a monitor file\n", name);
+    free(r);
+    return NULL;
+  }
+  r->hdr = (const struct mon_header *)r->map;
+  if (memcmp(r->hdr->magic, MON_MAGIC, sizeof(r->hdr->magic)) ||
+      !r->hdr->ncolumns || r->hdr->data_start != mon_data_start(r->hdr->ncolumns) ||
+      r->hdr->used > r->size || r->hdr->data_start > r->hdr->used ||
+      r->hdr->index_end > r->hdr->used) {
+    printf("ERROR: \"%s\" is not a monitor file\n", name);
+    mon_close_reader(r);
+    return NULL;
+  }
+  return r;
+}
+
+const struct mon_header *mon_info(struct mon_reader *r)
+{
+  return r->hdr;
+}
+
+void mon_close_reader(struct mon_reader *r)
+{
+  munmap(r->map, r->size);
+  free(r);
+}
+
+static const struct mon_segment *mon_segment_at(struct mon_reader *r, u64 off)
+{
+  const struct mon_segment *seg = (const struct mon_segment *)(r->map + off);
+
+  if (off < r->hdr->data_start || off + sizeof(*seg) > r->hdr->used ||
+      seg->magic != MON_SEG_MAGIC || seg->len < sizeof(*seg) || seg->len > r->hdr->used - off ||
+      !seg->nsamples || seg->nsamples > MON_SEG_SAMPLES)
+    return NULL;
+  return seg;
+}
+
+static int mon_decode(struct mon_reader *r, const struct mon_segment *seg,
+                      u64 from, u64 to, mon_sample_fn *fn, void *ctx)
+{
+  int ncols = r->hdr->ncolumns, n = seg->nsamples;
+  const u64 *lens = (const u64 *)(seg + 1);
+  const byte *p = (const byte *)(lens + ncols + 1), *end = (const byte *)seg + seg->len;
+  u64 *cols;
+  u32 *row;
+  int ok = 1;
+
+  /* The chunk lengths must lie inside the segment before any is read */
+  if ((u64)(ncols + 1) * sizeof(*lens) > seg->len - sizeof(*seg))
+    return -1;
+  cols = xmalloc((size_t)(ncols + 1) * n * sizeof(*cols));
+  row = xmalloc(ncols * sizeof(*row));
+  for (int c = 0; c <= ncols && ok; c++) {
+    ok = lens[c] <= (u64)(end - p) && decode_runs(p, p + lens[c], n, cols + (size_t)c * n);
+    p += lens[c];
+  }
+  if (ok) {
+    u64 tick = seg->first_tick;
+    for (int i = 0; i < n; i++) {
+      tick += cols[i];
+      if (tick < from || tick > to)
+        continue;
+      for (int c = 0; c < ncols; c++)
+        row[c] = cols[(size_t)(c + 1) * n + i];
+      fn(ctx, tick, row);
+    }
+  }
+  free(cols);
+  free(row);
+  return ok ? 0 : -1;
+}
+
+/* Calls fn for every sample with from <= tick <= to, in order */
+int mon_scan(struct mon_reader *r, u64 from, u64 to, mon_sample_fn *fn, void *ctx)
+{
+  u64 *offsets = NULL, off;
+  size_t n = 0, alloc = 0;
+  int status = 0;
+
+  /* Indexed segments, newest index block first */
+  for (off = r->hdr->last_index; off; ) {
+    const struct mon_index *idx = (const struct mon_index *)(r->map + off);
+    const struct mon_index_entry *e = (const struct mon_index_entry *)(idx + 1);
+
+    if (off + sizeof(*idx) > r->hdr->used || idx->magic != MON_IDX_MAGIC ||
+        !idx->count || idx->count > MON_INDEX_SEGMENTS || idx->prev >= off) {
+      status = -1;
+      break;
+    }
+    if (e[idx->count - 1].last_tick < from)
+      break;				/* This one and all older are before the range */
+    for (int i = idx->count - 1; i >= 0; i--)
+      if (e[i].first_tick <= to && e[i].last_tick >= from) {
+        if (n == alloc) {
+          alloc = alloc ? 2 * alloc : 64;
+          offsets = xrealloc(offsets, alloc * sizeof(*offsets));
+        }
+        offsets[n++] = e[i].offset;
+      }
+    off = idx->prev;
+  }
+
+  /* Decode in time order */
+  while (!status && n--) {
+    const struct mon_segment *seg = mon_segment_at(r, offsets[n]);
+    status = seg ? mon_decode(r, seg, from, to, fn, ctx) : -1;
+  }
+  free(offsets);
+
+  /* Segments written after the last index block */
+  for (off = r->hdr->index_end; !status && off < r->hdr->used; ) {
+    const struct mon_segment *seg = mon_segment_at(r, off);
+    if (!seg)
+      return -1;
+    if (seg->first_tick <= to && seg->last_tick >= from)
+      status = mon_decode(r, seg, from, to, fn, ctx);
+    off += seg->len;
+  }
+  return status;
+}
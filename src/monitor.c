@@ -0,0 +1,231 @@
+/*
+ *	H1A EEPROM Tool -- Long-running Port Monitor
+ *
+ *	Copyright (c) 2023 Adnacom, Inc.
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <time.h>
+
+#include "adna.h"
+
+/*
+ * Samples the status registers of every H1A and of the port above it at a
+ * fixed rate into a monitor file (see mon-store.c), for weeks if need be.
+ * Samples are numbered by ticks of the sampling period since the start, so
+ * a sample the sampler was too late for shows up as a gap rather than as
+ * drift. The query side prints a time range as CSV or just the changes.
+ */
+
+struct mon_source {
+  struct pci_dev *dev;
+  u16 reg;
+  u8 width;
+};
+
+static volatile sig_atomic_t mon_stop;
+
+static void mon_signal(int sig UNUSED)
+{
+  mon_stop = 1;
+}
+
+#define MON_COLUMN_STEP 16
+
+/* Append a column, the tables grow in steps; mon_create checks the total */
+static void mon_add(struct mon_column **cols, struct mon_source **src, int *n,
+                    struct pci_dev *dev, int reg, int width, const char *name)
+{
+  struct mon_column *c;
+
+  if (!(*n % MON_COLUMN_STEP)) {
+    *cols = xrealloc(*cols, (*n + MON_COLUMN_STEP) * sizeof(**cols));
+    *src = xrealloc(*src, (*n + MON_COLUMN_STEP) * sizeof(**src));
+  }
+  c = &(*cols)[*n];
+  memset(c, 0, sizeof(*c));
+  c->domain = dev->domain;
+  c->bus = dev->bus;
+  c->dev = dev->dev;
+  c->func = dev->func;
+  c->reg = reg;
+  c->width = width;
+  snprintf(c->name, sizeof(c->name), "%s", name);
+  (*src)[*n].dev = dev;
+  (*src)[*n].reg = reg;
+  (*src)[*n].width = width;
+  (*n)++;
+}
+
+static void mon_add_port(struct mon_column **cols, struct mon_source **src, int *n,
+                         struct pci_access *a, struct pci_filter *f)
+{
+  struct pci_dev *dev = pci_get_dev(a, f->domain, f->bus, f->slot, f->func);
+  struct pci_cap *cap;
+
+  pci_fill_info(dev, PCI_FILL_CAPS | PCI_FILL_EXT_CAPS);
+  mon_add(cols, src, n, dev, PCI_STATUS, 2, "status");
+  if ((cap = pci_find_cap(dev, PCI_CAP_ID_EXP, PCI_CAP_NORMAL))) {
+    mon_add(cols, src, n, dev, cap->addr + PCI_EXP_DEVSTA, 2, "devsta");
+    mon_add(cols, src, n, dev, cap->addr + PCI_EXP_LNKSTA, 2, "lnksta");
+  }
+  if ((cap = pci_find_cap(dev, PCI_EXT_CAP_ID_AER, PCI_CAP_EXTENDED))) {
+    mon_add(cols, src, n, dev, cap->addr + PCI_ERR_UNCOR_STATUS, 4, "aer_uncor");
+    mon_add(cols, src, n, dev, cap->addr + PCI_ERR_COR_STATUS, 4, "aer_cor");
+  }
+}
+
+int monitor_run(struct pci_access *a, struct pci_filter **h1a, struct pci_filter **parent,
+                int count, const char *name, unsigned int interval_us)
+{
+  struct mon_column *cols = NULL;
+  struct mon_source *src = NULL;
+  u64 interval = (u64)interval_us * 1000, t0, tick, samples = 0;
+  struct mon_writer *w;
+  struct sigaction sa;
+  u32 *row;
+  int n = 0, status = EXIT_FAILURE;
+
+  pci_scan_bus(a);
+  for (int i = 0; i < count; i++) {
+    mon_add_port(&cols, &src, &n, a, h1a[i]);
+    mon_add_port(&cols, &src, &n, a, parent[i]);
+  }
+  if (!(w = mon_create(name, cols, n, interval)))
+    goto out;
+  row = xmalloc(n * sizeof(*row));
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = mon_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  printf("Monitoring %d register(s) of %d H1A device(s) every %u us into %s (Ctrl-C to stop)\n",
+         n, count, interval_us, name);
+  fflush(stdout);
+
+  status = EXIT_SUCCESS;
+  t0 = monotonic_ns();
+  for (tick = 0; !mon_stop; ) {
+    for (int c = 0; c < n; c++)
+      row[c] = (src[c].width == 4) ? pci_read_long(src[c].dev, src[c].reg)
+                                   : pci_read_word(src[c].dev, src[c].reg);
+    if (mon_append(w, tick, row)) {
+      printf("ERROR: Unable to write \"%s\"\n", name);
+      status = EXIT_FAILURE;
+      break;
+    }
+    samples++;
+    /* Skip the ticks already gone rather than sampling in a burst */
+    tick = (monotonic_ns() - t0) / interval + 1;
+    sleep_until(t0 + tick * interval);
+  }
+
+  if (mon_close(w) != EXIT_SUCCESS) {
+    printf("ERROR: Unable to write \"%s\"\n", name);
+    status = EXIT_FAILURE;
+  }
+  printf("\nMonitor stopped, %llu sample(s) in %llu tick(s)\n",
+         (unsigned long long)samples, (unsigned long long)tick);
+  free(row);
+out:
+  free(cols);
+  free(src);
+  return status;
+}
+
+/*** Queries ***/
+
+struct mon_query {
+  const struct mon_header *hdr;
+  bool changes;
+  bool have_last;
+  u32 *last;
+  u64 rows;
+};
+
+static void mon_column_name(const struct mon_column *c, char *buf, size_t len)
+{
+  snprintf(buf, len, "%04x:%02x:%02x.%d/%s", c->domain, c->bus, c->dev, c->func, c->name);
+}
+
+static void mon_print_sample(void *ctx, u64 tick, const u32 *values)
+{
+  struct mon_query *q = ctx;
+  const struct mon_header *hdr = q->hdr;
+  double t = tick * (hdr->interval_ns / 1e9);
+  char name[64];
+
+  q->rows++;
+  if (!q->changes) {
+    printf("%.6f", t);
+    for (u32 c = 0; c < hdr->ncolumns; c++)
+      printf(",0x%0*x", 2 * hdr->columns[c].width, values[c]);
+    putchar('\n');
+    return;
+  }
+
+  for (u32 c = 0; c < hdr->ncolumns; c++) {
+    int width = 2 * hdr->columns[c].width;
+
+    if (q->have_last && values[c] == q->last[c])
+      continue;
+    mon_column_name(&hdr->columns[c], name, sizeof(name));
+    if (q->have_last)
+      printf("%.6f %s 0x%0*x -> 0x%0*x\n", t, name, width, q->last[c], width, values[c]);
+    else
+      printf("%.6f %s 0x%0*x (initial)\n", t, name, width, values[c]);
+  }
+  memcpy(q->last, values, hdr->ncolumns * sizeof(*values));
+  q->have_last = true;
+}
+
+int monitor_query(const char *name, double from, double to, bool changes)
+{
+  struct mon_reader *r = mon_open(name);
+  const struct mon_header *hdr;
+  struct mon_query q;
+  char stamp[64], col[64];
+  time_t start;
+  u64 first, last;
+  int status;
+
+  if (!r)
+    return EXIT_FAILURE;
+  hdr = mon_info(r);
+  first = (from > 0) ? (u64)(from * 1e9 / hdr->interval_ns) : 0;
+  last = (to >= 0) ? (u64)(to * 1e9 / hdr->interval_ns) : ~(u64)0;
+
+  start = hdr->start_ns / 1000000000;
+  strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&start));
+  printf("# %s: started %s, every %llu us, %u register(s)\n", name, stamp,
+         (unsigned long long)(hdr->interval_ns / 1000), hdr->ncolumns);
+
+  memset(&q, 0, sizeof(q));
+  q.hdr = hdr;
+  q.changes = changes;
+  q.last = xmalloc(hdr->ncolumns * sizeof(*q.last));
+  if (!changes) {
+    printf("time");
+    for (u32 c = 0; c < hdr->ncolumns; c++) {
+      mon_column_name(&hdr->columns[c], col, sizeof(col));
+      printf(",%s", col);
+    }
+    putchar('\n');
+  }
+
+  status = mon_scan(r, first, last, mon_print_sample, &q);
+  if (status)
+    printf("ERROR: \"%s\" is damaged, output stops at the damage\n", name);
+  else if (!q.rows)
+    printf("# No samples in the given time range\n");
+
+  free(q.last);
+  mon_close_reader(r);
+  return status ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,312 @@
+/*
+ *	H1A EEPROM Tool -- Peer-to-Peer ACS Control
+ *
+ *	Copyright (c) 2023 Adnacom, Inc.
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "adna.h"
+
+/*
+ * A request from one endpoint to another below the same switch turns
+ * around inside the switch, unless a downstream port it enters through
+ * has ACS P2P Request Redirect set: then it is sent up to the root complex
+ * and comes back down, if the root complex routes peer traffic at all.
+ * Completion Redirect does the same to the completions going back, and
+ * Egress Control can block or redirect by target port. For every pair of
+ * endpoints below an H1A this walks both of them up to the port they have
+ * in common and reports the first port on the way that would send their
+ * traffic up.
+ *
+ * With --p2p-enable, Request and Completion Redirect are cleared on every
+ * port below each H1A. The old ACS Control values are written to a
+ * rollback file first, which --p2p-restore deletes once applied, then all
+ * ports are written in one pass and read back. Egress Control is left as
+ * it is: when it is set up at all, it is set up on purpose.
+ */
+
+#define P2P_REDIRECT  (PCI_ACS_CTRL_REQ_RED | PCI_ACS_CTRL_CMPLT_RED)
+#define P2P_MAX_HOPS  16
+
+struct p2p_port {
+  struct device *d;
+  int acs;				/* ACS capability, 0 if none */
+  u16 ctl, new_ctl;
+};
+
+static int p2p_acs(struct device *d)
+{
+  struct pci_cap *cap;
+
+  pci_fill_info(d->dev, PCI_FILL_EXT_CAPS);
+  cap = pci_find_cap(d->dev, PCI_EXT_CAP_ID_ACS, PCI_CAP_EXTENDED);
+  if (!cap || !config_fetch(d, cap->addr, PCI_ACS_CTRL + 2))
+    return 0;
+  return cap->addr;
+}
+
+/* Topmost H1A above d, d itself if it is one */
+static struct device *p2p_h1a(struct device *d)
+{
+  struct device *h1a = NULL;
+
+  for (; d; d = pcie_parent(d))
+    if (pcie_is_h1a(d))
+      h1a = d;
+  return h1a;
+}
+
+static struct p2p_port *p2p_lookup(struct p2p_port *ports, int n, struct device *d)
+{
+  for (int i = 0; i < n; i++)
+    if (ports[i].d == d)
+      return &ports[i];
+  return NULL;
+}
+
+/* Ports above d, nearest first */
+static int p2p_path(struct device *d, struct device **path)
+{
+  int n = 0;
+
+  for (d = pcie_parent(d); d && n < P2P_MAX_HOPS; d = pcie_parent(d))
+    path[n++] = d;
+  return n;
+}
+
+/* Why the traffic of one endpoint to a peer leaves the switch, NULL if it does not */
+static const char *p2p_blocked(struct p2p_port *ports, int n, struct device **path, int len,
+                               struct device **at)
+{
+  for (int i = 0; i < len; i++) {
+    struct p2p_port *p = p2p_lookup(ports, n, path[i]);
+
+    *at = path[i];
+    if (!p || !p->acs)
+      continue;
+    if (p->ctl & PCI_ACS_CTRL_REQ_RED)
+      return "Request Redirect";
+    if (p->ctl & PCI_ACS_CTRL_CMPLT_RED)
+      return "Completion Redirect";
+    if (p->ctl & PCI_ACS_CTRL_EGRESS)
+      return "Egress Control";
+  }
+  return NULL;
+}
+
+static int p2p_pairs(struct p2p_port *ports, int n, struct device **eps, int neps)
+{
+  struct device *pa[P2P_MAX_HOPS], *pb[P2P_MAX_HOPS], *at;
+  char a[16], b[16], c[16];
+  int direct = 0;
+
+  for (int i = 0; i < neps; i++)
+    for (int j = i + 1; j < neps; j++) {
+      int la = p2p_path(eps[i], pa), lb = p2p_path(eps[j], pb), ca = la, cb = lb;
+      const char *why;
+
+      if (p2p_h1a(eps[i]) != p2p_h1a(eps[j]))
+        continue;
+      /* The first port both share is where the traffic turns around */
+      for (int x = 0; x < la && ca == la; x++)
+        for (int y = 0; y < lb; y++)
+          if (pa[x] == pb[y]) {
+            ca = x;
+            cb = y;
+            break;
+          }
+
+      pcie_name(a, sizeof(a), eps[i]->dev);
+      pcie_name(b, sizeof(b), eps[j]->dev);
+      if (!(why = p2p_blocked(ports, n, pa, ca, &at)))
+        why = p2p_blocked(ports, n, pb, cb, &at);
+      if (why) {
+        pcie_name(c, sizeof(c), at->dev);
+        printf("  %s <-> %s  through the root complex, %s at %s\n", a, b, why, c);
+      } else {
+        printf("  %s <-> %s  direct\n", a, b);
+        direct++;
+      }
+    }
+  return direct;
+}
+
+static void p2p_show_ports(struct p2p_port *ports, int n)
+{
+  char name[16];
+
+  for (int i = 0; i < n; i++) {
+    struct p2p_port *p = &ports[i];
+
+    pcie_name(name, sizeof(name), p->d->dev);
+    if (!p->acs) {
+      printf("  %s  no ACS\n", name);
+      continue;
+    }
+    printf("  %s  ReqRedir%c CmpltRedir%c EgressCtrl%c DirectTrans%c UpstreamFwd%c%s\n", name,
+           FLAG(p->ctl, PCI_ACS_CTRL_REQ_RED), FLAG(p->ctl, PCI_ACS_CTRL_CMPLT_RED),
+           FLAG(p->ctl, PCI_ACS_CTRL_EGRESS), FLAG(p->ctl, PCI_ACS_CTRL_TRANS),
+           FLAG(p->ctl, PCI_ACS_CTRL_FORWARD), pcie_is_h1a(p->d) ? "  (H1A)" : "");
+  }
+}
+
+static int p2p_save(const char *name, const struct p2p_port *ports, int n, bool force)
+{
+  FILE *f = rollback_create(name, "ACS", "--p2p-restore", force);
+
+  if (!f)
+    return -1;
+  for (int i = 0; i < n; i++) {
+    const struct p2p_port *p = &ports[i];
+    int reg = p->acs + PCI_ACS_CTRL;
+
+    if (p->acs && p->new_ctl != p->ctl)
+      rollback_entry(f, p->d->dev, 1, &reg, &p->ctl);
+  }
+  return rollback_close(f, name);
+}
+
+/* Clear the redirects in one pass, then read every port back past the cache */
+static int p2p_write(struct p2p_port *ports, int n, int *writes)
+{
+  char name[16];
+  int bad = 0;
+
+  *writes = 0;
+  for (int i = 0; i < n; i++)
+    if (ports[i].acs && ports[i].new_ctl != ports[i].ctl) {
+      pci_write_word(ports[i].d->dev, ports[i].acs + PCI_ACS_CTRL, ports[i].new_ctl);
+      (*writes)++;
+    }
+  for (int i = 0; i < n; i++) {
+    struct p2p_port *p = &ports[i];
+
+    if (!p->acs || p->new_ctl == p->ctl)
+      continue;
+    pci_setup_cache(p->d->dev, NULL, 0);
+    p->ctl = pci_read_word(p->d->dev, p->acs + PCI_ACS_CTRL);
+    if (p->ctl != p->new_ctl) {
+      pcie_name(name, sizeof(name), p->d->dev);
+      printf("ERROR: %s did not take ACS Control %04x\n", name, p->new_ctl);
+      bad++;
+    }
+  }
+  return bad;
+}
+
+int p2p_control(struct device *first, bool enable, const char *rollback, bool force)
+{
+  struct p2p_port *ports;
+  struct device **eps, *d;
+  int n = 0, neps = 0, max = 0, writes, bad, planned = 0, status = EXIT_SUCCESS;
+
+  for (d = first; d; d = d->next)
+    max++;
+  ports = xmalloc((max + 1) * sizeof(*ports));
+  eps = xmalloc((max + 1) * sizeof(*eps));
+
+  /* Ports and endpoints below the H1As, bus order as in the list */
+  for (d = first; d; d = d->next) {
+    int exp, type;
+
+    if (!p2p_h1a(d) || !(exp = pcie_dev_cap(d)))
+      continue;
+    type = pcie_type(d, exp);
+    if (type == PCI_EXP_TYPE_ENDPOINT || type == PCI_EXP_TYPE_LEG_END) {
+      eps[neps++] = d;
+    } else if (d->bridge) {
+      struct p2p_port *p = &ports[n++];
+
+      memset(p, 0, sizeof(*p));
+      p->d = d;
+      if ((p->acs = p2p_acs(d)))
+        p->ctl = p->new_ctl = get_conf_word(d, p->acs + PCI_ACS_CTRL);
+      if (p->ctl & P2P_REDIRECT) {
+        p->new_ctl = p->ctl & ~P2P_REDIRECT;
+        planned++;
+      }
+    }
+  }
+  if (!n) {
+    printf("No H1A device(s) found\n");
+    goto out;
+  }
+
+  printf("ACS on the ports below the H1A device(s):\n");
+  p2p_show_ports(ports, n);
+  if (neps > 1) {
+    printf("Peer-to-peer between endpoints below the same H1A:\n");
+    printf("%d pair(s) direct\n", p2p_pairs(ports, n, eps, neps));
+  } else
+    printf("Fewer than two endpoints below the H1A device(s), no pairs to check\n");
+
+  if (!enable)
+    goto out;
+  if (!planned) {
+    printf("No port redirects peer-to-peer traffic, nothing to change\n");
+    goto out;
+  }
+  if (p2p_save(rollback, ports, n, force)) {
+    status = EXIT_FAILURE;
+    goto out;
+  }
+
+  printf("\nClear ACS redirects on %d port(s), previous settings saved to %s\n", planned, rollback);
+  bad = p2p_write(ports, n, &writes);
+  printf("%d register write(s), %s\n", writes,
+         bad ? "some ports did not take the change" : "all verified");
+  if (neps > 1)
+    printf("%d pair(s) now direct\n", p2p_pairs(ports, n, eps, neps));
+  printf("IOMMU groups were formed at boot and do not change until devices are re-added\n");
+  if (bad)
+    status = EXIT_FAILURE;
+out:
+  free(eps);
+  free(ports);
+  return status;
+}
+
+int p2p_restore(struct pci_access *a, const char *name)
+{
+  FILE *f = fopen(name, "r");
+  struct rollback_line l;
+  int lineno = 0, restored = 0, status = EXIT_SUCCESS, r;
+
+  if (!f) {
+    printf("ERROR: Unable to open \"%s\" (%s)\n", name, strerror(errno));
+    return EXIT_FAILURE;
+  }
+  while ((r = rollback_read(f, name, &lineno, 1, a, &l))) {
+    char dev[16];
+
+    if (r < 0) {
+      status = EXIT_FAILURE;
+      continue;
+    }
+    pcie_name(dev, sizeof(dev), l.dev);
+    if (l.reg[0] < 0x100) {
+      printf("ERROR: %s:%d: ACS Control is in extended config space\n", name, lineno);
+      status = EXIT_FAILURE;
+    } else {
+      pci_write_word(l.dev, l.reg[0], l.val[0]);
+      if (pci_read_word(l.dev, l.reg[0]) != l.val[0]) {
+        printf("ERROR: %s did not take the saved value\n", dev);
+        status = EXIT_FAILURE;
+      } else
+        restored++;
+    }
+    pci_free_dev(l.dev);
+  }
+  fclose(f);
+  printf("Restored ACS on %d port(s) from %s\n", restored, name);
+  if (status == EXIT_SUCCESS)
+    rollback_remove(name);
+  return status;
+}
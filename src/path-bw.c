@@ -0,0 +1,138 @@
+/*
+ *	H1A EEPROM Tool -- Path Bandwidth Analysis
+ *
+ *	Copyright (c) 2023 Adnacom, Inc.
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "adna.h"
+
+/*
+ * For every endpoint below an H1A, walks the bridge tree built by
+ * grow_tree() from the device up to its root port and rates each link on
+ * the way: negotiated speed times width, less the line encoding, less the
+ * TLP framing at the payload size the path allows. The slowest link is the
+ * most the device can move in one direction. DLLP traffic (acks and flow
+ * control updates) takes a few percent more and is not counted.
+ */
+
+#define PATH_MAX_HOPS   16
+#define PATH_TLP_BYTES  24			/* 4DW header, LCRC, sequence, framing */
+
+struct path_hop {
+  struct device *up, *down;		/* Ends of the link */
+  int speed, width;			/* Negotiated */
+  double raw;				/* GB/s per direction after encoding */
+};
+
+/* Per-lane GB/s after line encoding, by Link Speed code */
+static double path_lane_rate(int speed)
+{
+  switch (speed) {
+    case 1: return 2.5 * 8 / 10 / 8;		/* 8b/10b */
+    case 2: return 5.0 * 8 / 10 / 8;
+    case 3: return 8.0 * 128 / 130 / 8;	/* 128b/130b */
+    case 4: return 16.0 * 128 / 130 / 8;
+    case 5: return 32.0 * 128 / 130 / 8;
+    case 6: return 64.0 * 242 / 256 / 8;	/* FLIT mode */
+    default: return 0;
+  }
+}
+
+static int path_size(struct device *d, int exp, u16 mask, int shift)
+{
+  return 128 << ((get_conf_word(d, exp + PCI_EXP_DEVCTL) & mask) >> shift);
+}
+
+/* Report the path of one endpoint, false if it is not behind an H1A */
+static bool path_report(struct device *ep)
+{
+  struct path_hop hops[PATH_MAX_HOPS];
+  struct device *d, *up;
+  int nhops = 0, mps = 4096, mrrs, cpl, exp, slowest = -1;
+  char a[16], b[16], name[128];
+  bool behind_h1a = false;
+  double best = 0;
+
+  exp = pcie_dev_cap(ep);
+  mrrs = path_size(ep, exp, PCI_EXP_DEVCTL_READRQ, 12);
+
+  /* Every device with an upstream link contributes one hop */
+  for (d = ep; d && nhops < PATH_MAX_HOPS; d = up) {
+    int dexp = pcie_dev_cap(d), type;
+    u16 lnksta;
+
+    up = pcie_parent(d);
+    if (!dexp)
+      break;
+    if (path_size(d, dexp, PCI_EXP_DEVCTL_PAYLOAD, 5) < mps)
+      mps = path_size(d, dexp, PCI_EXP_DEVCTL_PAYLOAD, 5);
+    if (pcie_is_h1a(d))
+      behind_h1a = true;
+    type = pcie_type(d, dexp);
+    if (!up || type == PCI_EXP_TYPE_ROOT_PORT || type == PCI_EXP_TYPE_DOWNSTREAM)
+      continue;				/* No link above, or one inside a switch */
+    lnksta = get_conf_word(d, dexp + PCI_EXP_LNKSTA);
+    hops[nhops].up = up;
+    hops[nhops].down = d;
+    hops[nhops].speed = lnksta & PCI_EXP_LNKSTA_SPEED;
+    hops[nhops].width = (lnksta & PCI_EXP_LNKSTA_WIDTH) >> 4;
+    hops[nhops].raw = path_lane_rate(hops[nhops].speed) * hops[nhops].width;
+    nhops++;
+  }
+  if (!behind_h1a || !nhops)
+    return false;
+
+  pcie_name(a, sizeof(a), ep->dev);
+  printf("%s  %s\n", a, pci_lookup_name(pacc, name, sizeof(name), PCI_LOOKUP_VENDOR | PCI_LOOKUP_DEVICE,
+                                        ep->dev->vendor_id, ep->dev->device_id));
+  printf("  MPS %d B, MRRS %d B, TLP efficiency %.1f%%\n", mps, mrrs,
+         100.0 * mps / (mps + PATH_TLP_BYTES));
+  /* Root port first */
+  for (int i = nhops - 1; i >= 0; i--) {
+    struct path_hop *h = &hops[i];
+    double eff = h->raw * mps / (mps + PATH_TLP_BYTES);
+
+    pcie_name(a, sizeof(a), h->up->dev);
+    pcie_name(b, sizeof(b), h->down->dev);
+    printf("  %s -> %s  %-7s x%-2d  %6.2f GB/s raw  %6.2f GB/s payload%s\n",
+           a, b, pcie_speed_name(h->speed), h->width, h->raw, eff,
+           pcie_is_h1a(h->down) ? "  (H1A)" : "");
+    if (slowest < 0 || eff < best) {
+      best = eff;
+      slowest = i;
+    }
+  }
+  /* Read completions carry at most MRRS, writes at most MPS */
+  cpl = (mrrs < mps) ? mrrs : mps;
+  pcie_name(a, sizeof(a), hops[slowest].up->dev);
+  pcie_name(b, sizeof(b), hops[slowest].down->dev);
+  printf("  Limited by %s -> %s: %.2f GB/s write, %.2f GB/s read per direction\n\n",
+         a, b, best, hops[slowest].raw * cpl / (cpl + PATH_TLP_BYTES));
+  return true;
+}
+
+int path_bandwidth(struct device *first)
+{
+  int endpoints = 0;
+
+  for (struct device *d = first; d; d = d->next) {
+    int exp = pcie_dev_cap(d), type;
+
+    if (!exp)
+      continue;
+    type = pcie_type(d, exp);
+    if (type != PCI_EXP_TYPE_ENDPOINT && type != PCI_EXP_TYPE_LEG_END)
+      continue;
+    if (path_report(d))
+      endpoints++;
+  }
+  if (!endpoints)
+    printf("No endpoints found behind the H1A device(s)\n");
+  return EXIT_SUCCESS;
+}
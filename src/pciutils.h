@@ -26,6 +26,8 @@ void die(char *msg, ...) NONRET PCI_PRINTF(1,2);
 void *xmalloc(size_t howmuch);
 void *xrealloc(void *ptr, size_t howmuch);
 char *xstrdup(const char *str);
+u64 monotonic_ns(void);
+void sleep_until(u64 deadline);
 int parse_generic_option(int i, struct pci_access *pacc, char *arg);
 
 #ifdef PCI_HAVE_PM_INTEL_CONF
@@ -0,0 +1,353 @@
+/*
+ *	H1A EEPROM Tool -- Link Error Flight Recorder
+ *
+ *	Copyright (c) 2023 Adnacom, Inc.
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "adna.h"
+#include "eep.h"
+
+/*
+ * Samples the error and link status of every H1A and of the port above it
+ * into a ring holding the last few seconds. A new uncorrectable or
+ * correctable AER bit, a new fatal/non-fatal Device Status bit, Data Link
+ * Layer Link Active going away on the parent port or the H1A dropping off
+ * the bus triggers a capture: config space of the parent and of everything
+ * below it plus all of BAR0 of the PEX8608 are copied to memory first,
+ * before the kernel's error recovery gets to reset the link, and only then
+ * written out together with the ring.
+ */
+
+#define REC_CFG_SIZE    4096
+
+struct rec_sample {
+  u64 ns;
+  int port;
+  bool present;
+  u16 status, devsta, lnksta;
+  u32 uncor, cor;
+};
+
+struct rec_port {
+  struct pci_dev *dev;
+  int h1a;				/* Index of the H1A the port belongs to */
+  bool upstream;			/* The H1A itself, else the port above it */
+  int exp, aer;				/* Capability offsets, 0 if missing */
+  bool sampled;
+  struct rec_sample last;
+};
+
+struct rec_h1a {
+  struct device d;			/* For BAR0, kept mapped */
+  struct rec_port *parent;
+  int sec_bus, sub_bus;			/* Buses behind the parent port */
+};
+
+struct rec_snapshot {
+  struct pci_dev *dev;
+  byte cfg[REC_CFG_SIZE];
+  int len;
+};
+
+static struct {
+  struct pci_access *pacc;
+  const struct recorder_options *opt;
+  int nports, nh1a;
+  struct rec_port *ports;
+  struct rec_h1a *h1a;
+  struct rec_sample *ring;
+  unsigned int ring_size, ring_head, ring_count;
+  struct rec_snapshot *snaps;
+  int max_snaps;
+  uint32_t *bar0;			/* Sized for the largest BAR0 */
+  size_t bar0_len;			/* Captured, 0 if BAR0 is not mapped */
+  unsigned int captures;
+} rec;
+
+static volatile sig_atomic_t rec_stop;
+
+static void rec_signal(int sig UNUSED)
+{
+  rec_stop = 1;
+}
+
+static void rec_port_init(struct rec_port *p, struct pci_filter *f, int h1a, bool upstream)
+{
+  struct pci_cap *cap;
+
+  memset(p, 0, sizeof(*p));
+  p->dev = pci_get_dev(rec.pacc, f->domain, f->bus, f->slot, f->func);
+  p->h1a = h1a;
+  p->upstream = upstream;
+  pci_fill_info(p->dev, PCI_FILL_CAPS | PCI_FILL_EXT_CAPS);
+  if ((cap = pci_find_cap(p->dev, PCI_CAP_ID_EXP, PCI_CAP_NORMAL)))
+    p->exp = cap->addr;
+  if ((cap = pci_find_cap(p->dev, PCI_EXT_CAP_ID_AER, PCI_CAP_EXTENDED)))
+    p->aer = cap->addr;
+}
+
+static void rec_sample_port(struct rec_port *p, struct rec_sample *s, u64 now)
+{
+  memset(s, 0, sizeof(*s));
+  s->ns = now;
+  s->port = p - rec.ports;
+  s->present = pci_read_word(p->dev, PCI_VENDOR_ID) != 0xffff;
+  if (!s->present)
+    return;
+  s->status = pci_read_word(p->dev, PCI_STATUS);
+  if (p->exp) {
+    s->devsta = pci_read_word(p->dev, p->exp + PCI_EXP_DEVSTA);
+    s->lnksta = pci_read_word(p->dev, p->exp + PCI_EXP_LNKSTA);
+  }
+  if (p->aer) {
+    s->uncor = pci_read_long(p->dev, p->aer + PCI_ERR_UNCOR_STATUS);
+    s->cor = pci_read_long(p->dev, p->aer + PCI_ERR_COR_STATUS);
+  }
+}
+
+static void rec_ring_push(const struct rec_sample *s)
+{
+  rec.ring[rec.ring_head] = *s;
+  rec.ring_head = (rec.ring_head + 1) % rec.ring_size;
+  if (rec.ring_count < rec.ring_size)
+    rec.ring_count++;
+}
+
+/* Reason for a capture, NULL if the sample shows nothing new */
+static const char *rec_trigger(const struct rec_port *p, const struct rec_sample *s)
+{
+  const struct rec_sample *l = &p->last;
+
+  if (!p->sampled)
+    return NULL;
+  if (l->present && !s->present)
+    return p->upstream ? "H1A not responding" : "Parent port not responding";
+  if (!s->present)
+    return NULL;
+  if (s->uncor & ~l->uncor)
+    return "New uncorrectable AER status";
+  if (s->cor & ~l->cor)
+    return "New correctable AER status";
+  if (s->devsta & ~l->devsta & (PCI_EXP_DEVSTA_NFED | PCI_EXP_DEVSTA_FED))
+    return "New fatal/non-fatal error in Device Status";
+  if (!p->upstream && (l->lnksta & ~s->lnksta & PCI_EXP_LNKSTA_DL_ACT))
+    return "Link down";
+  return NULL;
+}
+
+static void rec_snapshot_dev(struct rec_snapshot *sn, struct pci_dev *d)
+{
+  sn->dev = d;
+  memset(sn->cfg, 0xff, sizeof(sn->cfg));
+  sn->len = 0;
+  if (!pci_read_block(d, 0, sn->cfg, 256))
+    return;
+  sn->len = 256;
+  if (pci_read_block(d, 256, sn->cfg + 256, REC_CFG_SIZE - 256))
+    sn->len = REC_CFG_SIZE;
+}
+
+/* Everything that has to happen before the kernel recovers the link */
+static int rec_capture_state(int h1a)
+{
+  struct rec_h1a *h = &rec.h1a[h1a];
+  struct pci_dev *p;
+  int n = 0;
+
+  rec_snapshot_dev(&rec.snaps[n++], h->parent->dev);
+  for (p = rec.pacc->devices; p && n < rec.max_snaps; p = p->next)
+    if (p->domain == h->parent->dev->domain && p->bus >= h->sec_bus && p->bus <= h->sub_bus)
+      rec_snapshot_dev(&rec.snaps[n++], p);
+
+  rec.bar0_len = h->d.bar0_size;
+  for (size_t i = 0; i < rec.bar0_len / 4; i++)
+    rec.bar0[i] = h->d.bar0[i];
+  return n;
+}
+
+static FILE *rec_open(const char *dir, const char *name, const char *mode)
+{
+  char path[PATH_MAX];
+  FILE *f;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  if (!(f = fopen(path, mode)))
+    printf("ERROR: Unable to write \"%s\" (%s)\n", path, strerror(errno));
+  return f;
+}
+
+static void rec_write_bundle(int h1a, const char *reason, u64 trigger_ns,
+                             u64 latency_ns, int nsnaps)
+{
+  struct pci_dev *dev = rec.h1a[h1a].d.dev;
+  char dir[PATH_MAX], stamp[32], name[64];
+  struct timespec ts;
+  struct tm tm;
+  FILE *f;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  localtime_r(&ts.tv_sec, &tm);
+  strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+  snprintf(dir, sizeof(dir), "%s/h1a-%04x:%02x:%02x.%d-%s.%03ld", rec.opt->dir,
+           dev->domain, dev->bus, dev->dev, dev->func, stamp, ts.tv_nsec / 1000000);
+  if (mkdir(dir, 0755)) {
+    printf("ERROR: Unable to create \"%s\" (%s)\n", dir, strerror(errno));
+    return;
+  }
+
+  if ((f = rec_open(dir, "summary.txt", "w"))) {
+    fprintf(f, "Device: %04x:%02x:%02x.%d\n", dev->domain, dev->bus, dev->dev, dev->func);
+    fprintf(f, "Trigger: %s\n", reason);
+    fprintf(f, "Captured: %s.%03ld\n", stamp, ts.tv_nsec / 1000000);
+    fprintf(f, "Capture latency: %.3f ms\n", latency_ns / 1e6);
+    fprintf(f, "Sample interval: %u ms\n", rec.opt->interval_ms);
+    fprintf(f, "Config snapshots: %d\n", nsnaps);
+    if (rec.bar0_len)
+      fprintf(f, "BAR0: %zu bytes\n", rec.bar0_len);
+    else
+      fprintf(f, "BAR0: not mapped\n");
+    fclose(f);
+  }
+
+  for (int i = 0; i < nsnaps; i++) {
+    struct rec_snapshot *sn = &rec.snaps[i];
+    snprintf(name, sizeof(name), "config-%04x:%02x:%02x.%d.bin",
+             sn->dev->domain, sn->dev->bus, sn->dev->dev, sn->dev->func);
+    if (sn->len && (f = rec_open(dir, name, "wb"))) {
+      fwrite(sn->cfg, 1, sn->len, f);
+      fclose(f);
+    }
+  }
+
+  if (rec.bar0_len && (f = rec_open(dir, "bar0.bin", "wb"))) {
+    fwrite(rec.bar0, 1, rec.bar0_len, f);
+    fclose(f);
+  }
+
+  if ((f = rec_open(dir, "ring.csv", "w"))) {
+    unsigned int first = (rec.ring_head + rec.ring_size - rec.ring_count) % rec.ring_size;
+
+    fprintf(f, "time_ms,port,present,status,devsta,lnksta,aer_uncor,aer_cor\n");
+    for (unsigned int i = 0; i < rec.ring_count; i++) {
+      struct rec_sample *s = &rec.ring[(first + i) % rec.ring_size];
+      struct pci_dev *p = rec.ports[s->port].dev;
+      fprintf(f, "%.3f,%04x:%02x:%02x.%d,%d,0x%04x,0x%04x,0x%04x,0x%08x,0x%08x\n",
+              ((double)s->ns - (double)trigger_ns) / 1e6,
+              p->domain, p->bus, p->dev, p->func, s->present,
+              s->status, s->devsta, s->lnksta, s->uncor, s->cor);
+    }
+    fclose(f);
+  }
+
+  printf("%04x:%02x:%02x.%d: %s, captured in %.3f ms to %s\n",
+         dev->domain, dev->bus, dev->dev, dev->func, reason, latency_ns / 1e6, dir);
+  fflush(stdout);
+}
+
+static void rec_cleanup(void)
+{
+  for (int i = 0; i < rec.nh1a; i++)
+    eep_hw_unmap(&rec.h1a[i].d);
+  for (int i = 0; i < rec.nports; i++)
+    pci_free_dev(rec.ports[i].dev);
+  free(rec.ports);
+  free(rec.h1a);
+  free(rec.ring);
+  free(rec.snaps);
+  free(rec.bar0);
+}
+
+int recorder_run(struct pci_access *a, struct pci_filter **h1a, struct pci_filter **parent,
+                 int count, const struct recorder_options *opt)
+{
+  struct sigaction sa;
+  struct pci_dev *p;
+  size_t bar0_max = 0;
+  u64 next;
+
+  memset(&rec, 0, sizeof(rec));
+  rec.pacc = a;
+  rec.opt = opt;
+  if (mkdir(opt->dir, 0755) && errno != EEXIST) {
+    printf("ERROR: Unable to create \"%s\" (%s)\n", opt->dir, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  pci_scan_bus(a);
+  rec.nh1a = count;
+  rec.h1a = xmalloc(count * sizeof(*rec.h1a));
+  memset(rec.h1a, 0, count * sizeof(*rec.h1a));
+  rec.ports = xmalloc(2 * count * sizeof(*rec.ports));
+  for (int i = 0; i < count; i++) {
+    struct rec_h1a *h = &rec.h1a[i];
+    struct rec_port *up = &rec.ports[rec.nports++];
+
+    rec_port_init(up, h1a[i], i, true);
+    h->parent = &rec.ports[rec.nports++];
+    rec_port_init(h->parent, parent[i], i, false);
+    h->sec_bus = pci_read_byte(h->parent->dev, PCI_SECONDARY_BUS);
+    h->sub_bus = pci_read_byte(h->parent->dev, PCI_SUBORDINATE_BUS);
+    h->d.dev = up->dev;
+    if (eep_hw_map(&h->d) && h->d.bar0_size > bar0_max)
+      bar0_max = h->d.bar0_size;
+  }
+  rec.bar0 = bar0_max ? xmalloc(bar0_max) : NULL;
+
+  for (p = a->devices; p; p = p->next)
+    rec.max_snaps++;
+  rec.max_snaps++;			/* The parent port */
+  rec.snaps = xmalloc(rec.max_snaps * sizeof(*rec.snaps));
+
+  rec.ring_size = rec.nports * (opt->window_ms / opt->interval_ms + 1);
+  rec.ring = xmalloc(rec.ring_size * sizeof(*rec.ring));
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = rec_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  printf("Recording %d H1A device(s) every %u ms, keeping %u ms (Ctrl-C to stop)\n",
+         count, opt->interval_ms, opt->window_ms);
+  fflush(stdout);
+
+  next = monotonic_ns();
+  while (!rec_stop) {
+    for (int i = 0; i < rec.nports; i++) {
+      struct rec_port *port = &rec.ports[i];
+      struct rec_sample s;
+      const char *reason;
+
+      rec_sample_port(port, &s, monotonic_ns());
+      rec_ring_push(&s);
+      reason = rec_trigger(port, &s);
+      port->last = s;
+      port->sampled = true;
+      if (reason) {
+        int n = rec_capture_state(port->h1a);
+        rec_write_bundle(port->h1a, reason, s.ns, monotonic_ns() - s.ns, n);
+        rec.captures++;
+      }
+    }
+    /* Do not try to catch up on samples missed while writing a bundle */
+    next += (u64)opt->interval_ms * 1000000;
+    if (next < monotonic_ns())
+      next = monotonic_ns();
+    sleep_until(next);
+  }
+
+  printf("\nRecorder stopped, %u capture(s)\n", rec.captures);
+  rec_cleanup();
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,100 @@
+/*
+ *	H1A EEPROM Tool -- Register Field Descriptions
+ *
+ *	Copyright (c) 2023 Adnacom, Inc.
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+#ifndef __REGS_H__
+#define __REGS_H__
+
+#include <stdint.h>
+
+#include "../lib/header.h"
+#include "eep.h"
+
+/*
+ * One line per register field: name, register offset, shift and width.
+ * Offsets of the PEX8608 registers are BAR0 offsets, the others are
+ * relative to the capability (or header) that holds them.
+ *
+ * For every field the table expands to the constants <name>_reg,
+ * <name>_shift and <name>_width, and to the inline accessors
+ * <name>_get(v) (extract) and <name>_val(x) (place into a register word).
+ * REG_MASK()/REG_VAL() give the same results as constant expressions, so
+ * command words can be written as a plain OR of fields.
+ */
+#define REG_FIELDS(F) \
+  /* Serial EEPROM Status and Control (260h) */ \
+  F(eep_blk_addr,           EEP_STAT_N_CTRL_ADDR,  0, 13) \
+  F(eep_cmd,                EEP_STAT_N_CTRL_ADDR, 13,  3) \
+  F(eep_prsnt,              EEP_STAT_N_CTRL_ADDR, 16,  2) \
+  F(eep_cmd_status,         EEP_STAT_N_CTRL_ADDR, 18,  1) \
+  F(eep_blk_addr_upper,     EEP_STAT_N_CTRL_ADDR, 20,  1) \
+  F(eep_addr_width_override, EEP_STAT_N_CTRL_ADDR, 21, 1) \
+  F(eep_addr_width,         EEP_STAT_N_CTRL_ADDR, 22,  2) \
+  F(eep_ready,              EEP_STAT_N_CTRL_ADDR, 24,  1) \
+  F(eep_wr_enable,          EEP_STAT_N_CTRL_ADDR, 25,  1) \
+  F(eep_blk_wr_protect,     EEP_STAT_N_CTRL_ADDR, 26,  2) \
+  F(eep_wr_status,          EEP_STAT_N_CTRL_ADDR, 28,  3) \
+  F(eep_wr_protect_en,      EEP_STAT_N_CTRL_ADDR, 31,  1) \
+  /* Power Management Control/Status (PM capability + 4) */ \
+  F(pmcsr_state,            PCI_PM_CTRL,           0,  2) \
+  F(pmcsr_no_soft_reset,    PCI_PM_CTRL,           3,  1) \
+  F(pmcsr_pme_enable,       PCI_PM_CTRL,           8,  1) \
+  F(pmcsr_pme_status,       PCI_PM_CTRL,          15,  1) \
+  /* Bridge Control (3Eh, type 1 header) */ \
+  F(brctl_parity,           PCI_BRIDGE_CONTROL,    0,  1) \
+  F(brctl_serr,             PCI_BRIDGE_CONTROL,    1,  1) \
+  F(brctl_isa,              PCI_BRIDGE_CONTROL,    2,  1) \
+  F(brctl_vga,              PCI_BRIDGE_CONTROL,    3,  1) \
+  F(brctl_vga16,            PCI_BRIDGE_CONTROL,    4,  1) \
+  F(brctl_master_abort,     PCI_BRIDGE_CONTROL,    5,  1) \
+  F(brctl_sec_reset,        PCI_BRIDGE_CONTROL,    6,  1) \
+  /* Link Status (PCIe capability + 12h) */ \
+  F(lnksta_speed,           PCI_EXP_LNKSTA,        0,  4) \
+  F(lnksta_width,           PCI_EXP_LNKSTA,        4,  6) \
+  F(lnksta_train,           PCI_EXP_LNKSTA,       11,  1) \
+  F(lnksta_slot_clk,        PCI_EXP_LNKSTA,       12,  1) \
+  F(lnksta_dl_active,       PCI_EXP_LNKSTA,       13,  1) \
+  F(lnksta_bw_mgmt,         PCI_EXP_LNKSTA,       14,  1) \
+  F(lnksta_auto_bw,         PCI_EXP_LNKSTA,       15,  1)
+
+#define REG_FIELD_CONSTS(name, reg, shift, width) \
+  name##_reg = (reg), name##_shift = (shift), name##_width = (width),
+
+enum reg_fields {
+  REG_FIELDS(REG_FIELD_CONSTS)
+};
+
+#define REG_MASK(name) \
+  ((uint32_t)(((1ULL << name##_width) - 1) << name##_shift))
+#define REG_VAL(name, x) \
+  (((uint32_t)(x) << name##_shift) & REG_MASK(name))
+#define REG_GET(name, v) \
+  (((uint32_t)(v) & REG_MASK(name)) >> name##_shift)
+
+#define REG_FIELD_ACCESSORS(name, reg, shift, width) \
+  static inline uint32_t name##_get(uint32_t v) { return REG_GET(name, v); } \
+  static inline uint32_t name##_val(uint32_t x) { return REG_VAL(name, x); }
+
+REG_FIELDS(REG_FIELD_ACCESSORS)
+
+/* EEPROM controller command word; the block address spills into bit 20 */
+#define EEP_COMMAND(cmd, addr) \
+  (REG_VAL(eep_cmd, (cmd)) | \
+   REG_VAL(eep_blk_addr, (addr)) | \
+   REG_VAL(eep_blk_addr_upper, (uint32_t)(addr) >> eep_blk_addr_width))
+
+/* Commands that (re)program the address width use a two byte address */
+#define EEP_COMMAND_WIDTH(cmd) \
+  (REG_VAL(eep_cmd, (cmd)) | \
+   REG_MASK(eep_addr_width_override) | \
+   REG_VAL(eep_addr_width, TWO_BYTES))
+
+static inline uint32_t eep_cmd_addr(uint32_t cmd)
+{
+  return eep_blk_addr_get(cmd) | (eep_blk_addr_upper_get(cmd) << eep_blk_addr_width);
+}
+
+#endif /* __REGS_H__ */
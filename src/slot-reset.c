@@ -0,0 +1,152 @@
+/*
+ *	H1A EEPROM Tool -- Slot Power Cycle Reset
+ *
+ *	Copyright (c) 2023 Adnacom, Inc.
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "adna.h"
+
+/*
+ * Resets whatever sits in the slot below a port by switching the slot
+ * power off and on through Slot Control, the way pciehp does it. Instead
+ * of fixed sleeps every step polls for what it waits for: Command Completed
+ * after each Slot Control write, Link Active going away after power off,
+ * then Presence Detect and Link Active after power on. A port that cannot
+ * report Link Active gets the whole link timeout instead. Only the second
+ * after power off that the card needs to discharge is a plain wait. The
+ * hotplug interrupt is masked for the duration, so a pciehp driver owning
+ * the slot does not take the cycle for a surprise removal, and the
+ * Presence Detect and DLL State Changed events it caused are cleared
+ * before it is unmasked. Ports whose slot has no power controller are left
+ * alone and the caller resets through the bridge instead.
+ */
+
+#define SLOT_CMD_TIMEOUT     1000		/* ms, Command Completed */
+#define SLOT_LINK_TIMEOUT    1000		/* ms, link down or up */
+#define SLOT_PRESENT_TIMEOUT 1000		/* ms, Presence Detect after power on */
+#define SLOT_OFF_HOLD        1000		/* ms, power off before power on, as pciehp */
+#define SLOT_LINK_SETTLE     100		/* ms, link up to first config request */
+
+#define SLOT_PWRI_ON         0x0100
+#define SLOT_PWRI_OFF        0x0300
+#define SLOT_EVENTS          (PCI_EXP_SLTSTA_PWRF | PCI_EXP_SLTSTA_MRLS | PCI_EXP_SLTSTA_PRSD | \
+                              PCI_EXP_SLTSTA_CMDC | PCI_EXP_SLTSTA_LLCHG)
+
+static void slot_sleep_ms(unsigned int ms)
+{
+  struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+
+  nanosleep(&ts, NULL);
+}
+
+/* Poll a register until (value & mask) == want, false on timeout */
+static bool slot_wait(struct pci_dev *p, int reg, u16 mask, u16 want, unsigned int timeout_ms)
+{
+  u64 end = monotonic_ns() + timeout_ms * 1000000ULL;
+
+  for (;;) {
+    if ((pci_read_word(p, reg) & mask) == want)
+      return true;
+    if (monotonic_ns() >= end)
+      return false;
+    slot_sleep_ms(1);
+  }
+}
+
+static bool slot_command(struct pci_dev *p, int exp, u32 sltcap, u16 ctl)
+{
+  pci_write_word(p, exp + PCI_EXP_SLTCTL, ctl);
+  if (sltcap & PCI_EXP_SLTCAP_NOCMDCOMP)
+    return true;
+  if (!slot_wait(p, exp + PCI_EXP_SLTSTA, PCI_EXP_SLTSTA_CMDC, PCI_EXP_SLTSTA_CMDC, SLOT_CMD_TIMEOUT))
+    return false;
+  pci_write_word(p, exp + PCI_EXP_SLTSTA, PCI_EXP_SLTSTA_CMDC);
+  return true;
+}
+
+/* Link up as the port can report it, a plain wait if it cannot */
+static bool slot_link_up(struct pci_dev *p, int exp, u32 lnkcap)
+{
+  if (lnkcap & PCI_EXP_LNKCAP_DLLA)
+    return slot_wait(p, exp + PCI_EXP_LNKSTA, PCI_EXP_LNKSTA_DL_ACT, PCI_EXP_LNKSTA_DL_ACT,
+                     SLOT_LINK_TIMEOUT);
+  slot_sleep_ms(SLOT_LINK_TIMEOUT);
+  return true;
+}
+
+int slot_power_cycle(struct pci_dev *p, struct slot_timing *t)
+{
+  struct pci_cap *cap;
+  u32 sltcap, lnkcap;
+  u16 ctl, run;
+  u64 start = monotonic_ns(), t0 = start;
+  int exp, status = EXIT_FAILURE;
+
+  memset(t, 0, sizeof(*t));
+  pci_fill_info(p, PCI_FILL_CAPS);
+  cap = pci_find_cap(p, PCI_CAP_ID_EXP, PCI_CAP_NORMAL);
+  if (!cap || !(pci_read_word(p, cap->addr + PCI_EXP_FLAGS) & PCI_EXP_FLAGS_SLOT))
+    return SLOT_NO_POWER;
+  exp = cap->addr;
+  sltcap = pci_read_long(p, exp + PCI_EXP_SLTCAP);
+  if (!(sltcap & PCI_EXP_SLTCAP_PWRC))
+    return SLOT_NO_POWER;
+  lnkcap = pci_read_long(p, exp + PCI_EXP_LNKCAP);
+
+  ctl = pci_read_word(p, exp + PCI_EXP_SLTCTL);
+  run = ctl & ~(PCI_EXP_SLTCTL_HPIE | PCI_EXP_SLTCTL_CMDC);
+  pci_write_word(p, exp + PCI_EXP_SLTSTA, SLOT_EVENTS);
+
+  /* Power off */
+  run |= PCI_EXP_SLTCTL_PWRC;
+  if (sltcap & PCI_EXP_SLTCAP_PWRI)
+    run = (run & ~PCI_EXP_SLTCTL_PWRI) | SLOT_PWRI_OFF;
+  if (!slot_command(p, exp, sltcap, run)) {
+    printf("ERROR: Slot did not complete the power off command\n");
+    goto restore;
+  }
+  if ((lnkcap & PCI_EXP_LNKCAP_DLLA) &&
+      !slot_wait(p, exp + PCI_EXP_LNKSTA, PCI_EXP_LNKSTA_DL_ACT, 0, SLOT_LINK_TIMEOUT)) {
+    printf("ERROR: Link stayed up with the slot powered off\n");
+    goto restore;
+  }
+  t->off_ns = monotonic_ns() - t0;
+  slot_sleep_ms(SLOT_OFF_HOLD);
+
+  /* Power on */
+  t0 = monotonic_ns();
+  run &= ~PCI_EXP_SLTCTL_PWRC;
+  if (sltcap & PCI_EXP_SLTCAP_PWRI)
+    run = (run & ~PCI_EXP_SLTCTL_PWRI) | SLOT_PWRI_ON;
+  if (!slot_command(p, exp, sltcap, run)) {
+    printf("ERROR: Slot did not complete the power on command\n");
+    goto restore;
+  }
+  if (!slot_wait(p, exp + PCI_EXP_SLTSTA, PCI_EXP_SLTSTA_PRES, PCI_EXP_SLTSTA_PRES,
+                 SLOT_PRESENT_TIMEOUT)) {
+    printf("ERROR: No card present in the slot after power on\n");
+    goto restore;
+  }
+  t->present_ns = monotonic_ns() - t0;
+  if (!slot_link_up(p, exp, lnkcap)) {
+    printf("ERROR: Link did not come up after power on\n");
+    goto restore;
+  }
+  t->link_ns = monotonic_ns() - t0;
+  slot_sleep_ms(SLOT_LINK_SETTLE);
+  status = EXIT_SUCCESS;
+
+restore:
+  /* Power back as it was, the interrupt given back without our events */
+  pci_write_word(p, exp + PCI_EXP_SLTSTA, SLOT_EVENTS);
+  pci_write_word(p, exp + PCI_EXP_SLTCTL, ctl);
+  t->total_ns = monotonic_ns() - start;
+  return status;
+}
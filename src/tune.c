@@ -0,0 +1,392 @@
+/*
+ *	H1A EEPROM Tool -- PCI Express Tuning Profiles
+ *
+ *	Copyright (c) 2023 Adnacom, Inc.
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "adna.h"
+
+/*
+ * Applies one set of Device Control and Link Control settings to every
+ * function below the root port of each H1A: the root port itself, any
+ * switch in between, the H1A ports and the endpoints behind them. Max
+ * Payload Size has to agree within the hierarchy of one root port, so it
+ * is the largest value supported by all functions below that port; other
+ * root ports keep their own. The new values are computed for all functions
+ * first, the old ones are written to a rollback file, and only then are
+ * the changed registers written in one pass and read back. An existing
+ * rollback file is never replaced unless forced, since a second run would
+ * save its own settings over the original ones; a complete rollback
+ * deletes the file.
+ *
+ * Changing MPS under traffic is not safe; run this with the link idle.
+ */
+
+struct tune_profile {
+  const char *name;
+  const char *desc;
+  int aspm;				/* -1 to enable what both link ends support */
+  int mrrs;				/* Max Read Request in bytes, 0 for the MPS */
+  bool ext_tag, relaxed, nosnoop;
+};
+
+static const struct tune_profile tune_profiles[] = {
+  { "latency",    "ASPM off, read requests of one payload",          0,    0, true,  true,  false },
+  { "throughput", "ASPM off, 4 KB read requests, no snoop allowed",  0, 4096, true,  true,  true  },
+  { "power",      "ASPM L0s/L1 where supported, 512 B read requests", -1, 512, false, true,  false },
+  { NULL, NULL, 0, 0, false, false, false }
+};
+
+struct tune_dev {
+  struct pci_dev *dev;
+  int exp;				/* PCI Express capability */
+  int type;				/* Device/port type */
+  struct tune_dev *up;			/* Port above, NULL for the root port */
+  int hierarchy;			/* Index of the root port above */
+  u16 devctl, lnkctl;			/* Current */
+  u16 new_devctl, new_lnkctl;		/* Planned */
+};
+
+static const struct tune_profile *tune_find(const char *name)
+{
+  for (const struct tune_profile *p = tune_profiles; p->name; p++)
+    if (!strcasecmp(p->name, name))
+      return p;
+  return NULL;
+}
+
+static void tune_list_profiles(void)
+{
+  printf("Known profiles:\n");
+  for (const struct tune_profile *p = tune_profiles; p->name; p++)
+    printf("  %-12s %s\n", p->name, p->desc);
+}
+
+static bool tune_is_bridge(struct pci_dev *d)
+{
+  return (pci_read_byte(d, PCI_HEADER_TYPE) & 0x7f) == PCI_HEADER_TYPE_BRIDGE;
+}
+
+/* Bridge whose secondary bus is the bus of d */
+static struct pci_dev *tune_bridge_above(struct pci_access *a, struct pci_dev *d)
+{
+  for (struct pci_dev *p = a->devices; p; p = p->next)
+    if (p->domain == d->domain && tune_is_bridge(p) &&
+        pci_read_byte(p, PCI_SECONDARY_BUS) == d->bus)
+      return p;
+  return NULL;
+}
+
+static struct tune_dev *tune_lookup(struct tune_dev *devs, int n, struct pci_dev *d)
+{
+  for (int i = 0; i < n; i++)
+    if (devs[i].dev == d)
+      return &devs[i];
+  return NULL;
+}
+
+/* Bus order, so a port always comes before the devices below it */
+static int tune_compare(const void *A, const void *B)
+{
+  const struct pci_dev *a = ((const struct tune_dev *)A)->dev;
+  const struct pci_dev *b = ((const struct tune_dev *)B)->dev;
+
+  if (a->domain != b->domain)
+    return (a->domain < b->domain) ? -1 : 1;
+  if (a->bus != b->bus)
+    return (a->bus < b->bus) ? -1 : 1;
+  if (a->dev != b->dev)
+    return (a->dev < b->dev) ? -1 : 1;
+  return (a->func < b->func) ? -1 : (a->func > b->func);
+}
+
+/* Add the root port above f and every PCIe function below it, once */
+static int tune_collect(struct pci_access *a, struct pci_filter *f,
+                        struct tune_dev *devs, int n, int max)
+{
+  struct pci_dev *d = pci_get_dev(a, f->domain, f->bus, f->slot, f->func);
+  struct pci_dev *root = NULL, *p;
+  int sec, sub, first = n, hierarchy = n ? devs[n - 1].hierarchy + 1 : 0;
+
+  for (p = tune_bridge_above(a, d); p; p = tune_bridge_above(a, p)) {
+    int exp = pcie_cap(p);
+
+    root = p;
+    if (exp && ((pci_read_word(p, exp + PCI_EXP_FLAGS) & PCI_EXP_FLAGS_TYPE) >> 4) == PCI_EXP_TYPE_ROOT_PORT)
+      break;
+  }
+  pci_free_dev(d);
+  if (!root)
+    return n;
+  if (tune_lookup(devs, n, root))
+    return n;				/* Another H1A under the same root port */
+
+  sec = pci_read_byte(root, PCI_SECONDARY_BUS);
+  sub = pci_read_byte(root, PCI_SUBORDINATE_BUS);
+  for (p = a->devices; p && n < max; p = p->next) {
+    struct tune_dev *t = &devs[n];
+    int exp;
+
+    if (p != root && (p->domain != root->domain || p->bus < sec || p->bus > sub))
+      continue;
+    if (!(exp = pcie_cap(p)))
+      continue;				/* Conventional PCI, nothing to tune */
+    memset(t, 0, sizeof(*t));
+    t->dev = p;
+    t->exp = exp;
+    t->hierarchy = hierarchy;
+    t->type = (pci_read_word(p, exp + PCI_EXP_FLAGS) & PCI_EXP_FLAGS_TYPE) >> 4;
+    t->devctl = t->new_devctl = pci_read_word(p, exp + PCI_EXP_DEVCTL);
+    t->lnkctl = t->new_lnkctl = pci_read_word(p, exp + PCI_EXP_LNKCTL);
+    n++;
+  }
+  qsort(devs + first, n - first, sizeof(*devs), tune_compare);
+  for (int i = first; i < n; i++)
+    if (devs[i].dev != root)
+      devs[i].up = tune_lookup(devs + first, n - first, tune_bridge_above(a, devs[i].dev));
+  return n;
+}
+
+static int tune_log2_size(int bytes)
+{
+  int code = 0;
+
+  while ((128 << code) < bytes && code < 5)
+    code++;
+  return code;
+}
+
+/* Largest payload every function below the same root port supports */
+static int tune_mps(const struct tune_dev *devs, int n, int hierarchy)
+{
+  int mps = 5;
+
+  for (int i = 0; i < n; i++) {
+    int cap = pci_read_long(devs[i].dev, devs[i].exp + PCI_EXP_DEVCAP) & PCI_EXP_DEVCAP_PAYLOAD;
+    if (devs[i].hierarchy == hierarchy && cap < mps)
+      mps = cap;
+  }
+  return mps;
+}
+
+static void tune_plan(const struct tune_profile *prof, struct tune_dev *devs, int n)
+{
+  int mps = 0, mrrs = 0;
+
+  for (int i = 0; i < n; i++) {
+    struct tune_dev *t = &devs[i];
+    u32 devcap = pci_read_long(t->dev, t->exp + PCI_EXP_DEVCAP);
+    u16 v = t->devctl;
+
+    if (!i || t->hierarchy != devs[i - 1].hierarchy) {
+      mps = tune_mps(devs, n, t->hierarchy);
+      mrrs = prof->mrrs ? tune_log2_size(prof->mrrs) : mps;
+    }
+
+    v &= ~(PCI_EXP_DEVCTL_PAYLOAD | PCI_EXP_DEVCTL_READRQ | PCI_EXP_DEVCTL_EXT_TAG |
+           PCI_EXP_DEVCTL_RELAXED | PCI_EXP_DEVCTL_NOSNOOP);
+    v |= mps << 5 | mrrs << 12;
+    if (prof->ext_tag && (devcap & PCI_EXP_DEVCAP_EXT_TAG))
+      v |= PCI_EXP_DEVCTL_EXT_TAG;
+    if (prof->relaxed)
+      v |= PCI_EXP_DEVCTL_RELAXED;
+    if (prof->nosnoop)
+      v |= PCI_EXP_DEVCTL_NOSNOOP;
+    t->new_devctl = v;
+    t->new_lnkctl = t->lnkctl & ~PCI_EXP_LNKCTL_ASPM;
+  }
+
+  /* ASPM per link: what both ends support, set the same on both */
+  if (prof->aspm < 0)
+    for (int i = 0; i < n; i++) {
+      struct tune_dev *t = &devs[i];
+      int aspm;
+
+      if (!t->up)
+        continue;
+      aspm = (pci_read_long(t->dev, t->exp + PCI_EXP_LNKCAP) &
+              pci_read_long(t->up->dev, t->up->exp + PCI_EXP_LNKCAP) & PCI_EXP_LNKCAP_ASPM) >> 10;
+      /* A switch has one link above its upstream port only */
+      if (t->up->type == PCI_EXP_TYPE_UPSTREAM)
+        continue;
+      t->new_lnkctl |= aspm;
+      t->up->new_lnkctl |= aspm;
+    }
+}
+
+static int tune_save(const char *name, const struct tune_dev *devs, int n, bool force)
+{
+  FILE *f = rollback_create(name, "tuning", "--tune-rollback", force);
+
+  if (!f)
+    return -1;
+  for (int i = 0; i < n; i++) {
+    const struct tune_dev *t = &devs[i];
+    int reg[2] = { t->exp + PCI_EXP_DEVCTL, t->exp + PCI_EXP_LNKCTL };
+    u16 val[2] = { t->devctl, t->lnkctl };
+
+    rollback_entry(f, t->dev, 2, reg, val);
+  }
+  return rollback_close(f, name);
+}
+
+/*
+ * Write the planned values, skipping registers that already hold them.
+ * ASPM is turned off from the bottom up and turned on from the top down,
+ * so a link never has it enabled at the downstream end only; devs[] is in
+ * bus order, root port first.
+ */
+static inline u16 tune_lnkctl_off(const struct tune_dev *t)
+{
+  return t->lnkctl & (t->new_lnkctl | ~PCI_EXP_LNKCTL_ASPM);
+}
+
+static int tune_write(struct tune_dev *devs, int n)
+{
+  int writes = 0;
+
+  for (int i = n - 1; i >= 0; i--) {
+    struct tune_dev *t = &devs[i];
+    if (tune_lnkctl_off(t) != t->lnkctl) {
+      pci_write_word(t->dev, t->exp + PCI_EXP_LNKCTL, tune_lnkctl_off(t));
+      writes++;
+    }
+  }
+  for (int i = 0; i < n; i++) {
+    struct tune_dev *t = &devs[i];
+    if (t->new_devctl != t->devctl) {
+      pci_write_word(t->dev, t->exp + PCI_EXP_DEVCTL, t->new_devctl);
+      writes++;
+    }
+    if (t->new_lnkctl != tune_lnkctl_off(t)) {
+      pci_write_word(t->dev, t->exp + PCI_EXP_LNKCTL, t->new_lnkctl);
+      writes++;
+    }
+  }
+  return writes;
+}
+
+static const char *tune_types[] = {
+  "Endpoint", "Legacy", "?", "?", "Root Port", "Upstream", "Downstream",
+  "PCIe-PCI", "PCI-PCIe", "RC Endpt", "RC EvtCol"
+};
+
+static const char *tune_aspm_name(int aspm)
+{
+  static const char *names[] = { "off", "L0s", "L1", "L0s L1" };
+  return names[aspm & 3];
+}
+
+/* Read everything back and report, returns the number of mismatches */
+static int tune_verify(const struct tune_dev *devs, int n)
+{
+  int bad = 0;
+
+  printf("%-13s %-10s %5s %5s %-7s %-6s %-3s %-3s\n",
+         "Device", "Type", "MPS", "MRRS", "ASPM", "ExtTag", "RO", "NS");
+  for (int i = 0; i < n; i++) {
+    const struct tune_dev *t = &devs[i];
+    u16 devctl = pci_read_word(t->dev, t->exp + PCI_EXP_DEVCTL);
+    u16 lnkctl = pci_read_word(t->dev, t->exp + PCI_EXP_LNKCTL);
+    bool ok = devctl == t->new_devctl &&
+              (lnkctl & PCI_EXP_LNKCTL_ASPM) == (t->new_lnkctl & PCI_EXP_LNKCTL_ASPM);
+    printf("%04x:%02x:%02x.%d  %-10s %5d %5d %-7s %-6s %-3s %-3s%s\n",
+           t->dev->domain, t->dev->bus, t->dev->dev, t->dev->func,
+           t->type < (int)(sizeof(tune_types) / sizeof(*tune_types)) ? tune_types[t->type] : "?",
+           128 << ((devctl & PCI_EXP_DEVCTL_PAYLOAD) >> 5),
+           128 << ((devctl & PCI_EXP_DEVCTL_READRQ) >> 12),
+           tune_aspm_name(lnkctl),
+           (devctl & PCI_EXP_DEVCTL_EXT_TAG) ? "on" : "off",
+           (devctl & PCI_EXP_DEVCTL_RELAXED) ? "on" : "off",
+           (devctl & PCI_EXP_DEVCTL_NOSNOOP) ? "on" : "off",
+           ok ? "" : "  MISMATCH");
+    if (!ok)
+      bad++;
+  }
+  return bad;
+}
+
+int tune_apply(struct pci_access *a, struct pci_filter **h1a, int count,
+               const char *profile, const char *rollback, bool force)
+{
+  const struct tune_profile *prof = tune_find(profile);
+  struct tune_dev *devs;
+  struct pci_dev *p;
+  int n = 0, max = 0, writes, bad, status = EXIT_FAILURE;
+
+  if (!prof) {
+    printf("ERROR: Unknown tuning profile \"%s\"\n", profile);
+    tune_list_profiles();
+    return EXIT_FAILURE;
+  }
+
+  pci_scan_bus(a);
+  for (p = a->devices; p; p = p->next)
+    max++;
+  devs = xmalloc((max ? max : 1) * sizeof(*devs));
+  for (int i = 0; i < count; i++)
+    n = tune_collect(a, h1a[i], devs, n, max);
+  if (!n) {
+    printf("ERROR: No PCI Express root port found above the H1A device(s)\n");
+    goto out;
+  }
+
+  tune_plan(prof, devs, n);
+  if (tune_save(rollback, devs, n, force))
+    goto out;
+
+  printf("Apply profile \"%s\" to %d function(s), previous settings saved to %s\n",
+         prof->name, n, rollback);
+  writes = tune_write(devs, n);
+  bad = tune_verify(devs, n);
+  printf("%d register write(s), %s\n", writes,
+         bad ? "some settings did not take effect" : "all settings verified");
+  status = bad ? EXIT_FAILURE : EXIT_SUCCESS;
+out:
+  free(devs);
+  return status;
+}
+
+int tune_rollback(struct pci_access *a, const char *name)
+{
+  FILE *f = fopen(name, "r");
+  struct rollback_line l;
+  int lineno = 0, restored = 0, status = EXIT_SUCCESS, r;
+
+  if (!f) {
+    printf("ERROR: Unable to open \"%s\" (%s)\n", name, strerror(errno));
+    return EXIT_FAILURE;
+  }
+  pci_scan_bus(a);
+  while ((r = rollback_read(f, name, &lineno, 2, a, &l))) {
+    char dev[16];
+
+    if (r < 0) {
+      status = EXIT_FAILURE;
+      continue;
+    }
+    pci_write_word(l.dev, l.reg[0], l.val[0]);
+    pci_write_word(l.dev, l.reg[1], l.val[1]);
+    if (pci_read_word(l.dev, l.reg[0]) != l.val[0] ||
+        (pci_read_word(l.dev, l.reg[1]) & PCI_EXP_LNKCTL_ASPM) != (l.val[1] & PCI_EXP_LNKCTL_ASPM)) {
+      pcie_name(dev, sizeof(dev), l.dev);
+      printf("ERROR: %s did not take the saved values\n", dev);
+      status = EXIT_FAILURE;
+    } else
+      restored++;
+    pci_free_dev(l.dev);
+  }
+  fclose(f);
+  printf("Restored %d function(s) from %s\n", restored, name);
+  if (status == EXIT_SUCCESS)
+    rollback_remove(name);
+  return status;
+}
@@ -0,0 +1,86 @@
+/*
+ *	H1A EEPROM Tool -- Kernel Hotplug Event Listener
+ *
+ *	Copyright (c) 2023 Adnacom, Inc.
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "adna.h"
+
+#ifdef PCI_OS_LINUX
+
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#define UEVENT_BUF_SIZE 8192
+
+int uevent_open(void)
+{
+  struct sockaddr_nl addr;
+  int fd;
+
+  fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+  if (fd < 0)
+    return -1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+  addr.nl_pid = 0;
+  addr.nl_groups = 1;		/* Kernel events */
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Returns 1 for a PCI event, 0 for anything else and -1 on error */
+int uevent_recv(int fd, struct uevent *ev)
+{
+  char buf[UEVENT_BUF_SIZE];
+  ssize_t len;
+  char *p, *end;
+
+  len = recv(fd, buf, sizeof(buf) - 1, 0);
+  if (len <= 0)
+    return -1;
+  buf[len] = 0;
+  end = buf + len;
+
+  memset(ev, 0, sizeof(*ev));
+  /* The header is "action@devpath", followed by KEY=VALUE strings */
+  for (p = buf + strlen(buf) + 1; p < end; p += strlen(p) + 1) {
+    if (!strncmp(p, "ACTION=", 7))
+      snprintf(ev->action, sizeof(ev->action), "%s", p + 7);
+    else if (!strncmp(p, "SUBSYSTEM=", 10))
+      snprintf(ev->subsystem, sizeof(ev->subsystem), "%s", p + 10);
+    else if (!strncmp(p, "PCI_SLOT_NAME=", 14))
+      snprintf(ev->slot, sizeof(ev->slot), "%s", p + 14);
+    else if (!strncmp(p, "PCI_ID=", 7))
+      sscanf(p + 7, "%x:%x", &ev->vendor, &ev->device);
+  }
+
+  return !strcmp(ev->subsystem, "pci") && ev->slot[0];
+}
+
+#else
+
+int uevent_open(void)
+{
+  errno = ENOSYS;
+  return -1;
+}
+
+int uevent_recv(int fd UNUSED, struct uevent *ev UNUSED)
+{
+  return -1;
+}
+
+#endif